@@ -4,47 +4,342 @@
 #include <string>
 #include <fstream>
 #include <unordered_map>
+#include <unordered_set>
+#include <map>
 #include <random>
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <climits>
+#include <cmath>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <array>
+#include <string_view>
+#include <atomic>
+#include <functional>
+#include <deque>
+#include <coroutine>
+#include <cstddef>
+#include <utility>
+#include <tuple>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
 
 #define SCREEN_WIDTH 1024
 #define SCREEN_HEIGHT 512
 
-std::mt19937 rng(std::random_device{}());  // 乱数エンジン（使い回す）
-
-bool random_with_probability(double p) {
-    std::uniform_real_distribution<double> dist(0.0, 1.0);
-    return dist(rng) < p;
-}
-
 //frame
 const int FPS = 60;
 const int frameDeray = 1000 / FPS;
-Uint32 frameStart;
-int frameTime;
+const int RESTART_DELAY_TICKS = FPS;  //やられてからやり直すまで
 
 //Stage
 const float Gravity = 0.5f;
-int cameraX = 0;
-int cameraY = 0;
-
-//確率
-bool p_30 = random_with_probability(0.30);
-bool p_25 = random_with_probability(0.25);
-bool p_10 = random_with_probability(0.10);
-bool p_5 = random_with_probability(0.05);
-bool p_1 = random_with_probability(0.01);
-int probability_frame_counter = 0;
-
-void refresh_probabilities_each_second(){
-    if(probability_frame_counter % FPS == 0){
+
+//前方宣言
+class Fireball;
+class Fire;
+class GameObject;
+
+//時間切れを知らせてほしいものが持つ節（時間切れになるとowner->on_timer(code)が呼ばれる。ownerがnullptrなら世界そのもの）
+//複製は繋がっていない状態で作られ、dueとpendingだけ引き継ぐ（World::restoreで繋ぎ直す）
+struct TimerNode{
+    TimerNode* prev = nullptr;
+    TimerNode* next = nullptr;
+    GameObject* owner = nullptr;
+    int code = 0;
+    Uint64 due = 0;        //時間切れになるシミュレーションのtick
+    bool pending = false;  //まだ時間切れになっていない
+
+    TimerNode() = default;
+    TimerNode(const TimerNode& o) : code(o.code),due(o.due),pending(o.pending){}
+    TimerNode& operator=(const TimerNode& o){
+        unlink();
+        code = o.code;
+        due = o.due;
+        pending = o.pending;
+        return *this;
+    }
+    ~TimerNode(){ unlink(); }
+    void unlink(){
+        if(!prev) return;
+        prev->next = next;
+        next->prev = prev;
+        prev = next = nullptr;
+    }
+    void cancel(){
+        unlink();
+        pending = false;
+    }
+};
+
+//シミュレーションのtick（1フレーム=1tick）で動く階層タイマーホイール
+//64スロット×4段。1tick進めるのに調べるのは1スロットだけなので、手間は時間切れになった数で決まる
+class TimerWheel{
+    public:
+        static constexpr int SLOT_BITS = 6;
+        static constexpr int SLOTS = 1 << SLOT_BITS;
+        static constexpr int LEVELS = 4;
+        static constexpr Uint64 MAX_DELAY = (Uint64(1) << (SLOT_BITS * LEVELS)) - 1;
+        Uint64 now = 0;  //処理済みのtick
+
+        TimerWheel(){
+            for(auto& level : heads){
+                for(TimerNode& h : level) h.prev = h.next = &h;
+            }
+        }
+        //写しは時刻だけ（繋がっている節はそれぞれの持ち主が繋ぎ直す）
+        TimerWheel(const TimerWheel& o) : TimerWheel(){ now = o.now; }
+        TimerWheel& operator=(const TimerWheel& o){
+            if(this != &o){
+                clear();
+                now = o.now;
+            }
+            return *this;
+        }
+        ~TimerWheel(){ clear(); }
+
+        //delay tick後に時間切れにする（もう登録されていれば付け替える）
+        void arm(TimerNode& node,GameObject* owner,int code,Uint64 delay){
+            node.unlink();
+            node.owner = owner;
+            node.code = code;
+            node.due = now + std::min(std::max<Uint64>(delay,1),MAX_DELAY);
+            node.pending = true;
+            link(node);
+        }
+        //複製から戻した節を、同じ時刻のまま繋ぎ直す
+        void relink(TimerNode& node,GameObject* owner){
+            node.unlink();
+            node.owner = owner;
+            if(!node.pending) return;
+            if(node.due <= now) node.due = now + 1;
+            link(node);
+        }
+        //tickまで進め、時間切れになった節ごとにfire(node)を呼ぶ（fireの中で登録し直してよい）
+        template<class Fn>
+        void advance(Uint64 tick,Fn fire){
+            while(now < tick){
+                now++;
+                int index = (int)(now & (SLOTS - 1));
+                //下の段が一周したら上の段の1スロットを下ろす
+                for(int level = 1; index == 0 && level < LEVELS; level++){
+                    index = (int)((now >> (SLOT_BITS * level)) & (SLOTS - 1));
+                    TimerNode& head = heads[level][index];
+                    while(head.next != &head){
+                        TimerNode* n = head.next;
+                        n->unlink();
+                        link(*n);
+                    }
+                }
+                TimerNode& head = heads[0][now & (SLOTS - 1)];
+                while(head.next != &head){
+                    TimerNode* n = head.next;
+                    n->unlink();
+                    n->pending = false;
+                    fire(*n);
+                }
+            }
+        }
+    private:
+        TimerNode heads[LEVELS][SLOTS];
+
+        void link(TimerNode& node){
+            Uint64 delta = node.due - now;
+            int level = 0;
+            while(level < LEVELS - 1 && delta >= (Uint64(1) << (SLOT_BITS * (level + 1)))) level++;
+            TimerNode& head = heads[level][(node.due >> (SLOT_BITS * level)) & (SLOTS - 1)];
+            node.prev = head.prev;
+            node.next = &head;
+            head.prev->next = &node;
+            head.prev = &node;
+        }
+        //全部の節を外す（pendingはそのまま）
+        void clear(){
+            for(auto& level : heads){
+                for(TimerNode& h : level){
+                    while(h.next != &h) h.next->unlink();
+                }
+            }
+        }
+};
+
+//ミリ秒をtickに（切り上げ。ticksがこの時間だけ進んだフレームで時間切れになる）
+inline Uint64 ticks_for_ms(Uint32 ms){
+    return (ms + frameDeray - 1) / frameDeray;
+}
+
+//コルーチンのフレームの置き場。持ち主の型ごとに返されたフレームを取っておいて使い回す
+//（同じ関数のフレームはいつも同じ大きさ）。スレッドごとに持つのでロックはいらない
+class FramePool{
+    public:
+        static constexpr size_t HEADER = alignof(std::max_align_t);  //先頭にどの型のものかを書いておく
+        static constexpr size_t MAX_FREE = 4096;                       //1つの型で取っておく数
+
+        template<class Owner>
+        static int id(){
+            static const int value = next_id++;
+            return value;
+        }
+        static void* allocate(int pool,size_t size){
+            Pool& p = local(pool);
+            char* block;
+            if(size == p.size && !p.free.empty()){
+                block = p.free.back();
+                p.free.pop_back();
+            }
+            else{
+                block = static_cast<char*>(::operator new(HEADER + size));
+                if(p.size == 0) p.size = size;
+            }
+            *reinterpret_cast<int*>(block) = pool;
+            return block + HEADER;
+        }
+        //別のスレッドで取ったものでも、返したスレッドで使い回す
+        static void release(void* frame,size_t size){
+            char* block = static_cast<char*>(frame) - HEADER;
+            Pool& p = local(*reinterpret_cast<int*>(block));
+            if(size == p.size && p.free.size() < MAX_FREE){
+                p.free.push_back(block);
+                return;
+            }
+            ::operator delete(block);
+        }
+    private:
+        struct Pool{
+            size_t size = 0;
+            std::vector<char*> free;
+            ~Pool(){ for(char* b : free) ::operator delete(b); }
+        };
+        static Pool& local(int pool){
+            thread_local std::vector<Pool> pools;
+            if(pool >= (int)pools.size()) pools.resize(pool + 1);
+            return pools[pool];
+        }
+        static inline std::atomic<int> next_id{0};
+};
+
+//敵の振る舞いを書くコルーチン（メンバー関数として書く。フレームは持ち主の型のFramePoolから取る）
+//写しは空になる（持ち主の写しがコルーチンを作り直す。Enemy::resume_script）
+class Script{
+    public:
+        struct promise_type{
+            Script get_return_object(){ return Script(std::coroutine_handle<promise_type>::from_promise(*this)); }
+            std::suspend_always initial_suspend()noexcept{ return {}; }
+            std::suspend_always final_suspend()noexcept{ return {}; }
+            void return_void(){}
+            void unhandled_exception(){ std::terminate(); }
+            template<class Owner>
+            static void* operator new(size_t size,Owner&){ return FramePool::allocate(FramePool::id<Owner>(),size); }
+            static void operator delete(void* frame,size_t size){ FramePool::release(frame,size); }
+        };
+        Script() = default;
+        Script(const Script&){}
+        Script& operator=(const Script& o){
+            if(this != &o) reset();
+            return *this;
+        }
+        Script(Script&& o)noexcept : handle(std::exchange(o.handle,nullptr)){}
+        Script& operator=(Script&& o)noexcept{
+            if(this != &o){
+                reset();
+                handle = std::exchange(o.handle,nullptr);
+            }
+            return *this;
+        }
+        ~Script(){ reset(); }
+        explicit operator bool()const{ return (bool)handle; }
+        bool done()const{ return handle.done(); }
+        void resume(){ handle.resume(); }
+        void reset(){
+            if(handle) handle.destroy();
+            handle = nullptr;
+        }
+    private:
+        explicit Script(std::coroutine_handle<> h) : handle(h){}
+        std::coroutine_handle<> handle;
+};
+
+//ゲーム中の出来事。更新中はここに積むだけで、マリオや一覧への反映はWorld::flush_eventsでまとめて行う
+enum GameEventType : Uint8{
+    EVENT_COIN,          //コインを取った
+    EVENT_STOMP,         //敵を踏んだ（valueは跳ね返りの速さ）
+    EVENT_KICK,          //甲羅を蹴った
+    EVENT_BLOCK_BROKEN,  //ブロックを壊した
+    EVENT_ITEM_BOX,      //アイテムボックスを叩いた（valueは中身のITEM_IN_BOX）
+    EVENT_POWER_UP,      //アイテムを取った（valueはなる状態のMarioState）
+    EVENT_WARP,          //土管でワープした
+    EVENT_DAMAGE,        //敵や炎に当たった
+    EVENT_JUMP,          //ジャンプした（水中では一かき）
+    EVENT_FIREBALL,      //マリオがファイアボールを撃った
+    EVENT_BOWSER_FIRE,   //クッパが炎を吐いた
+    EVENT_FIREBALL_END,  //ファイアボールが消えた
+    EVENT_TYPE_COUNT,
+};
+struct GameEvent{
+    GameEventType type;
+    int row,col;  //起きた場所のタイル
+    int value;
+};
+
+//世界ごとに持つ時刻・乱数・カメラと、敵やマリオが直接増やす弾の一覧
+//（World がこれを継承し、動かしている間は world がその世界を指す）
+struct WorldContext{
+    std::mt19937 rng;  // 乱数エンジン（世界ごとに使い回す）
+    Uint32 ticks = 0;  //ゲーム内の時刻（ms）。1フレームでframeDerayずつ進む（止めればすべての時間が止まる）
+    Uint64 frame = 0;  //シミュレーションのtick
+    TimerWheel timers;
+    TimerNode probability_timer;  //確率を1秒ごとに引き直す
+    int cameraX = 0;
+    int cameraY = 0;
+    std::vector<Fireball*> fire_balls;
+    std::vector<Fire*> fires;
+    //このフレームでまだ配っていない出来事
+    std::vector<GameEvent> events;
+
+    //確率
+    bool p_30,p_25,p_10,p_5,p_1;
+
+    explicit WorldContext(unsigned seed = std::random_device{}()) : rng(seed){
+        p_30 = random_with_probability(0.30);
+        p_25 = random_with_probability(0.25);
+        p_10 = random_with_probability(0.10);
+        p_5 = random_with_probability(0.05);
+        p_1 = random_with_probability(0.01);
+        //最初のフレームでも引き直す
+        timers.arm(probability_timer,nullptr,0,1);
+    }
+    void emit(GameEventType type,int row,int col,int value = 0){
+        events.push_back({type,row,col,value});
+    }
+    bool random_with_probability(double p) {
+        std::uniform_real_distribution<double> dist(0.0, 1.0);
+        return dist(rng) < p;
+    }
+    void refresh_probabilities_each_second(){
         p_30 = random_with_probability(0.30);
         p_25 = random_with_probability(0.25);
         p_10 = random_with_probability(0.10);
         p_5  = random_with_probability(0.05);
         p_1  = random_with_probability(0.01);
+        timers.arm(probability_timer,nullptr,0,FPS);
     }
-    probability_frame_counter++;
-}
+};
+//いま動かしている世界（スレッドごと）
+thread_local WorldContext* world = nullptr;
+
+//この範囲の間だけ world を差し替える
+struct WorldScope{
+    WorldContext* prev;
+    explicit WorldScope(WorldContext* w) : prev(world){ world = w; }
+    ~WorldScope(){ world = prev; }
+};
 
 //各テクスチャーの管理（画像ファイルのパスを一箇所に集約）
 namespace Assets{
@@ -73,20 +368,430 @@ namespace Assets{
     constexpr const char* ENEMY_BOWSER = "img/bowser.png"; 
     //敵の弾
     constexpr const char* FIRE = "img/fire.png"; 
+
+    //先読み用の一覧
+    constexpr const char* ALL[] = {
+        MARIO, FIREMARIO, STARMARIO, FIREBALL, GOAL, PIPE,
+        COIN, SUPERMASHROOM, STAR, FIREFLOWER,
+        ENEMY_MASHROOM, ENEMY_GREENTURTLE, ENEMY_GREENTURTLE_SHELL, ENEMY_FLOWER, ENEMY_FISH, ENEMY_BOWSER,
+        FIRE,
+    };
+}
+
+//アニメーションの1コマ（どの画像のどこを、何tick出すか）
+struct AnimFrame{
+    const char* asset;  //nullptrなら何も出さない（点滅）
+    Uint16 ticks;
+    Uint8 flip;         //SDL_RendererFlip（向きの反転と重ねがけ）
+    SDL_FRect src;      //画像の中の切り出し（0〜1）
+    SDL_FRect uv;       //アトラスの中の位置（アトラスを作るときに埋まる）
+};
+inline AnimFrame anim_frame(const char* asset,Uint16 ticks,Uint8 flip = SDL_FLIP_NONE,SDL_FRect src = {0,0,1,1}){
+    return {asset,ticks,flip,src,{0,0,0,0}};
+}
+enum AnimLoop : Uint8{
+    ANIM_LOOP,  //最後のコマの次は最初に戻る
+    ANIM_ONCE,  //最後のコマで止まる
+};
+//コマの並び。同じクリップを全員で共有し、各自は再生を始めたtickだけ持つ
+class AnimClip{
+    public:
+        AnimLoop loop;
+        std::vector<AnimFrame> frames;
+        AnimClip(AnimLoop loop,std::initializer_list<AnimFrame> list) : loop(loop),frames(list){
+            Uint32 t = 0;
+            for(const AnimFrame& f : frames){
+                t += std::max<Uint16>(f.ticks,1);
+                ends.push_back(t);
+            }
+        }
+        //再生を始めてからelapsed tick目のコマ
+        const AnimFrame& at(Uint64 elapsed)const{
+            Uint64 t = loop == ANIM_LOOP ? elapsed % ends.back() : std::min<Uint64>(elapsed,ends.back() - 1);
+            size_t i = 0;
+            while(ends[i] <= t) i++;
+            return frames[i];
+        }
+    private:
+        std::vector<Uint32> ends;  //各コマが終わるtick（累積）
+};
+//1体ごとの再生状態（クリップと始めたtickだけ。進めるのはシミュレーションのtick）
+struct AnimPlayer{
+    const AnimClip* clip = nullptr;
+    Uint64 start = 0;
+    //違うクリップに変わったときだけ最初から
+    void play(const AnimClip& c,Uint64 now){
+        if(clip == &c) return;
+        clip = &c;
+        start = now;
+    }
+    const AnimFrame& frame(Uint64 now)const{
+        return clip->at(now - start);
+    }
+};
+
+//クリップの定義（tickは1/FPS秒）
+namespace Anims{
+    AnimClip MARIO(ANIM_LOOP,{anim_frame(Assets::MARIO,1)});
+    AnimClip FIRE_MARIO(ANIM_LOOP,{anim_frame(Assets::FIREMARIO,1)});
+    AnimClip STAR_MARIO(ANIM_LOOP,{anim_frame(Assets::STARMARIO,1)});
+    //ダメージ後の無敵中は点滅
+    AnimClip MARIO_FLASH(ANIM_LOOP,{anim_frame(Assets::MARIO,2),anim_frame(nullptr,2)});
+    AnimClip FIRE_MARIO_FLASH(ANIM_LOOP,{anim_frame(Assets::FIREMARIO,2),anim_frame(nullptr,2)});
+    //クリボーは左右反転を繰り返して歩く
+    AnimClip MASHROOM_WALK(ANIM_LOOP,{anim_frame(Assets::ENEMY_MASHROOM,10),anim_frame(Assets::ENEMY_MASHROOM,10,SDL_FLIP_HORIZONTAL)});
+    //ノコノコは上下に揺れて歩く
+    AnimClip TURTLE_WALK(ANIM_LOOP,{anim_frame(Assets::ENEMY_GREENTURTLE,8),anim_frame(Assets::ENEMY_GREENTURTLE,8,SDL_FLIP_NONE,{0,0,1,0.94f})});
+    //踏まれた甲羅は少し揺れて止まる。蹴られた甲羅は回り続ける
+    AnimClip SHELL_STOP(ANIM_ONCE,{anim_frame(Assets::ENEMY_GREENTURTLE_SHELL,3),anim_frame(Assets::ENEMY_GREENTURTLE_SHELL,3,SDL_FLIP_HORIZONTAL),anim_frame(Assets::ENEMY_GREENTURTLE_SHELL,1)});
+    AnimClip SHELL_SPIN(ANIM_LOOP,{anim_frame(Assets::ENEMY_GREENTURTLE_SHELL,3),anim_frame(Assets::ENEMY_GREENTURTLE_SHELL,3,SDL_FLIP_HORIZONTAL)});
+    //パックンフラワーは口を開け閉めする（上を切って縦に伸ばす）
+    AnimClip FLOWER_CHOMP(ANIM_LOOP,{anim_frame(Assets::ENEMY_FLOWER,12),anim_frame(Assets::ENEMY_FLOWER,12,SDL_FLIP_NONE,{0,0.12f,1,0.88f})});
+
+    //アトラスを作るときにコマの位置を埋める一覧
+    AnimClip* ALL[] = {
+        &MARIO, &FIRE_MARIO, &STAR_MARIO, &MARIO_FLASH, &FIRE_MARIO_FLASH,
+        &MASHROOM_WALK, &TURTLE_WALK, &SHELL_STOP, &SHELL_SPIN, &FLOWER_CHOMP,
+    };
+}
+
+//背景の1層。手続きで描いた絵を横にperiodで繰り返す帯にしておき、窓をずらして1回で貼る
+struct BackdropDef{
+    const char* name;
+    float scroll;  //カメラの動きに対する割合（遠い層ほど小さい）
+    int period;    //横の繰り返しの幅（画素）
+    SDL_Color (*paint)(int x,int y);  //0<=x<periodの点の色（aが0なら透明）
+};
+namespace Backdrops{
+    constexpr int MAX_LAYERS = 4;  //1つのステージで重ねられる層の数
+    const BackdropDef ALL[] = {
+        //上から下へ明るくなる空
+        {"sky",0.0f,1,[](int,int y)->SDL_Color{
+            return {(Uint8)(90 + 80 * y / SCREEN_HEIGHT),(Uint8)(150 + 60 * y / SCREEN_HEIGHT),255,255};
+        }},
+        //円を3つずつ重ねた雲
+        {"clouds",0.25f,512,[](int x,int y)->SDL_Color{
+            const int cx[] = {90,130,170,300,340,380}, cy[] = {90,70,90,150,130,150}, r[] = {30,40,30,25,35,25};
+            for(int i = 0; i < 6; i++){
+                if((x - cx[i]) * (x - cx[i]) + (y - cy[i]) * (y - cy[i]) < r[i] * r[i]) return {255,255,255,230};
+            }
+            return {0,0,0,0};
+        }},
+        //2つの波を重ねた丘（上の縁だけ濃い）
+        {"hills",0.5f,512,[](int x,int y)->SDL_Color{
+            float phase = 2 * (float)M_PI * x / 512;
+            float top = SCREEN_HEIGHT - 130 - 50 * std::sin(phase) - 20 * std::sin(2 * phase + 1);
+            if(y < top) return {0,0,0,0};
+            if(y < top + 4) return {30,110,30,255};
+            return {60,170,60,255};
+        }},
+        //地下のレンガの壁（段ごとに半分ずらす）
+        {"bricks",0.5f,64,[](int x,int y)->SDL_Color{
+            int row = y / 16;
+            int bx = (x + (row % 2) * 16) % 32;
+            if(y % 16 == 0 || bx == 0) return {35,20,15,255};
+            return {70,40,30,255};
+        }},
+    };
+    constexpr int COUNT = sizeof(ALL) / sizeof(ALL[0]);
+    //名前から番号（なければ-1）
+    inline int find(std::string_view name){
+        for(int i = 0; i < COUNT; i++){
+            if(name == ALL[i].name) return i;
+        }
+        return -1;
+    }
 }
 
+//画像は1回だけ読み込み、全部を1枚のテクスチャ（アトラス）に並べて全員で使い回す
+//（スプライトが切り替わってもテクスチャは替わらないので、描画はまとめて流せる）
+//デコード（surface）は読み込みスレッドからも呼べる。テクスチャ化はメインスレッドだけ
+class TextureCache{
+    public:
+        ~TextureCache(){
+            for(auto& s : surfaces){
+                if(s.second) SDL_FreeSurface(s.second);
+            }
+        }
+        SDL_Surface* surface(const char* path){
+            std::lock_guard<std::mutex> lock(mtx);
+            auto it = surfaces.find(path);
+            if(it != surfaces.end()) return it->second;
+            SDL_Surface* surface = IMG_Load(path);
+            if (!surface) {
+                SDL_Log("SDL_LoadBMP Error: %s", SDL_GetError());
+            }
+            surfaces[path] = surface;
+            return surface;
+        }
+        //全部の画像を並べた1枚のテクスチャ（スプライトはすべてここから切り出す）
+        SDL_Texture* atlas(SDL_Renderer* renderer){
+            //描画しない世界（ヘッドレス）ではテクスチャを作らない
+            if(!renderer) return nullptr;
+            {
+                std::lock_guard<std::mutex> lock(texture_mtx);
+                if(atlas_texture) return atlas_texture;
+            }
+            //テクスチャを作れるのはメインスレッドだけ（シミュレーションのスレッドからは作ってあるものを引くだけ）
+            if(std::this_thread::get_id() != main_thread) return nullptr;
+            build_atlas(renderer);
+            std::lock_guard<std::mutex> lock(texture_mtx);
+            return atlas_texture;
+        }
+        //アトラスを返し、pathの画像の位置をuvに入れる（アニメーションしないスプライト用）
+        SDL_Texture* sprite(SDL_Renderer* renderer,const char* path,SDL_FRect& uv){
+            SDL_Texture* t = atlas(renderer);
+            if(!t) return nullptr;
+            std::lock_guard<std::mutex> lock(texture_mtx);
+            auto it = regions.find(path);
+            if(it == regions.end()) return nullptr;
+            uv = it->second;
+            return t;
+        }
+        //水・溶岩の表面の帯（横にFLUID_PERIODで繰り返す模様。幅はFLUID_STRIP_W）
+        static constexpr int FLUID_PERIOD = 64;
+        static constexpr int FLUID_STRIP_W = SCREEN_WIDTH + FLUID_PERIOD;  //画面幅の窓をどこから切り出しても収まる
+        static constexpr int FLUID_STRIP_H = 32;  //タイル1枚の高さ
+        struct FluidStrips{
+            SDL_Texture* texture;  //アトラス（まだ作っていなければnullptr）
+            SDL_FRect water,lava;
+        };
+        FluidStrips fluid_strips(){
+            std::lock_guard<std::mutex> lock(texture_mtx);
+            return {atlas_texture,water_strip,lava_strip};
+        }
+        //背景の層の帯（アトラスと一緒に作る。まだなければnullptr）
+        SDL_Texture* backdrop(int id){
+            std::lock_guard<std::mutex> lock(texture_mtx);
+            return backdrops[id];
+        }
+        //全部の画像をデコードしておく（読み込みスレッドから）
+        void preload(){
+            for(const char* path : Assets::ALL) surface(path);
+        }
+        //アトラスを作っておく（シミュレーションのスレッドを動かす前に、メインスレッドで呼ぶ）
+        void upload_all(SDL_Renderer* renderer){
+            atlas(renderer);
+        }
+    private:
+        std::mutex mtx;
+        std::mutex texture_mtx;
+        std::unordered_map<std::string,SDL_Surface*> surfaces;
+        std::unordered_map<std::string,SDL_FRect> regions;  //アトラスの中の各画像の位置（0〜1）
+        SDL_Texture* atlas_texture = nullptr;
+        SDL_FRect water_strip = {0,0,0,0};
+        SDL_FRect lava_strip = {0,0,0,0};
+        std::array<SDL_Texture*,Backdrops::COUNT> backdrops{};
+        std::thread::id main_thread = std::this_thread::get_id();  //グローバル変数なのでmainより前にメインスレッドで決まる
+
+        //波の帯を描く（波より上は透明、波頭だけ明るい色）
+        static void paint_fluid_strip(SDL_Surface* sheet,const SDL_Rect& at,SDL_Color body,SDL_Color crest,float amplitude){
+            Uint32 clear = SDL_MapRGBA(sheet->format,0,0,0,0);
+            Uint32 body_px = SDL_MapRGBA(sheet->format,body.r,body.g,body.b,255);
+            Uint32 crest_px = SDL_MapRGBA(sheet->format,crest.r,crest.g,crest.b,255);
+            SDL_LockSurface(sheet);
+            for(int x = 0; x < at.w; x++){
+                //2つの波を重ねる（どちらも周期がFLUID_PERIODを割り切るので継ぎ目が出ない）
+                float phase = 2 * (float)M_PI * x / FLUID_PERIOD;
+                float top = amplitude * (1 + std::sin(phase)) + amplitude * 0.5f * (1 + std::sin(2 * phase + 1));
+                Uint32* column = (Uint32*)((Uint8*)sheet->pixels + at.y * sheet->pitch) + at.x + x;
+                for(int y = 0; y < at.h; y++){
+                    Uint32 px = clear;
+                    if(y >= top + 3) px = body_px;
+                    else if(y >= top) px = crest_px;
+                    column[y * (sheet->pitch / 4)] = px;
+                }
+            }
+            SDL_UnlockSurface(sheet);
+        }
+        //画像を高い順に棚へ詰めて1枚にする。クリップのコマの位置もここで決める
+        void build_atlas(SDL_Renderer* renderer){
+            const int WIDTH = 2048;
+            const int PAD = 1;  //隣の画像がにじまないように空ける
+            std::vector<std::pair<const char*,SDL_Surface*>> list;
+            for(const char* path : Assets::ALL){
+                SDL_Surface* s = surface(path);
+                if(s) list.push_back({path,s});
+            }
+            std::stable_sort(list.begin(),list.end(),[](const auto& a,const auto& b){ return a.second->h > b.second->h; });
+            std::vector<SDL_Rect> places;
+            int x = PAD, y = PAD, shelf = 0;
+            for(auto& e : list){
+                if(x + e.second->w + PAD > WIDTH){
+                    x = PAD;
+                    y += shelf + PAD;
+                    shelf = 0;
+                }
+                places.push_back({x,y,e.second->w,e.second->h});
+                x += e.second->w + PAD;
+                shelf = std::max(shelf,e.second->h);
+            }
+            //一番下に水と溶岩の表面の帯を置く
+            SDL_Rect water_at = {PAD,y + shelf + PAD,FLUID_STRIP_W,FLUID_STRIP_H};
+            SDL_Rect lava_at = {PAD,water_at.y + FLUID_STRIP_H + PAD,FLUID_STRIP_W,FLUID_STRIP_H};
+            int height = lava_at.y + FLUID_STRIP_H + PAD;
+            SDL_Surface* sheet = SDL_CreateRGBSurfaceWithFormat(0,WIDTH,height,32,SDL_PIXELFORMAT_RGBA32);
+            if(!sheet){
+                SDL_Log("SDL_CreateRGBSurfaceWithFormat Error: %s", SDL_GetError());
+                return;
+            }
+            for(size_t i = 0; i < list.size(); i++){
+                SDL_SetSurfaceBlendMode(list[i].second,SDL_BLENDMODE_NONE);
+                SDL_BlitSurface(list[i].second,nullptr,sheet,&places[i]);
+            }
+            paint_fluid_strip(sheet,water_at,{0,120,255,255},{170,220,255,255},4);
+            paint_fluid_strip(sheet,lava_at,{255,80,0,255},{255,220,80,255},2);
+            SDL_Texture* texture = SDL_CreateTextureFromSurface(renderer,sheet);
+            SDL_FreeSurface(sheet);
+            if (!texture) {
+                SDL_Log("SDL_CreateTextureFromSurface Error: %s", SDL_GetError());
+                return;
+            }
+            std::lock_guard<std::mutex> lock(texture_mtx);
+            for(size_t i = 0; i < list.size(); i++){
+                const SDL_Rect& p = places[i];
+                regions[list[i].first] = {(float)p.x / WIDTH,(float)p.y / height,(float)p.w / WIDTH,(float)p.h / height};
+            }
+            water_strip = {(float)water_at.x / WIDTH,(float)water_at.y / height,(float)water_at.w / WIDTH,(float)water_at.h / height};
+            lava_strip = {(float)lava_at.x / WIDTH,(float)lava_at.y / height,(float)lava_at.w / WIDTH,(float)lava_at.h / height};
+            for(AnimClip* clip : Anims::ALL){
+                for(AnimFrame& f : clip->frames){
+                    if(!f.asset) continue;
+                    auto it = regions.find(f.asset);
+                    if(it == regions.end()) continue;
+                    const SDL_FRect& r = it->second;
+                    f.uv = {r.x + f.src.x * r.w,r.y + f.src.y * r.h,f.src.w * r.w,f.src.h * r.h};
+                }
+            }
+            atlas_texture = texture;
+            for(int i = 0; i < Backdrops::COUNT; i++){
+                backdrops[i] = paint_backdrop(renderer,Backdrops::ALL[i]);
+            }
+        }
+        //背景の層を、画面幅＋1周期の帯に描いておく（どこから画面幅を切り出しても繰り返しがつながる）
+        static SDL_Texture* paint_backdrop(SDL_Renderer* renderer,const BackdropDef& def){
+            int width = SCREEN_WIDTH + def.period;
+            SDL_Surface* surface = SDL_CreateRGBSurfaceWithFormat(0,width,SCREEN_HEIGHT,32,SDL_PIXELFORMAT_RGBA32);
+            if(!surface){
+                SDL_Log("SDL_CreateRGBSurfaceWithFormat Error: %s", SDL_GetError());
+                return nullptr;
+            }
+            SDL_LockSurface(surface);
+            for(int y = 0; y < SCREEN_HEIGHT; y++){
+                Uint32* line = (Uint32*)((Uint8*)surface->pixels + y * surface->pitch);
+                for(int x = 0; x < width; x++){
+                    SDL_Color c = def.paint(x % def.period,y);
+                    line[x] = SDL_MapRGBA(surface->format,c.r,c.g,c.b,c.a);
+                }
+            }
+            SDL_UnlockSurface(surface);
+            SDL_Texture* texture = SDL_CreateTextureFromSurface(renderer,surface);
+            SDL_FreeSurface(surface);
+            if (!texture) {
+                SDL_Log("SDL_CreateTextureFromSurface Error: %s", SDL_GetError());
+            }
+            return texture;
+        }
+};
+TextureCache texture_cache;
+
+//描画の層（小さい方から先に描く。同じ層の中はテクスチャ順）
+enum DrawLayer : Uint8{
+    LAYER_BACKGROUND,  //背景（遠い層から順に+1ずつ、Backdrops::MAX_LAYERS枚まで）
+    LAYER_STAGE = LAYER_BACKGROUND + Backdrops::MAX_LAYERS,  //タイル
+    LAYER_PIPE,
+    LAYER_GOAL,
+    LAYER_ITEM,
+    LAYER_ENEMY,
+    LAYER_MARIO,
+    LAYER_EFFECT,  //ファイアボール・炎
+};
+
+//1回の描画（色の塗りつぶしか、テクスチャの貼り付け）
+struct DrawCmd{
+    SDL_Texture* texture;  //スプライト（nullptrならcolorで塗る）
+    SDL_Rect dst;          //画面上の位置
+    SDL_FRect uv;          //テクスチャの切り出しを0〜1で（wが0なら全体）
+    Uint8 layer;           //DrawLayer
+    Uint8 flip;            //SDL_RendererFlip
+    SDL_Color color;
+};
+
+//1フレーム分の描画命令。シミュレーション側で積み、SDL_Rendererを持つ側でまとめて流す
+//（描画する側は世界の中身に触らないので、次のフレームのシミュレーションと同時に流せる）
+//画面に掛からないものは積まないので、描画の手間は画面に映っている数だけで決まる
+class DrawList{
+    public:
+        SDL_Color clear_color = {0,0,255,255};
+        std::vector<DrawCmd> cmds;
+        std::vector<SDL_Vertex> particles;  //粒の三角形（スプライトの後に1回で描く）
+        std::string title;  //ウィンドウのタイトル（HUD）
+
+        void reset(){
+            cmds.clear();
+            particles.clear();
+        }
+        void fill(const SDL_Rect& dst,Uint8 r,Uint8 g,Uint8 b,DrawLayer layer = LAYER_STAGE){
+            if(!on_screen(dst)) return;
+            cmds.push_back({nullptr,dst,{0,0,0,0},layer,SDL_FLIP_NONE,{r,g,b,255}});
+        }
+        void copy(SDL_Texture* texture,const SDL_Rect& dst,DrawLayer layer,SDL_RendererFlip flip = SDL_FLIP_NONE,SDL_FRect uv = {0,0,0,0}){
+            if(!texture || !on_screen(dst)) return;
+            cmds.push_back({texture,dst,uv,layer,(Uint8)flip,{255,255,255,255}});
+        }
+        //層、テクスチャの順に並べる（同じテクスチャの描画がまとまる。同じものどうしは積んだ順のまま）
+        void sort(){
+            std::stable_sort(cmds.begin(),cmds.end(),[](const DrawCmd& a,const DrawCmd& b){
+                if(a.layer != b.layer) return a.layer < b.layer;
+                return std::less<SDL_Texture*>()(a.texture,b.texture);
+            });
+        }
+        //SDL_Rendererに流す（メインスレッドで呼ぶ）
+        void submit(SDL_Renderer* renderer)const{
+            SDL_SetRenderDrawColor(renderer,clear_color.r,clear_color.g,clear_color.b,clear_color.a);
+            SDL_RenderClear(renderer);
+            SDL_Color last = clear_color;
+            SDL_Texture* sized = nullptr;  //texW,texHがどのテクスチャの大きさか（並べた後はほぼアトラスだけ）
+            int texW = 0, texH = 0;
+            for(const DrawCmd& c : cmds){
+                if(!c.texture){
+                    //色が変わったときだけ設定し直す
+                    if(c.color.r != last.r || c.color.g != last.g || c.color.b != last.b || c.color.a != last.a){
+                        SDL_SetRenderDrawColor(renderer,c.color.r,c.color.g,c.color.b,c.color.a);
+                        last = c.color;
+                    }
+                    SDL_RenderFillRect(renderer,&c.dst);
+                }
+                else if(c.uv.w > 0){
+                    if(c.texture != sized){
+                        SDL_QueryTexture(c.texture,nullptr,nullptr,&texW,&texH);
+                        sized = c.texture;
+                    }
+                    SDL_Rect src = {(int)(c.uv.x * texW),(int)(c.uv.y * texH),(int)(c.uv.w * texW),(int)(c.uv.h * texH)};
+                    SDL_RenderCopyEx(renderer,c.texture,&src,&c.dst,0,NULL,(SDL_RendererFlip)c.flip);
+                }
+                else{
+                    SDL_RenderCopyEx(renderer,c.texture,NULL,&c.dst,0,NULL,(SDL_RendererFlip)c.flip);
+                }
+            }
+            if(!particles.empty()){
+                SDL_SetRenderDrawBlendMode(renderer,SDL_BLENDMODE_BLEND);
+                SDL_RenderGeometry(renderer,nullptr,particles.data(),(int)particles.size(),nullptr,0);
+                SDL_SetRenderDrawBlendMode(renderer,SDL_BLENDMODE_NONE);
+            }
+        }
+    private:
+        static bool on_screen(const SDL_Rect& r){
+            return r.x < SCREEN_WIDTH && r.y < SCREEN_HEIGHT && r.x + r.w > 0 && r.y + r.h > 0 && r.w > 0 && r.h > 0;
+        }
+};
+
 //前方宣言
 class item;
 class Coin;
 class SuperMashroom;
 class Goal;
 class Warp_Pipe;
-class Fireball;
-class Fire;
-
-extern std::vector<Warp_Pipe*> warp_pipes;
-extern std::vector<Fireball*> fire_balls;
-extern std::vector<Fire*> fires;
 
 class Stage{
     public:
@@ -122,169 +827,829 @@ class Stage{
             PIPE_FLOWER = 'H',
             PIPE_NORMAL = 0,
         };
+        //タイル文字1つ分の意味（地形・箱の中身・敵・土管）
+        struct TileChar{
+            TileType tile;
+            ITEM_IN_BOX box;
+            EnemyType enemy;
+            PIPETYPE pipe;
+            constexpr bool operator==(const TileChar& o)const{
+                return tile == o.tile && box == o.box && enemy == o.enemy && pipe == o.pipe;
+            }
+            constexpr bool operator!=(const TileChar& o)const{ return !(*this == o); }
+        };
+        struct TileCharDef{
+            char c;
+            TileChar value;
+        };
+        //ステージファイルの文字と意味の対応（ここにない文字は空白。ワープ土管のアンカー文字はWARP_ANCHORS）
+        static constexpr TileCharDef TILE_CHAR_DEFS[] = {
+            {'0',{TILE_EMPTY,BOX_NONE,NO_ENEMY,PIPE_NORMAL}},
+            {'1',{TILE_GROUND,BOX_NONE,NO_ENEMY,PIPE_NORMAL}},
+            {'2',{TILE_BLOCK,BOX_NONE,NO_ENEMY,PIPE_NORMAL}},
+            {'3',{TILE_ITEMBOX,BOX_NONE,NO_ENEMY,PIPE_NORMAL}},
+            {'4',{TILE_COIN,BOX_NONE,NO_ENEMY,PIPE_NORMAL}},
+            {'G',{TILE_GOAL,BOX_NONE,NO_ENEMY,PIPE_NORMAL}},
+            {'S',{TILE_START,BOX_NONE,NO_ENEMY,PIPE_NORMAL}},
+            {'P',{TILE_PIPE,BOX_NONE,NO_ENEMY,PIPE_NORMAL}},
+            {'L',{TILE_LAVA,BOX_NONE,NO_ENEMY,PIPE_NORMAL}},
+            {'O',{TILE_OCEAN,BOX_NONE,NO_ENEMY,PIPE_NORMAL}},
+            //アイテムボックス入りのもの
+            {'c',{TILE_ITEMBOX,BOX_COIN,NO_ENEMY,PIPE_NORMAL}},
+            {'m',{TILE_ITEMBOX,BOX_SUPERMASHROOM,NO_ENEMY,PIPE_NORMAL}},
+            {'s',{TILE_ITEMBOX,BOX_STAR,NO_ENEMY,PIPE_NORMAL}},
+            {'f',{TILE_ITEMBOX,BOX_FIREFLOWER,NO_ENEMY,PIPE_NORMAL}},
+            //敵
+            {'M',{TILE_ENEMY,BOX_NONE,ENEMY_MASHROOM,PIPE_NORMAL}},
+            {'T',{TILE_ENEMY,BOX_NONE,ENEMY_GREENTURTLE,PIPE_NORMAL}},
+            {'F',{TILE_ENEMY,BOX_NONE,ENEMY_FISH,PIPE_NORMAL}},
+            {'B',{TILE_ENEMY,BOX_NONE,ENEMY_BOWSER,PIPE_NORMAL}},
+            //土管
+            {'W',{TILE_PIPE,BOX_NONE,NO_ENEMY,PIPE_WARP}},
+            {'i',{TILE_PIPE,BOX_NONE,NO_ENEMY,PIPE_WARP}},
+            {'o',{TILE_PIPE,BOX_NONE,NO_ENEMY,PIPE_WARP}},
+            {'H',{TILE_PIPE,BOX_NONE,NO_ENEMY,PIPE_FLOWER}},
+        };
+        static constexpr TileChar WARP_ANCHOR_CHAR = {TILE_PIPE,BOX_NONE,NO_ENEMY,PIPE_WARP};
+        //文字→意味の表（クラスの後でコンパイル時に作る）
+        static const std::array<TileChar,256> TILE_CHARS;
+        static constexpr std::array<TileChar,256> make_tile_chars(){
+            std::array<TileChar,256> table{};
+            for(TileChar& t : table) t = {TILE_EMPTY,BOX_NONE,NO_ENEMY,PIPE_NORMAL};
+            for(const TileCharDef& d : TILE_CHAR_DEFS) table[(unsigned char)d.c] = d.value;
+            for(const char* a = WARP_ANCHORS; *a; a++) table[(unsigned char)*a] = WARP_ANCHOR_CHAR;
+            return table;
+        }
+        //同じ文字に違う意味を付けていないか（アンカー文字も含めて）
+        static constexpr bool tile_chars_consistent(){
+            for(const TileCharDef& a : TILE_CHAR_DEFS){
+                for(const TileCharDef& b : TILE_CHAR_DEFS){
+                    if(a.c == b.c && a.value != b.value) return false;
+                }
+                for(const char* p = WARP_ANCHORS; *p; p++){
+                    if(a.c == *p && a.value != WARP_ANCHOR_CHAR) return false;
+                }
+            }
+            return true;
+        }
+        static constexpr bool is_tile_char(char c){
+            for(const TileCharDef& d : TILE_CHAR_DEFS){
+                if(d.c == c) return true;
+            }
+            for(const char* p = WARP_ANCHORS; *p; p++){
+                if(*p == c) return true;
+            }
+            return false;
+        }
+
+        //ビルド時に埋め込んだステージ（CMakeの MARIO_EMBED_STAGES）。セルはコンパイル時に解析済み
+        struct EmbeddedStage{
+            const char* name;
+            std::string_view text;
+            const TileChar* cells;   //全部の行のセルを詰めて並べたもの
+            const int* row_text;     //各行のtextでの先頭
+            const int* row_cells;    //各行のcellsでの先頭（rows+1個）
+            int rows;
+            int underground_row;
+        };
+        template<size_t ROWS,size_t CELLS>
+        struct EmbeddedGrid{
+            std::array<TileChar,CELLS> cells{};
+            std::array<int,ROWS> row_text{};
+            std::array<int,ROWS + 1> row_cells{};
+            int underground_row = -1;
+        };
+        //埋め込んだテキストを行に分ける（read_stage_linesと同じく、空行と'#'の行は飛ばし'*'の行は地下の開始位置）
+        //fnは(行の先頭, 長さ)で呼ばれる。'*'の行はlengthが-1
+        template<typename Fn>
+        static constexpr void for_each_embedded_line(std::string_view text,Fn fn){
+            size_t begin = 0;
+            while(begin < text.size()){
+                size_t end = text.find('\n',begin);
+                if(end == std::string_view::npos) end = text.size();
+                if(end > begin && text[begin] != '#'){
+                    fn(begin,text[begin] == '*' ? -1 : (int)(end - begin));
+                }
+                begin = end + 1;
+            }
+        }
+        static constexpr size_t count_embedded_rows(std::string_view text){
+            size_t rows = 0;
+            for_each_embedded_line(text,[&](size_t,int len){ if(len >= 0) rows++; });
+            return rows;
+        }
+        static constexpr size_t count_embedded_cells(std::string_view text){
+            size_t cells = 0;
+            for_each_embedded_line(text,[&](size_t,int len){ if(len >= 0) cells += len; });
+            return cells;
+        }
+        static constexpr bool embedded_chars_known(std::string_view text){
+            bool known = true;
+            for_each_embedded_line(text,[&](size_t begin,int len){
+                for(int i = 0; i < len; i++){
+                    if(!is_tile_char(text[begin + i])) known = false;
+                }
+            });
+            return known;
+        }
+        template<size_t ROWS,size_t CELLS>
+        static constexpr EmbeddedGrid<ROWS,CELLS> parse_embedded(std::string_view text){
+            EmbeddedGrid<ROWS,CELLS> grid{};
+            std::array<TileChar,256> table = make_tile_chars();
+            size_t row = 0, cell = 0;
+            for_each_embedded_line(text,[&](size_t begin,int len){
+                if(len < 0){
+                    grid.underground_row = (int)row;
+                    return;
+                }
+                grid.row_text[row] = (int)begin;
+                grid.row_cells[row] = (int)cell;
+                for(int i = 0; i < len; i++){
+                    grid.cells[cell++] = table[(unsigned char)text[begin + i]];
+                }
+                row++;
+            });
+            grid.row_cells[ROWS] = (int)cell;
+            return grid;
+        }
+        //filename（またはそのファイル名部分）と同じ名前で埋め込まれたステージ（なければnullptr）
+        static const EmbeddedStage* find_embedded(const char* filename);
     private:
-        TileType TILE_TABLE[256];
-        ITEM_IN_BOX BOX_TABLE[256];
-        EnemyType ENEMY_TABLE[256];
-        PIPETYPE PIPE_TABLE[256];
         std::vector<std::vector<TileType>> tiles;
         std::vector<std::vector<ITEM_IN_BOX>> boxes;
         std::vector<std::vector<EnemyType>> enemies;
         std::vector<std::vector<PIPETYPE>> pipes;
+        //ストリーミング用（ファイルを開いたまま、列チャンク単位で読み込む）
+        std::shared_ptr<std::ifstream> stream_file;
+        std::vector<std::streamoff> row_offsets;
+        std::vector<int> row_lengths;
+        int stream_width = 0;
+        std::vector<int> resident_chunk;  //リングの各スロットに載っているチャンク番号（-1は空）
+        //水・溶岩の環境マップ（1タイル1バイト）と連結領域
+        std::vector<Uint8> medium_map;
+        std::vector<Uint8> medium_pair;   //(row,col)と(row,col+1)のOR。横2タイルを1回で引く
+        std::vector<int> region_map;
+        int env_width = 0;
+        int env_index(int row,int col)const{
+            return row * env_width + slot(col);
+        }
+        static Uint8 medium_of(TileType t){
+            if(t == TILE_OCEAN) return MEDIUM_WATER;
+            if(t == TILE_LAVA) return MEDIUM_LAVA;
+            return MEDIUM_NONE;
+        }
+        bool env_in_range(int row,int col)const{
+            if(row < 0 || row >= (int)tiles.size()) return false;
+            if(col < 0 || col >= env_cols) return false;
+            return is_resident(col);
+        }
+        int env_cols = 0;
+        int env_col_begin = 0;  //環境マップの先頭の列（ストリーミング中は常駐している最初の列）
+        //ワープ土管の上段のタイル → warps の番号
+        std::unordered_map<long long,int> warp_cells;
+        //ワープ先のために先読みしたチャンク（チャンク番号 → 行ごとにCHUNK_COLS文字）
+        std::unordered_map<int,std::string> prefetched;
+        //倒した敵・取ったコインの出てきたタイル（ストリーミング中にチャンクを出入りしても出し直さない）
+        std::unordered_set<long long> consumed;
+        //チャンク番号 → そのチャンクの edits の番号（読み直したチャンクに書き換えを当て直す）
+        std::unordered_map<int,std::vector<int>> chunk_edits;
+        static long long cell_key(int row,int col){
+            return ((long long)row << 32) | (unsigned int)col;
+        }
+        void update_pair(int row,int col){
+            if(!env_in_range(row,col)) return;
+            Uint8 m = medium_map[env_index(row,col)];
+            if(env_in_range(row,col + 1)) m |= medium_map[env_index(row,col + 1)];
+            medium_pair[env_index(row,col)] = m;
+        }
+        //列番号 → 配列上の位置（ストリーミング中はリングバッファ）
+        int slot(int col)const{
+            return streaming ? col % RING_COLS : col;
+        }
     public:
-        const int TILE_SIZE = 32;
+        //チャンクの大きさと常駐させるチャンク数（メモリはステージの長さによらず一定）
+        static constexpr int CHUNK_COLS = 64;
+        static constexpr int RESIDENT_CHUNKS = 8;
+        //常駐範囲からこのチャンク数より離れたチャンクは、壊したブロック・取ったコイン・倒した敵を忘れる（覚える量を一定にする）
+        static constexpr int REMEMBERED_CHUNKS = 32;
+        static const int RING_COLS = CHUNK_COLS * RESIDENT_CHUNKS;
+        bool streaming = false;
+        //環境マップのビット
+        enum Medium : Uint8{
+            MEDIUM_NONE = 0,
+            MEDIUM_WATER = 1,
+            MEDIUM_LAVA = 2,
+            MEDIUM_HAZARD = 4,  //触れると死ぬ領域
+        };
+        //連結した水・溶岩のかたまりごとの性質
+        struct Region{
+            Uint8 medium;
+            double gravity_scale;
+            bool lethal;
+            int tile_count;
+        };
+        struct Environment{
+            Uint8 medium;
+            int region;  //水の領域番号（水に入っていなければ-1）
+        };
+        std::vector<Region> regions;
+        std::vector<int> free_regions;  //タイルが無くなって使い回せる領域の番号
+        //水・溶岩の描画用の矩形（タイル単位）。表面（上が同じ媒質でない行）は1行ずつで、波の帯を貼る
+        struct FluidQuad{
+            int row,col,rows,cols;
+            Uint8 medium;
+            bool surface;
+        };
+        std::vector<FluidQuad> fluid_quads;
+        //列FLUID_BUCKET_COLSごとに、かかっている矩形の番号（描くときは見える列の分だけ引く）
+        static constexpr int FLUID_BUCKET_COLS = 16;
+        std::vector<int> fluid_bucket_begin;
+        std::vector<int> fluid_bucket_quads;
+        bool fluid_dirty = true;  //水・溶岩の形が変わった（次に描くときに作り直す）
+        //背景の層（Backdropsの番号、遠い順）
+        std::vector<int> backdrop_over;
+        std::vector<int> backdrop_under;
+        int directive_lines = 0;  //ファイルの'#'の行の数（先頭に書く）
+        //ワープ土管1本分（ステージ全体を持つので、ストリーミング中でも読み込み前の行き先がわかる）
+        struct WarpEntry{
+            int row,col;       //左上のタイル
+            char anchor;       //組の文字
+            char dest;         //下段右が別のアンカーなら、その組の出口へ行く（'\0'なら同じ組の次の出口）
+            bool can_in,can_out;
+            int target;        //行き先のwarpsの番号（-1は行き先なし）
+        };
+        std::vector<WarpEntry> warps;
+        //ワープ土管の対応付けに使える文字
+        static constexpr const char* WARP_ANCHORS = "!#$%&+=?@^";
+        static constexpr int TILE_SIZE = 32;
         bool is_underground = false;
         int start_underground_row = 0;
+        //trueならブロックを叩いても壊れず、アイテムも出ない（到達解析でステージを変えないため）
+        bool frozen = false;
+        //ステージの外を指していたので弾いた問い合わせの数（hit_blocks・try_warp。ファザーが数える）
+        int rejected_lookups = 0;
         std::vector<std::string> raw_lines;
         int stageHeightInTiles(){
             return tiles.size();
         }
 
         int stageWidthInTiles(){
+            if(streaming) return stream_width;
             return tiles[0].size();
         }
-
-        void initTileTable() {
-            for (int i = 0; i < 256; i++){
-                TILE_TABLE[i] = TILE_EMPTY; // 全部0に 
-                BOX_TABLE[i] = BOX_NONE;
-                ENEMY_TABLE[i] = NO_ENEMY;
-                PIPE_TABLE[i] = PIPE_NORMAL;
-            }
-            TILE_TABLE['0'] = TILE_EMPTY;
-            TILE_TABLE['1'] = TILE_GROUND;
-            TILE_TABLE['2'] = TILE_BLOCK;
-            TILE_TABLE['3'] = TILE_ITEMBOX;
-            TILE_TABLE['4'] = TILE_COIN;
-            TILE_TABLE['G'] = TILE_GOAL;
-            TILE_TABLE['S'] = TILE_START;
-            TILE_TABLE['P'] = TILE_PIPE;
-            TILE_TABLE['L'] = TILE_LAVA;
-            TILE_TABLE['O'] = TILE_OCEAN;
-             //アイテムボックス入りのもの
-            TILE_TABLE['c'] = TILE_ITEMBOX;
-            BOX_TABLE['c'] = BOX_COIN;
-            TILE_TABLE['m'] = TILE_ITEMBOX;
-            BOX_TABLE['m'] = BOX_SUPERMASHROOM;
-            TILE_TABLE['s'] = TILE_ITEMBOX;
-            BOX_TABLE['s'] = BOX_STAR;
-            TILE_TABLE['f'] = TILE_ITEMBOX;
-            BOX_TABLE['f'] = BOX_FIREFLOWER;
-            TILE_TABLE['s'] = TILE_ITEMBOX;
-            BOX_TABLE['s'] = BOX_STAR;
-            //敵
-            TILE_TABLE['M'] = TILE_ENEMY;
-            ENEMY_TABLE['M'] = ENEMY_MASHROOM;
-            TILE_TABLE['T'] = TILE_ENEMY;
-            ENEMY_TABLE['T']  = ENEMY_GREENTURTLE;
-            TILE_TABLE['F'] = TILE_ENEMY;
-            ENEMY_TABLE['F']  = ENEMY_FISH;
-            TILE_TABLE['B'] = TILE_ENEMY;
-            ENEMY_TABLE['B']  = ENEMY_BOWSER;
-            //土管
-            TILE_TABLE['W'] = TILE_PIPE;
-            PIPE_TABLE['W'] = PIPE_WARP;
-            TILE_TABLE['!'] = TILE_PIPE;
-            PIPE_TABLE['!'] = PIPE_WARP;
-            TILE_TABLE['#'] = TILE_PIPE;
-            PIPE_TABLE['#'] = PIPE_WARP;
-            TILE_TABLE['i'] = TILE_PIPE;
-            PIPE_TABLE['i'] = PIPE_WARP;
-            TILE_TABLE['o'] = TILE_PIPE;
-            PIPE_TABLE['o'] = PIPE_WARP;
-            TILE_TABLE['H'] = TILE_PIPE;
-            PIPE_TABLE['H'] = PIPE_FLOWER;
+        //行ごとの横幅（行によって長さが違うことがある）
+        int row_width(int row)const{
+            if(streaming) return row_lengths[row];
+            return (int)tiles[row].size();
+        }
+        //(row,col)がステージの中か（行によって長さが違うので行ごとに見る）
+        bool in_stage(int row,int col)const{
+            return row >= 0 && row < (int)tiles.size() && col >= 0 && col < row_width(row);
+        }
+        bool is_resident(int col)const{
+            if(!streaming) return true;
+            int chunk = col / CHUNK_COLS;
+            return resident_chunk[chunk % RESIDENT_CHUNKS] == chunk;
+        }
+        bool is_chunk_resident(int chunk)const{
+            return resident_chunk[chunk % RESIDENT_CHUNKS] == chunk;
+        }
+        int chunk_count()const{
+            return (stream_width + CHUNK_COLS - 1) / CHUNK_COLS;
+        }
+        char raw_at(int row,int col)const{
+            if(row < 0 || row >= (int)raw_lines.size() || col < 0 || col >= row_width(row)) return '0';
+            if(!is_resident(col)) return '0';
+            return raw_lines[row][slot(col)];
         }
 
         void load_stage(const char* filename){
-            tiles.clear();
-            boxes.clear();
-            enemies.clear();
-            pipes.clear();
-            raw_lines.clear();
-
-            std::ifstream file(filename);
-            if (!file) {
+            std::vector<std::string> lines;
+            std::vector<std::string> directives;
+            int underground_row = -1;
+            if (!read_stage_lines(filename,lines,underground_row,&directives)) {
+                //ファイルがなければ埋め込んだステージを使う（どのディレクトリからでも起動できる）
+                if(const EmbeddedStage* embedded = find_embedded(filename)){
+                    load_embedded(*embedded);
+                    return;
+                }
+                load_lines({},-1);
+                set_backdrops({});
                 SDL_Log("ステージファイルが開けません: %s", filename);
                 return;
             }
+            load_lines(lines,underground_row);
+            set_backdrops(directives);
+        }
 
-            std::string line;
-            while(std::getline(file,line)){
-                if(line.empty())continue;
-                if(line[0] == '*'){
-                    start_underground_row = (int)tiles.size();
-                    continue;
-                }
+        //ファイルと同じ形の行（'*'の行を含む）から読み込む。生成したステージをファイルを通さずに使うとき用
+        void load_generated(const std::vector<std::string>& source){
+            std::vector<std::string> lines;
+            std::vector<std::string> directives;
+            int underground_row = -1;
+            for(const std::string& line : source){
+                add_stage_line(line,lines,underground_row,&directives);
+            }
+            load_lines(lines,underground_row);
+            set_backdrops(directives);
+        }
+
+        void load_lines(const std::vector<std::string>& lines,int underground_row){
+            begin_load(underground_row);
+            for(const std::string& line : lines){
                 raw_lines.push_back(line);
-                std::vector<TileType> tile_row;
-                std::vector<ITEM_IN_BOX> box_row;
-                std::vector<EnemyType> enemy_row;
-                std::vector<PIPETYPE> pipe_row;
+                std::vector<TileChar> cells;
                 for(char c : line){
-                    tile_row.push_back(TILE_TABLE[(unsigned char)c]);
-                    box_row.push_back(BOX_TABLE[(unsigned char)c]);
-                    enemy_row.push_back(ENEMY_TABLE[(unsigned char)c]);
-                    pipe_row.push_back(PIPE_TABLE[(unsigned char)c]);
+                    cells.push_back(TILE_CHARS[(unsigned char)c]);
                 }
-                tiles.push_back(tile_row);
-                boxes.push_back(box_row);
-                enemies.push_back(enemy_row);
-                pipes.push_back(pipe_row);
+                push_row(cells.data(),(int)cells.size());
             }
+            build_warp_index();
         };
 
-        void render(SDL_Renderer* renderer,int cameraX,int cameraY){
-            int start_row = 0;;
-            int end_row = (int)tiles.size();
-            if(!is_underground){
-                start_row = 0;
-                end_row = start_underground_row;
+        //埋め込んだステージから読み込む（文字の解析はコンパイル時に済んでいる）
+        void load_embedded(const EmbeddedStage& embedded){
+            begin_load(embedded.underground_row);
+            for(int row = 0; row < embedded.rows; row++){
+                int width = embedded.row_cells[row + 1] - embedded.row_cells[row];
+                raw_lines.emplace_back(embedded.text.substr(embedded.row_text[row],width));
+                push_row(embedded.cells + embedded.row_cells[row],width);
             }
-            else{
-                start_row = start_underground_row;
-                end_row = (int)tiles.size();
+            build_warp_index();
+            //指示の行は解析しないで残してあるので、ここで拾う
+            std::vector<std::string> directives;
+            size_t begin = 0;
+            while(begin < embedded.text.size()){
+                size_t end = embedded.text.find('\n',begin);
+                if(end == std::string_view::npos) end = embedded.text.size();
+                if(end > begin && embedded.text[begin] == '#') directives.emplace_back(embedded.text.substr(begin,end - begin));
+                begin = end + 1;
             }
-            for(int row = start_row; row < end_row; ++row){
-                for(int col = 0; col < (int)tiles[row].size(); ++col){
-                    int worldX = col * TILE_SIZE;
-                    int worldY = row * TILE_SIZE;
-        
-                    int screenX = worldX - cameraX;
-                    int screenY = worldY - cameraY;
+            set_backdrops(directives);
+        }
 
-                    if (screenX + TILE_SIZE < 0 || screenX > SCREEN_WIDTH) continue;
+        void begin_load(int underground_row){
+            tiles.clear();
+            boxes.clear();
+            enemies.clear();
+            pipes.clear();
+            raw_lines.clear();
+            clear_edits();
+            consumed.clear();
+            streaming = false;
+            stream_file.reset();
 
-                    SDL_Rect r;
-                    r.x = screenX;
-                    r.y = screenY;
-                    r.w = TILE_SIZE;
+            if(underground_row >= 0){
+                start_underground_row = underground_row;
+            }
+        }
+        void push_row(const TileChar* cells,int width){
+            std::vector<TileType> tile_row(width);
+            std::vector<ITEM_IN_BOX> box_row(width);
+            std::vector<EnemyType> enemy_row(width);
+            std::vector<PIPETYPE> pipe_row(width);
+            for(int i = 0; i < width; i++){
+                tile_row[i] = cells[i].tile;
+                box_row[i] = cells[i].box;
+                enemy_row[i] = cells[i].enemy;
+                pipe_row[i] = cells[i].pipe;
+            }
+            tiles.push_back(std::move(tile_row));
+            boxes.push_back(std::move(box_row));
+            enemies.push_back(std::move(enemy_row));
+            pipes.push_back(std::move(pipe_row));
+        }
+
+        static bool is_warp_anchor(char c){
+            return c != '\0' && strchr(WARP_ANCHORS,c) != nullptr;
+        }
+
+        //1行分の文字からワープ土管を索引に登録する
+        //上段は W+アンカー、下段は i(入れる) o(出られる)。下段右が別のアンカーならその組の出口へ行く
+        void index_warp_row(int row,const std::string& line){
+            //直前の行で見つけた上段に、この行（下段）の情報を入れる
+            for(int i = (int)warps.size() - 1; i >= 0 && warps[i].row == row - 1; i--){
+                set_warp_bottom(warps[i],line);
+            }
+            for(size_t col = line.find('W'); col != std::string::npos; col = line.find('W',col + 1)){
+                add_warp(row,(int)col,line);
+            }
+        }
+        void set_warp_bottom(WarpEntry& w,const std::string& line){
+            char in = (w.col < (int)line.size()) ? line[w.col] : '0';
+            char out = (w.col + 1 < (int)line.size()) ? line[w.col + 1] : '0';
+            w.can_in = (in == 'i');
+            w.can_out = (out == 'o');
+            w.dest = is_warp_anchor(out) ? out : '\0';
+        }
+        int add_warp(int row,int col,const std::string& line){
+            WarpEntry w;
+            w.row = row;
+            w.col = col;
+            w.anchor = (col + 1 < (int)line.size()) ? line[col + 1] : '\0';
+            w.dest = '\0';
+            w.can_in = false;
+            w.can_out = false;
+            w.target = -1;
+            int id = (int)warps.size();
+            warps.push_back(w);
+            //土管の幅（右に続くドカンのタイル）だけ上段を登録する
+            for(int c = col; c < (int)line.size() && TILE_CHARS[(unsigned char)line[c]].tile == TILE_PIPE; c++){
+                warp_cells[cell_key(row,c)] = id;
+            }
+            return id;
+        }
+        //warps[id]の上段の登録をnew_idに付け替える（-1なら消す）
+        void move_warp_cells(int id,int new_id){
+            const WarpEntry& w = warps[id];
+            for(int c = w.col; ; c++){
+                auto it = warp_cells.find(cell_key(w.row,c));
+                if(it == warp_cells.end() || it->second != id) break;
+                if(new_id < 0) warp_cells.erase(it);
+                else it->second = new_id;
+            }
+        }
+
+        //ホットリロード用：上段がrowの行にあるワープ土管を索引から外す（行を書き換える前に、今の文字で探す）
+        //外した土管と、番号が変わった土管の組の文字をanchorsに足す
+        void unindex_warp_row(int row,std::string& anchors){
+            if(row < 0 || row >= (int)raw_lines.size()) return;
+            const std::string& line = raw_lines[row];
+            for(size_t col = line.find('W'); col != std::string::npos; col = line.find('W',col + 1)){
+                int id = warp_at(row,(int)col);
+                if(id < 0 || warps[id].col != (int)col) continue;
+                anchors += warps[id].anchor;
+                move_warp_cells(id,-1);
+                //最後の土管を空いた番号に詰める
+                int last = (int)warps.size() - 1;
+                if(id != last){
+                    move_warp_cells(last,id);
+                    warps[id] = warps[last];
+                    anchors += warps[id].anchor;
+                }
+                warps.pop_back();
+            }
+        }
+        //ホットリロード用：書き換えた後の行から、上段がrowの行にあるワープ土管を拾い直す
+        void reindex_warp_row(int row,std::string& anchors){
+            if(row < 0 || row >= (int)raw_lines.size()) return;
+            const std::string& line = raw_lines[row];
+            static const std::string none;
+            const std::string& below = (row + 1 < (int)raw_lines.size()) ? raw_lines[row + 1] : none;
+            for(size_t col = line.find('W'); col != std::string::npos; col = line.find('W',col + 1)){
+                int id = add_warp(row,(int)col,line);
+                set_warp_bottom(warps[id],below);
+                anchors += warps[id].anchor;
+            }
+        }
+
+        //行き先を決める。アンカーごとに列順に並べ、明示された組の出口か、同じ組の次の出口へつなぐ
+        //（同じアンカーが2本だけなら今まで通りお互いが行き先になる）
+        //anchorsを渡すと、その組の土管とその組へ行く土管だけ決め直す
+        void resolve_warps(const std::string* anchors = nullptr){
+            auto touched = [&](char c){
+                return !anchors || (c != '\0' && anchors->find(c) != std::string::npos);
+            };
+            std::unordered_map<char,std::vector<int>> groups;
+            for(int i = 0; i < (int)warps.size(); i++){
+                if(warps[i].anchor != '\0') groups[warps[i].anchor].push_back(i);
+            }
+            for(auto& g : groups){
+                std::sort(g.second.begin(),g.second.end(),[&](int a,int b){
+                    if(warps[a].col != warps[b].col) return warps[a].col < warps[b].col;
+                    return warps[a].row < warps[b].row;
+                });
+            }
+            for(auto& g : groups){
+                const std::vector<int>& members = g.second;
+                int n = (int)members.size();
+                for(int k = 0; k < n; k++){
+                    WarpEntry& w = warps[members[k]];
+                    if(!touched(w.anchor) && !touched(w.dest)) continue;
+                    w.target = -1;
+                    if(!w.can_in) continue;
+                    if(w.dest != '\0'){
+                        auto it = groups.find(w.dest);
+                        if(it == groups.end()) continue;
+                        for(int j : it->second){
+                            if(j != members[k] && warps[j].can_out){
+                                w.target = j;
+                                break;
+                            }
+                        }
+                    }
+                    else{
+                        for(int step = 1; step < n; step++){
+                            int j = members[(k + step) % n];
+                            if(warps[j].can_out){
+                                w.target = j;
+                                break;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        //読み込み済みの行からワープ土管の索引を作り直す（ホットリロード後にも呼ぶ）
+        void build_warp_index(){
+            warps.clear();
+            warp_cells.clear();
+            for(int row = 0; row < (int)raw_lines.size(); row++){
+                index_warp_row(row,raw_lines[row]);
+            }
+            resolve_warps();
+        }
+
+        //(row,col)がワープ土管の上段ならwarpsの番号（なければ-1）
+        int warp_at(int row,int col)const{
+            auto it = warp_cells.find(cell_key(row,col));
+            return (it == warp_cells.end()) ? -1 : it->second;
+        }
+
+        //ステージファイルを行に分ける（空行は飛ばし、'*'の行は地下の開始位置として記録）
+        //'#'の行は指示（背景など）。directivesがあればそこに集める
+        static bool read_stage_lines(const char* filename,std::vector<std::string>& lines,int& underground_row,std::vector<std::string>* directives = nullptr){
+            std::ifstream file(filename);
+            if (!file) return false;
+            std::string line;
+            while(std::getline(file,line)){
+                add_stage_line(line,lines,underground_row,directives);
+            }
+            return true;
+        }
+        static void add_stage_line(const std::string& line,std::vector<std::string>& lines,int& underground_row,std::vector<std::string>* directives = nullptr){
+            if(line.empty())return;
+            if(line[0] == '*'){
+                underground_row = (int)lines.size();
+                return;
+            }
+            if(line[0] == '#'){
+                if(directives) directives->push_back(line);
+                return;
+            }
+            lines.push_back(line);
+        }
+
+        //指示の行から背景の層を決める（書いていなければ地上は空・雲・丘、地下はレンガの壁）
+        //  #bg sky clouds hills      地上の背景（遠い順）
+        //  #bg-under bricks          地下の背景
+        void set_backdrops(const std::vector<std::string>& directives){
+            backdrop_over = {Backdrops::find("sky"),Backdrops::find("clouds"),Backdrops::find("hills")};
+            backdrop_under = {Backdrops::find("bricks")};
+            directive_lines = (int)directives.size();
+            for(const std::string& line : directives){
+                std::vector<std::string_view> words;
+                std::string_view rest(line);
+                while(!rest.empty()){
+                    size_t begin = rest.find_first_not_of(" \t\r");
+                    if(begin == std::string_view::npos) break;
+                    size_t end = rest.find_first_of(" \t\r",begin);
+                    if(end == std::string_view::npos) end = rest.size();
+                    words.push_back(rest.substr(begin,end - begin));
+                    rest = rest.substr(end);
+                }
+                std::vector<int>* target = nullptr;
+                if(words[0] == "#bg") target = &backdrop_over;
+                else if(words[0] == "#bg-under") target = &backdrop_under;
+                if(!target) continue;
+                target->clear();
+                for(size_t i = 1; i < words.size(); i++){
+                    int id = Backdrops::find(words[i]);
+                    if(id < 0){
+                        SDL_Log("背景がありません: %.*s", (int)words[i].size(), words[i].data());
+                        continue;
+                    }
+                    if((int)target->size() < Backdrops::MAX_LAYERS) target->push_back(id);
+                }
+            }
+        }
+
+        //1行のうちcol_begin〜col_endだけ解析し直す（ホットリロード用）
+        //水・溶岩が変わったタイルはその場で環境マップを直す。環境マップより右に水・溶岩が増えたときだけtrue（作り直す）
+        bool reparse_cells(int row,const std::string& line,int col_begin,int col_end){
+            col_begin = std::max(col_begin,0);
+            int old_end = std::min(col_end,(int)tiles[row].size());
+            std::vector<Uint8> before;
+            for(int col = col_begin; col < old_end; col++){
+                before.push_back(medium_of(tiles[row][col]));
+            }
+            int width = (int)line.size();
+            tiles[row].resize(width,TILE_EMPTY);
+            boxes[row].resize(width,BOX_NONE);
+            enemies[row].resize(width,NO_ENEMY);
+            pipes[row].resize(width,PIPE_NORMAL);
+            raw_lines[row] = line;
+            int new_end = std::min(col_end,width);
+            for(int col = col_begin; col < new_end; col++){
+                unsigned char c = (unsigned char)line[col];
+                const TileChar& t = TILE_CHARS[c];
+                tiles[row][col] = t.tile;
+                boxes[row][col] = t.box;
+                enemies[row][col] = t.enemy;
+                pipes[row][col] = t.pipe;
+            }
+            bool rebuild = false;
+            for(int col = col_begin; col < std::max(old_end,new_end); col++){
+                Uint8 was = MEDIUM_NONE, now = MEDIUM_NONE;
+                if(col < old_end) was = before[col - col_begin];
+                if(col < new_end) now = medium_of(tiles[row][col]);
+                if(was == now) continue;
+                if(env_in_range(row,col)) update_environment_cell(row,col);
+                else rebuild = true;
+            }
+            return rebuild;
+        }
+
+        //各行の先頭位置だけ覚えておき、中身は load_chunk で必要な分だけ読む
+        bool open_stream(const char* filename){
+            tiles.clear();
+            boxes.clear();
+            enemies.clear();
+            pipes.clear();
+            raw_lines.clear();
+            clear_edits();
+            consumed.clear();
+            row_offsets.clear();
+            row_lengths.clear();
+            stream_width = 0;
+            warps.clear();
+            warp_cells.clear();
+            prefetched.clear();
+
+            stream_file = std::make_shared<std::ifstream>(filename,std::ios::binary);
+            if (!*stream_file) {
+                SDL_Log("ステージファイルが開けません: %s", filename);
+                stream_file.reset();
+                return false;
+            }
+            std::ifstream& file = *stream_file;
+            std::string line;
+            std::vector<std::string> directives;
+            while(true){
+                std::streamoff offset = file.tellg();
+                if(!std::getline(file,line)) break;
+                if(line.empty())continue;
+                if(line[0] == '*'){
+                    start_underground_row = (int)row_offsets.size();
+                    continue;
+                }
+                if(line[0] == '#'){
+                    directives.push_back(line);
+                    continue;
+                }
+                //ワープ土管だけはステージ全体を索引にしておく（行き先の先読みに使う）
+                index_warp_row((int)row_offsets.size(),line);
+                row_offsets.push_back(offset);
+                row_lengths.push_back((int)line.size());
+                stream_width = std::max(stream_width,(int)line.size());
+            }
+            file.clear();
+            resolve_warps();
+            set_backdrops(directives);
+
+            int rows = (int)row_offsets.size();
+            tiles.assign(rows,std::vector<TileType>(RING_COLS,TILE_EMPTY));
+            boxes.assign(rows,std::vector<ITEM_IN_BOX>(RING_COLS,BOX_NONE));
+            enemies.assign(rows,std::vector<EnemyType>(RING_COLS,NO_ENEMY));
+            pipes.assign(rows,std::vector<PIPETYPE>(RING_COLS,PIPE_NORMAL));
+            raw_lines.assign(rows,std::string(RING_COLS,'0'));
+            resident_chunk.assign(RESIDENT_CHUNKS,-1);
+            streaming = true;
+            return rows > 0;
+        }
+
+        //チャンクの生の文字をファイルから読む（行ごとにCHUNK_COLS文字、行の外は'0'）
+        std::string read_chunk(int chunk){
+            std::ifstream& file = *stream_file;
+            int col_begin = chunk * CHUNK_COLS;
+            int rows = (int)row_offsets.size();
+            std::string buf(rows * CHUNK_COLS,'0');
+            for(int row = 0; row < rows; row++){
+                int n = std::min(CHUNK_COLS,row_lengths[row] - col_begin);
+                if(n > 0){
+                    file.seekg(row_offsets[row] + col_begin);
+                    file.read(&buf[row * CHUNK_COLS],n);
+                }
+            }
+            return buf;
+        }
+
+        //ワープ先のチャンクを先に読んでおく（リングには載せないので今の画面はそのまま）
+        void prefetch_chunk(int chunk){
+            if(!streaming || chunk < 0 || chunk >= chunk_count()) return;
+            if(is_chunk_resident(chunk) || prefetched.count(chunk)) return;
+            if((int)prefetched.size() >= RESIDENT_CHUNKS) prefetched.clear();
+            prefetched[chunk] = read_chunk(chunk);
+        }
+
+        //チャンクをリングの該当スロットに読み込む（前に載っていたチャンクは上書きされる）
+        void load_chunk(int chunk){
+            int col_begin = chunk * CHUNK_COLS;
+            int base = slot(col_begin);
+            std::string buf;
+            auto pre = prefetched.find(chunk);
+            if(pre != prefetched.end()){
+                buf = std::move(pre->second);
+                prefetched.erase(pre);
+            }
+            else{
+                buf = read_chunk(chunk);
+            }
+            for(int row = 0; row < (int)row_offsets.size(); row++){
+                for(int i = 0; i < CHUNK_COLS; i++){
+                    unsigned char c = (unsigned char)buf[row * CHUNK_COLS + i];
+                    const TileChar& t = TILE_CHARS[c];
+                    tiles[row][base + i] = t.tile;
+                    boxes[row][base + i] = t.box;
+                    enemies[row][base + i] = t.enemy;
+                    pipes[row][base + i] = t.pipe;
+                    raw_lines[row][base + i] = (char)c;
+                }
+            }
+            //壊したブロックなどはファイルには無いので、このチャンクの書き換えを当て直す
+            auto edited = chunk_edits.find(chunk);
+            if(edited != chunk_edits.end()){
+                for(int i : edited->second){
+                    tiles[edits[i].row][slot(edits[i].col)] = edits[i].after;
+                }
+            }
+            resident_chunk[chunk % RESIDENT_CHUNKS] = chunk;
+        }
+        //first〜lastが常駐しているときに、遠く離れたチャンクの書き換えと取ったものを捨てる
+        void forget_far_chunks(int first,int last){
+            auto far = [&](int chunk){
+                return chunk < first - REMEMBERED_CHUNKS || chunk > last + REMEMBERED_CHUNKS;
+            };
+            for(auto it = consumed.begin(); it != consumed.end(); ){
+                if(far((int)(*it & 0xFFFFFFFF) / CHUNK_COLS)) it = consumed.erase(it);
+                else ++it;
+            }
+            bool any = false;
+            for(const auto& c : chunk_edits){
+                if(far(c.first) && !c.second.empty()) any = true;
+            }
+            if(!any) return;
+            //残す書き換えだけ詰めて、チャンクごとの番号を振り直す
+            std::vector<TileEdit> kept;
+            for(const TileEdit& e : edits){
+                if(!far(e.col / CHUNK_COLS)) kept.push_back(e);
+            }
+            clear_edits();
+            for(const TileEdit& e : kept) record_edit(e);
+        }
+        void consume(int row,int col){
+            if(streaming) consumed.insert(cell_key(row,col));
+        }
+        bool is_consumed(int row,int col)const{
+            return consumed.count(cell_key(row,col)) != 0;
+        }
+
+        void render(DrawList& out,int cameraX,int cameraY){
+            int start_row = 0;;
+            int end_row = (int)tiles.size();
+            if(!is_underground){
+                start_row = 0;
+                end_row = start_underground_row;
+            }
+            else{
+                start_row = start_underground_row;
+                end_row = (int)tiles.size();
+            }
+            render_backdrops(out,cameraX);
+            render_fluids(out,cameraX,cameraY,start_row,end_row);
+            //画面に入る列だけを見る
+            int first_col = std::max(0,cameraX / TILE_SIZE - 1);
+            for(int row = start_row; row < end_row; ++row){
+                int last_col = std::min(row_width(row),(cameraX + SCREEN_WIDTH) / TILE_SIZE + 1);
+                for(int col = first_col; col < last_col; ++col){
+                    int worldX = col * TILE_SIZE;
+                    int worldY = row * TILE_SIZE;
+        
+                    int screenX = worldX - cameraX;
+                    int screenY = worldY - cameraY;
+
+                    if (screenX + TILE_SIZE < 0 || screenX > SCREEN_WIDTH) continue;
+                    if (!is_resident(col)) continue;
+
+                    SDL_Rect r;
+                    r.x = screenX;
+                    r.y = screenY;
+                    r.w = TILE_SIZE;
                     r.h = TILE_SIZE;
 
-                    TileType t = tiles[row][col];
+                    TileType t = tiles[row][slot(col)];
                     if(t == TILE_GROUND){
-                        SDL_SetRenderDrawColor(renderer,100,60,20,255);
-                        SDL_RenderFillRect(renderer, &r);
+                        out.fill(r,100,60,20);
                     }
                     else if(t == TILE_BLOCK){
-                        SDL_SetRenderDrawColor(renderer,150,150,150,255);   
-                        SDL_RenderFillRect(renderer, &r);                 
+                        out.fill(r,150,150,150);
                     }
                     else if(t == TILE_ITEMBOX){
-                        SDL_SetRenderDrawColor(renderer,255,200,0,255); 
-                        SDL_RenderFillRect(renderer, &r);                       
+                        out.fill(r,255,200,0);
                     }
                     else if(t == TILE_PIPE ){
-                        SDL_SetRenderDrawColor(renderer,180,255,100,255); 
-                        SDL_RenderFillRect(renderer, &r);  
-                    }
-                    else if(t == TILE_LAVA){
-                        SDL_SetRenderDrawColor(renderer,255,80,0,255); 
-                        SDL_RenderFillRect(renderer, &r);
-                    }
-                    else if(t == TILE_OCEAN){
-                        SDL_SetRenderDrawColor(renderer,0,120,255,255); 
-                        SDL_RenderFillRect(renderer, &r);
+                        out.fill(r,180,255,100);
                     }
                 }
             }
@@ -297,154 +1662,866 @@ class Stage{
             int row = py / TILE_SIZE;
     
             if (row >= (int)tiles.size()) return false;
-            if (col >= (int)tiles[row].size()) return false;
+            if (col >= row_width(row)) return false;
+            if (!is_resident(col)) return false;
 
-            TileType t = tiles[row][col];
+            TileType t = tiles[row][slot(col)];
             return (t == TILE_GROUND || t == TILE_BLOCK || t == TILE_ITEMBOX|| t == TILE_PIPE);
         }
 
-        void hit_blocks(int px, int py, std::vector<item*>& items,SDL_Renderer* redenderer);
-
-        void change_tiles(int row,int col,TileType type){
-            tiles[row][col] = type;
+        void hit_blocks(int px, int py);
+
+        //水・溶岩を横に続く分だけまとめ、真上の行と同じ幅なら縦にも伸ばす
+        void build_fluid_quads(){
+            fluid_quads.clear();
+            fluid_bucket_begin.assign(1,0);
+            fluid_bucket_quads.clear();
+            fluid_dirty = false;
+            if(env_width == 0) return;
+            std::vector<int> open,next_open;  //前の行で縦に伸ばせる矩形
+            for(int row = 0; row < (int)tiles.size(); row++){
+                next_open.clear();
+                size_t k = 0;
+                int col = env_col_begin;
+                while(col < env_cols){
+                    Uint8 m = env_in_range(row,col) ? (medium_map[env_index(row,col)] & (MEDIUM_WATER | MEDIUM_LAVA)) : 0;
+                    if(!m){
+                        col++;
+                        continue;
+                    }
+                    bool surface = fluid_at(row - 1,col) != m;
+                    int end = col + 1;
+                    while(end < env_cols && fluid_at(row,end) == m && (fluid_at(row - 1,end) != m) == surface) end++;
+                    while(k < open.size() && fluid_quads[open[k]].col < col) k++;
+                    if(!surface && k < open.size()){
+                        FluidQuad& q = fluid_quads[open[k]];
+                        if(q.col == col && q.cols == end - col && q.medium == m){
+                            q.rows++;
+                            next_open.push_back(open[k]);
+                            col = end;
+                            continue;
+                        }
+                    }
+                    fluid_quads.push_back({row,col,1,end - col,m,surface});
+                    if(!surface) next_open.push_back((int)fluid_quads.size() - 1);
+                    col = end;
+                }
+                open.swap(next_open);
+            }
+            //矩形を列の区画に振り分ける（数えてから詰める）
+            int buckets = std::max(0,(env_cols - env_col_begin + FLUID_BUCKET_COLS - 1) / FLUID_BUCKET_COLS);
+            fluid_bucket_begin.assign(buckets + 1,0);
+            for(const FluidQuad& q : fluid_quads){
+                for(int b = fluid_bucket(q.col); b <= fluid_bucket(q.col + q.cols - 1); b++) fluid_bucket_begin[b + 1]++;
+            }
+            for(int b = 0; b < buckets; b++) fluid_bucket_begin[b + 1] += fluid_bucket_begin[b];
+            fluid_bucket_quads.resize(fluid_bucket_begin[buckets]);
+            std::vector<int> cursor(fluid_bucket_begin.begin(),fluid_bucket_begin.end() - 1);
+            for(int i = 0; i < (int)fluid_quads.size(); i++){
+                const FluidQuad& q = fluid_quads[i];
+                for(int b = fluid_bucket(q.col); b <= fluid_bucket(q.col + q.cols - 1); b++) fluid_bucket_quads[cursor[b]++] = i;
+            }
         }
-
-        TileType get_tiletype(int row,int col){
-            return tiles[row][col];
+        int fluid_bucket(int col)const{
+            return (col - env_col_begin) / FLUID_BUCKET_COLS;
         }
-        EnemyType get_enemytype(int row,int col){
-            return enemies[row][col];
+        Uint8 fluid_at(int row,int col)const{
+            if(!env_in_range(row,col)) return 0;
+            return medium_map[env_index(row,col)] & (MEDIUM_WATER | MEDIUM_LAVA);
         }
-        PIPETYPE get_pipetype(int row,int col){
-            return pipes[row][col];
+        //背景は層ごとに1回だけ貼る（帯の窓をカメラの位置×scrollだけずらす）
+        void render_backdrops(DrawList& out,int cameraX){
+            const std::vector<int>& layers = is_underground ? backdrop_under : backdrop_over;
+            for(size_t i = 0; i < layers.size(); i++){
+                const BackdropDef& def = Backdrops::ALL[layers[i]];
+                SDL_Texture* texture = texture_cache.backdrop(layers[i]);
+                if(!texture) continue;
+                int width = SCREEN_WIDTH + def.period;
+                int offset = ((int)(cameraX * def.scroll) % def.period + def.period) % def.period;
+                SDL_FRect uv = {(float)offset / width,0,(float)SCREEN_WIDTH / width,1};
+                out.copy(texture,{0,0,SCREEN_WIDTH,SCREEN_HEIGHT},(DrawLayer)(LAYER_BACKGROUND + i),SDL_FLIP_NONE,uv);
+            }
         }
-    };
-
-class GameObject{
-    public:
-        SDL_Rect dstRect;
-        SDL_Texture* texture = nullptr;
-        virtual ~GameObject() = default;
-        float vx,vy;
-        bool is_alive;
-        bool is_underground;
-        bool is_ocean;
-        float Gravity_status = Gravity;
-        virtual void init(int bx,int by){
-            dstRect.x = bx;dstRect.y = by;
-            is_alive = true;
+        //水・溶岩は矩形ごとに1回だけ積む。表面の帯は世界の位置と時間でずらした窓を切り出して波を流す
+        void render_fluids(DrawList& out,int cameraX,int cameraY,int start_row,int end_row){
+            if(fluid_dirty) build_fluid_quads();
+            TextureCache::FluidStrips strips = texture_cache.fluid_strips();
+            Uint64 frame = world->frame;
+            //溶岩は2秒周期で明るさが脈打つ
+            float glow = 0.5f + 0.5f * std::sin(frame * 2 * (float)M_PI / (FPS * 2));
+            Uint8 lava_g = (Uint8)(60 + 50 * glow);
+            int c0 = std::max(cameraX / TILE_SIZE,env_col_begin);
+            int c1 = std::min((cameraX + SCREEN_WIDTH - 1) / TILE_SIZE,env_cols - 1);
+            if(c0 > c1) return;
+            for(int b = fluid_bucket(c0); b <= fluid_bucket(c1); b++){
+                for(int n = fluid_bucket_begin[b]; n < fluid_bucket_begin[b + 1]; n++){
+                    const FluidQuad& q = fluid_quads[fluid_bucket_quads[n]];
+                    //区画をまたぐ矩形は、見えている最初の区画でだけ積む
+                    if(fluid_bucket(std::max(q.col,c0)) != b) continue;
+                    int r0 = std::max(q.row,start_row);
+                    int r1 = std::min(q.row + q.rows,end_row);
+                    if(r0 >= r1) continue;
+                    //画面の外は切り落とす（帯は画面幅の分しか貼れない）
+                    int x0 = std::max(q.col * TILE_SIZE - cameraX,0);
+                    int x1 = std::min((q.col + q.cols) * TILE_SIZE - cameraX,SCREEN_WIDTH);
+                    if(x0 >= x1) continue;
+                    SDL_Rect r = {x0,r0 * TILE_SIZE - cameraY,x1 - x0,(r1 - r0) * TILE_SIZE};
+                    bool lava = (q.medium & MEDIUM_LAVA) != 0;
+                    if(!q.surface || !strips.texture){
+                        if(lava) out.fill(r,255,lava_g,0);
+                        else out.fill(r,0,120,255);
+                        continue;
+                    }
+                    int speed = lava ? 1 : 2;  //1フレームに流れる画素
+                    int offset = (int)(((Uint64)(x0 + cameraX) + frame * speed) % TextureCache::FLUID_PERIOD);
+                    const SDL_FRect& band = lava ? strips.lava : strips.water;
+                    float scale = band.w / TextureCache::FLUID_STRIP_W;
+                    SDL_FRect uv = {band.x + offset * scale,band.y,r.w * scale,band.h};
+                    out.copy(strips.texture,r,LAYER_STAGE,SDL_FLIP_NONE,uv);
+                }
+            }
         }
-        virtual void render(SDL_Renderer* renderer,int cameraX,int cameraY){
-            if(!texture || !is_alive)return;
-            SDL_Rect Screen = dstRect;
-            Screen.x = dstRect.x - cameraX;
-            Screen.y = dstRect.y - cameraY;
-            SDL_RenderCopy(renderer,texture,NULL,&Screen);
-        };
-        virtual void cheak_is_ocean(Stage* stage){
-            int ts = stage->TILE_SIZE;
-
-            // チェックする4点（少し内側を取って誤判定防止）
-            int x1 = dstRect.x + 1;                 // 左
-            int x2 = dstRect.x + dstRect.w - 1;     // 右
-            int y1 = dstRect.y + 1;                 // 上
-            int y2 = dstRect.y + dstRect.h - 1;     // 下
-
-            int points[4][2] = {
-                {x1, y1}, // 左上
-                {x2, y1}, // 右上
-                {x1, y2}, // 左下
-                {x2, y2}  // 右下
-            };
 
-            for(int i = 0; i < 4; i++){
-                int px = points[i][0];
-                int py = points[i][1];
-                int col = px / ts;
-                int row = py / ts;
-
-                if(row < 0 || row >= stage->stageHeightInTiles()) continue;
-                if(col < 0 || col >= stage->stageWidthInTiles()) continue;
+        //読み込み後に水・溶岩の連結領域を作る（ストリーミング中は常駐している列だけ）
+        void build_environment(){
+            int rows = (int)tiles.size();
+            int col_begin = 0;
+            env_col_begin = 0;
+            env_width = streaming ? RING_COLS : 0;
+            if(streaming){
+                int first = INT_MAX, last = -1;
+                for(int chunk : resident_chunk){
+                    if(chunk < 0) continue;
+                    first = std::min(first,chunk);
+                    last = std::max(last,chunk);
+                }
+                if(last < 0) return;
+                col_begin = first * CHUNK_COLS;
+                env_col_begin = col_begin;
+                env_cols = std::min(stream_width,(last + 1) * CHUNK_COLS);
+            }
+            else{
+                for(int row = 0; row < rows; row++) env_width = std::max(env_width,row_width(row));
+                env_cols = env_width;
+            }
+            medium_map.assign(rows * env_width,MEDIUM_NONE);
+            medium_pair.assign(rows * env_width,MEDIUM_NONE);
+            region_map.assign(rows * env_width,-1);
+            regions.clear();
+            free_regions.clear();
+            for(int row = 0; row < rows; row++){
+                int end = std::min(env_cols,row_width(row));
+                for(int col = col_begin; col < end; col++){
+                    if(!is_resident(col)) continue;
+                    medium_map[env_index(row,col)] = medium_of(tiles[row][slot(col)]);
+                }
+            }
+            //4近傍で同じ媒質のタイルを塗りつぶして領域番号を振る
+            std::vector<std::pair<int,int>> stack;
+            for(int row = 0; row < rows; row++){
+                for(int col = col_begin; col < env_cols; col++){
+                    if(!env_in_range(row,col)) continue;
+                    Uint8 m = medium_map[env_index(row,col)];
+                    if(m == MEDIUM_NONE || region_map[env_index(row,col)] >= 0) continue;
+                    int id = (int)regions.size();
+                    Region region;
+                    region.medium = m;
+                    region.gravity_scale = (m == MEDIUM_WATER) ? 0.3 : 1.0;
+                    region.lethal = (m == MEDIUM_LAVA);
+                    region.tile_count = 0;
+                    stack.push_back({row,col});
+                    region_map[env_index(row,col)] = id;
+                    while(!stack.empty()){
+                        auto [r,c] = stack.back();
+                        stack.pop_back();
+                        region.tile_count++;
+                        const int dr[4] = {-1,1,0,0};
+                        const int dc[4] = {0,0,-1,1};
+                        for(int k = 0; k < 4; k++){
+                            int nr = r + dr[k], nc = c + dc[k];
+                            if(nc < col_begin || !env_in_range(nr,nc)) continue;
+                            int ni = env_index(nr,nc);
+                            if(medium_map[ni] != m || region_map[ni] >= 0) continue;
+                            region_map[ni] = id;
+                            stack.push_back({nr,nc});
+                        }
+                    }
+                    regions.push_back(region);
+                }
+            }
+            //危険な領域はビットにしておき、問い合わせ時に領域表を引かずに済ませる
+            for(int row = 0; row < rows; row++){
+                for(int col = col_begin; col < env_cols; col++){
+                    if(!env_in_range(row,col)) continue;
+                    int id = region_map[env_index(row,col)];
+                    if(id >= 0 && regions[id].lethal) medium_map[env_index(row,col)] |= MEDIUM_HAZARD;
+                }
+            }
+            for(int row = 0; row < rows; row++){
+                for(int col = col_begin; col < env_cols; col++){
+                    update_pair(row,col);
+                }
+            }
+            fluid_dirty = true;
+        }
 
-                if(stage->get_tiletype(row, col) == Stage::TILE_OCEAN){
-                    is_ocean = true;
-                    return;
+        //1タイルだけ変わったときの更新（前の領域から抜き、隣と同じ媒質ならその領域に入れる）
+        //2つの領域をつなぐタイルなら小さいほうを塗り替えて1つにする。切れたときは同じ番号のまま持つ（性質は媒質で決まるので困らない）
+        void update_environment_cell(int row,int col){
+            if(!env_in_range(row,col)) return;
+            int i = env_index(row,col);
+            //行が短くなって消えたタイルは何もない扱い
+            Uint8 m = MEDIUM_NONE;
+            if(slot(col) < (int)tiles[row].size()) m = medium_of(tiles[row][slot(col)]);
+            if(m != MEDIUM_NONE || (medium_map[i] & (MEDIUM_WATER | MEDIUM_LAVA))) fluid_dirty = true;
+            int old = region_map[i];
+            region_map[i] = -1;
+            if(old >= 0) release_region(old,1);
+            int id = -1;
+            if(m != MEDIUM_NONE){
+                //隣の領域のうち一番大きいものに入れ、ほかの隣は（同じ番号でも切れているかもしれないので）隣ごとに塗り替える
+                int near_row[4],near_col[4],near = 0;
+                const int dr[4] = {-1,1,0,0};
+                const int dc[4] = {0,0,-1,1};
+                for(int k = 0; k < 4; k++){
+                    int nr = row + dr[k], nc = col + dc[k];
+                    if(!env_in_range(nr,nc)) continue;
+                    int ni = env_index(nr,nc);
+                    int other = region_map[ni];
+                    if((medium_map[ni] & (MEDIUM_WATER | MEDIUM_LAVA)) != m || other < 0) continue;
+                    near_row[near] = nr;
+                    near_col[near] = nc;
+                    near++;
+                    if(id < 0 || regions[other].tile_count > regions[id].tile_count) id = other;
+                }
+                for(int k = 0; k < near; k++){
+                    int other = region_map[env_index(near_row[k],near_col[k])];
+                    if(other != id) merge_region(near_row[k],near_col[k],other,id);
                 }
+                if(id < 0){
+                    if(!free_regions.empty()){
+                        id = free_regions.back();
+                        free_regions.pop_back();
+                    }
+                    else{
+                        id = (int)regions.size();
+                        regions.emplace_back();
+                    }
+                    regions[id] = {m,(m == MEDIUM_WATER) ? 0.3 : 1.0,m == MEDIUM_LAVA,0};
+                }
+                regions[id].tile_count++;
+                if(regions[id].lethal) m |= MEDIUM_HAZARD;
             }
-            is_ocean = false;
+            medium_map[i] = m;
+            region_map[i] = id;
+            update_pair(row,col - 1);
+            update_pair(row,col);
         }
-        void update_gravity_status(Stage* stage){
-            cheak_is_ocean(stage);
-            if(is_ocean){
-                Gravity_status = Gravity * 0.3;
+        //(row,col)からつながっているfromのタイルをintoに塗り替える
+        void merge_region(int row,int col,int from,int into){
+            std::vector<std::pair<int,int>> stack = {{row,col}};
+            region_map[env_index(row,col)] = into;
+            int moved = 0;
+            while(!stack.empty()){
+                auto [r,c] = stack.back();
+                stack.pop_back();
+                moved++;
+                const int dr[4] = {-1,1,0,0};
+                const int dc[4] = {0,0,-1,1};
+                for(int k = 0; k < 4; k++){
+                    int nr = r + dr[k], nc = c + dc[k];
+                    if(!env_in_range(nr,nc) || region_map[env_index(nr,nc)] != from) continue;
+                    region_map[env_index(nr,nc)] = into;
+                    stack.push_back({nr,nc});
+                }
             }
-            else{
-                Gravity_status = Gravity;
+            regions[into].tile_count += moved;
+            release_region(from,moved);
+        }
+        void release_region(int id,int removed){
+            regions[id].tile_count -= removed;
+            if(regions[id].tile_count == 0) free_regions.push_back(id);
+        }
+
+        //矩形の4隅（x1,y1)-(x2,y2)がどの媒質に入っているか。1行につき1回（横に2タイルまで）引く
+        Environment query_environment(int x1,int y1,int x2,int y2)const{
+            Environment env = {MEDIUM_NONE,-1};
+            if(env_width == 0) return env;
+            int rows[2] = {y1 / TILE_SIZE,y2 / TILE_SIZE};
+            int c1 = x1 / TILE_SIZE;
+            int c2 = x2 / TILE_SIZE;
+            for(int k = 0; k < 2; k++){
+                int row = rows[k];
+                if(k == 1 && row == rows[0]) break;
+                bool in1 = env_in_range(row,c1);
+                bool in2 = env_in_range(row,c2);
+                if(in1 && in2 && c2 == c1 + 1){
+                    env.medium |= medium_pair[env_index(row,c1)];
+                }
+                else{
+                    if(in1) env.medium |= medium_map[env_index(row,c1)];
+                    if(in2) env.medium |= medium_map[env_index(row,c2)];
+                }
             }
+            //水に入っているときだけ領域番号を探す
+            if(env.medium & MEDIUM_WATER){
+                int cols[2] = {c1,c2};
+                for(int k = 0; k < 4 && env.region < 0; k++){
+                    int row = rows[k / 2], col = cols[k % 2];
+                    if(!env_in_range(row,col)) continue;
+                    int i = env_index(row,col);
+                    if(medium_map[i] & MEDIUM_WATER) env.region = region_map[i];
+                }
+            }
+            return env;
+        }
+
+        //足元の左右2点が危険な領域か
+        bool is_hazard_under(int left_x,int right_x,int foot_y)const{
+            if(env_width == 0) return false;
+            int row = foot_y / TILE_SIZE;
+            int col_L = left_x / TILE_SIZE;
+            int col_R = right_x / TILE_SIZE;
+            if(!env_in_range(row,col_L) || !env_in_range(row,col_R)) return false;
+            Uint8 m = (col_R == col_L + 1) ? medium_pair[env_index(row,col_L)]
+                                           : (medium_map[env_index(row,col_L)] | medium_map[env_index(row,col_R)]);
+            return (m & MEDIUM_HAZARD) != 0;
         }
-        bool check_LAVA(Stage* stage){
-            // マリオの足元付近の座標を取得
-            float foot_y  = dstRect.y + dstRect.h - 1;   // 足の少し上
-            float left_x  = dstRect.x + 1;               // 左端から少し内側
-            float right_x = dstRect.x + dstRect.w - 1;   // 右端から少し内側
 
-            // タイル座標に変換
-            int row    = static_cast<int>(foot_y)  / stage->TILE_SIZE;
-            int col_L  = static_cast<int>(left_x)  / stage->TILE_SIZE;
-            int col_R  = static_cast<int>(right_x) / stage->TILE_SIZE;
+        double region_gravity_scale(int region)const{
+            if(region < 0 || region >= (int)regions.size()) return 1.0;
+            return regions[region].gravity_scale;
+        }
 
-            // ステージ範囲外なら溶岩ではないとみなす
-            if (row < 0 || row >= stage->stageHeightInTiles()){
-                return false;
+        void change_tiles(int row,int col,TileType type){
+            //同じタイルへの書き換えは記録しない（チャンクを出し直すたびに記録が増えないように）
+            if(!is_resident(col) || tiles[row][slot(col)] == type) return;
+            set_tile(row,col,type);
+            update_environment_cell(row,col);
+        }
+
+        //読み込んだ後に書き換わったタイル（世界のスナップショットはステージを丸ごと写さず、これだけ持つ）
+        struct TileEdit{
+            int row,col;
+            TileType before,after;
+            bool operator==(const TileEdit& o)const{
+                return row == o.row && col == o.col && before == o.before && after == o.after;
             }
-            if (col_L < 0 || col_L >= stage->stageWidthInTiles()){
-                return false;
+        };
+        std::vector<TileEdit> edits;
+        //タイルを書き換えて記録する（常駐している列だけ）
+        void set_tile(int row,int col,TileType type){
+            TileType& t = tiles[row][slot(col)];
+            record_edit({row,col,t,type});
+            t = type;
+        }
+        void record_edit(const TileEdit& e){
+            if(streaming) chunk_edits[e.col / CHUNK_COLS].push_back((int)edits.size());
+            edits.push_back(e);
+        }
+        void clear_edits(){
+            edits.clear();
+            chunk_edits.clear();
+        }
+        //書き換えをtargetと同じにする。先頭の共通部分はそのままにして、違う分だけ戻してから当て直す
+        //（同じファイルを読み込んだステージどうしでだけ使える）
+        void restore_edits(const std::vector<TileEdit>& target){
+            size_t common = 0;
+            while(common < edits.size() && common < target.size() && edits[common] == target[common]) common++;
+            for(size_t i = edits.size(); i > common; i--){
+                const TileEdit& e = edits[i - 1];
+                if(streaming) chunk_edits[e.col / CHUNK_COLS].pop_back();
+                if(!is_resident(e.col)) continue;
+                tiles[e.row][slot(e.col)] = e.before;
+                if(medium_of(e.before) != medium_of(e.after)) update_environment_cell(e.row,e.col);
             }
-            if (col_R < 0 || col_R >= stage->stageWidthInTiles()){
-                return false; 
+            edits.resize(common);
+            for(size_t i = common; i < target.size(); i++){
+                const TileEdit& e = target[i];
+                //常駐していない列は記録だけしておき、読み込んだときに当てる
+                if(!is_resident(e.col)){
+                    record_edit(e);
+                    continue;
+                }
+                set_tile(e.row,e.col,e.after);
+                if(medium_of(e.before) != medium_of(e.after)) update_environment_cell(e.row,e.col);
             }
+        }
 
-            // 左足・右足下のタイルを取得
-            Stage::TileType tL = stage->get_tiletype(row, col_L);
-            Stage::TileType tR = stage->get_tiletype(row, col_R);
-
-            // どちらかが溶岩なら true
-            return(tL == Stage::TILE_LAVA || tR == Stage::TILE_LAVA);
+        TileType get_tiletype(int row,int col){
+            if(!is_resident(col)) return TILE_EMPTY;
+            return tiles[row][slot(col)];
+        }
+        EnemyType get_enemytype(int row,int col){
+            if(!is_resident(col)) return NO_ENEMY;
+            return enemies[row][slot(col)];
+        }
+        PIPETYPE get_pipetype(int row,int col){
+            if(!is_resident(col)) return PIPE_NORMAL;
+            return pipes[row][slot(col)];
         }
     };
 
-class Goal{
+static_assert(Stage::tile_chars_consistent(),"同じ文字に違うタイルが割り当てられています");
+constexpr std::array<Stage::TileChar,256> Stage::TILE_CHARS = Stage::make_tile_chars();
+static_assert(Stage::TILE_CHARS['s'].box == Stage::BOX_STAR && Stage::TILE_CHARS['H'].pipe == Stage::PIPE_FLOWER,"タイル表");
+static_assert(Stage::TILE_CHARS['x'].tile == Stage::TILE_EMPTY,"知らない文字は空白");
+
+#ifdef MARIO_EMBED_STAGES
+//embedded_stages.h はCMakeが *.map から作る（EMBED_STAGE(識別子, "ファイル名", R"(中身)") の並び）
+//知らない文字があればビルドが止まる
+#define EMBED_STAGE(id,name,text) \
+    constexpr std::string_view id##_text = text; \
+    static_assert(Stage::embedded_chars_known(id##_text),"埋め込むステージに知らない文字があります: " name); \
+    constexpr auto id##_grid = Stage::parse_embedded<Stage::count_embedded_rows(id##_text),Stage::count_embedded_cells(id##_text)>(id##_text);
+#include "embedded_stages.h"
+#undef EMBED_STAGE
+
+#define EMBED_STAGE(id,name,text) \
+    {name,id##_text,id##_grid.cells.data(),id##_grid.row_text.data(),id##_grid.row_cells.data(),(int)id##_grid.row_text.size(),id##_grid.underground_row},
+const Stage::EmbeddedStage EMBEDDED_STAGES[] = {
+#include "embedded_stages.h"
+};
+#undef EMBED_STAGE
+#endif
+
+const Stage::EmbeddedStage* Stage::find_embedded(const char* filename){
+#ifdef MARIO_EMBED_STAGES
+    std::string_view path = filename;
+    size_t slash = path.find_last_of("/\\");
+    std::string_view base = (slash == std::string_view::npos) ? path : path.substr(slash + 1);
+    for(const EmbeddedStage& e : EMBEDDED_STAGES){
+        if(path == e.name || base == e.name) return &e;
+    }
+#else
+    (void)filename;
+#endif
+    return nullptr;
+}
+
+//ベンチマーク用のステージを自動生成する（1-1.mapと同じ文字形式で出力）
+class StageGenerator{
     public:
-        SDL_Rect dstRect = {0,0,32,32*7};
-        SDL_Texture* texture = nullptr;
-        bool load_texture(SDL_Renderer* renderer){
-            IMG_Init(IMG_INIT_JPG | IMG_INIT_PNG);
-            SDL_Surface* surface = IMG_Load(Assets::GOAL);
-            if (!surface) {
-                SDL_Log("SDL_LoadBMP Error: %s", SDL_GetError());
-                return false;
+        struct Params{
+            int width = 116;              //横のタイル数
+            unsigned int seed = 1;        //同じseedなら同じステージ
+            double enemy_density = 0.05;  //1列あたりの敵の出現率
+            double item_density = 0.05;   //1列あたりのアイテム・コインの出現率
+            double water = 0.10;          //地下で水にする列の割合
+            double lava = 0.03;           //地上で溶岩にする列の割合
+            int warps = 2;                //ワープ土管の組数（地上と地下で1組）
+        };
+        //1-1と同じく地上16行・地下16行
+        static const int SECTION_HEIGHT = 16;
+        static const int GROUND_ROW = 11;
+        static const int MIN_WIDTH = 40;
+
+        explicit StageGenerator(const Params& p) : params(p), gen(p.seed){
+            if(params.width < MIN_WIDTH) params.width = MIN_WIDTH;
+        }
+
+        std::vector<std::string> generate(){
+            int W = params.width;
+            over.assign(SECTION_HEIGHT,std::string(W,'0'));
+            under.assign(SECTION_HEIGHT,std::string(W,'0'));
+            over_used.assign(W,false);
+            under_used.assign(W,false);
+            for(int row = GROUND_ROW; row < SECTION_HEIGHT; row++){
+                over[row].assign(W,'1');
+                under[row].assign(W,'1');
             }
-        
-            texture = SDL_CreateTextureFromSurface(renderer,surface);
-            SDL_FreeSurface(surface);
-            if (!texture) {
-                SDL_Log("SDL_CreateTextureFromSurface Error: %s", SDL_GetError());
+            //地下の左端の壁
+            for(int row = 6; row < GROUND_ROW; row++){
+                under[row][0] = '1';
+            }
+            //スタートとゴールの周りは平地のまま残す
+            reserve(over_used,0,8);
+            reserve(under_used,0,8);
+            reserve(over_used,W - 12,W);
+            reserve(under_used,W - 12,W);
+            over[GROUND_ROW - 1][4] = 'S';
+            over[GROUND_ROW - 1][W - 8] = 'G';
+
+            place_warps();
+            place_lava();
+            place_water();
+            place_pits_and_pipes();
+            place_enemies(over,over_used);
+            place_enemies(under,under_used);
+            place_items(over);
+            place_items(under);
+
+            std::vector<std::string> lines = over;
+            lines.push_back(std::string(W,'*'));
+            lines.insert(lines.end(),under.begin(),under.end());
+            return lines;
+        }
+
+        bool write(const char* filename){
+            std::vector<std::string> lines = generate();
+            std::ofstream file(filename);
+            if(!file){
+                SDL_Log("ステージファイルが書き込めません: %s", filename);
                 return false;
             }
+            for(const auto& line : lines){
+                file << line << '\n';
+            }
+            return (bool)file;
+        }
 
-            return true;
-        };
-        void render(SDL_Renderer* renderer,int cameraX,int cameraY){
-            if(texture){                
+    private:
+        Params params;
+        std::mt19937 gen;
+        std::vector<std::string> over;
+        std::vector<std::string> under;
+        std::vector<bool> over_used;
+        std::vector<bool> under_used;
+
+        //標準の分布はライブラリごとに結果が違うので、mt19937の出力から自分で作る（同じseedならどの環境でも同じステージ）
+        int rand_int(int lo,int hi){
+            Uint32 range = (Uint32)(hi - lo) + 1;
+            if(range == 0) return lo + (int)gen();
+            //割り切れない端数は捨てて引き直す（偏らないように）
+            Uint32 limit = 0xFFFFFFFFu - (0xFFFFFFFFu % range + 1) % range;
+            Uint32 x;
+            do{
+                x = (Uint32)gen();
+            }while(x > limit);
+            return lo + (int)(x % range);
+        }
+        bool chance(double p){
+            return (Uint32)gen() * 0x1p-32 < p;
+        }
+        void reserve(std::vector<bool>& used,int from,int to){
+            for(int col = std::max(from,0); col < std::min(to,(int)used.size()); col++){
+                used[col] = true;
+            }
+        }
+        bool is_free(const std::vector<bool>& used,int from,int to)const{
+            if(from < 0 || to > (int)used.size()) return false;
+            for(int col = from; col < to; col++){
+                if(used[col]) return false;
+            }
+            return true;
+        }
+        //空いている区間をランダムに探す（見つからなければ-1）
+        int find_free(const std::vector<bool>& used,int len){
+            int W = params.width;
+            for(int tries = 0; tries < 64; tries++){
+                int col = rand_int(8,W - 12 - len);
+                if(is_free(used,col - 1,col + len + 1)) return col;
+            }
+            return -1;
+        }
+        //2x2のワープ土管（上段: W+アンカー, 下段: i o）
+        void put_warp_pipe(std::vector<std::string>& sec,int col,char anchor){
+            sec[GROUND_ROW - 2][col]     = 'W';
+            sec[GROUND_ROW - 2][col + 1] = anchor;
+            sec[GROUND_ROW - 1][col]     = 'i';
+            sec[GROUND_ROW - 1][col + 1] = 'o';
+        }
+        void place_warps(){
+            int max_pairs = (int)strlen(Stage::WARP_ANCHORS);
+            int W = params.width;
+            int span = W - 24;
+            //等間隔の間隔に土管（前後の空きを入れて4列）が入る組数まで
+            max_pairs = std::min(max_pairs,std::max(span / 4 - 1,0));
+            int n = std::min(params.warps,max_pairs);
+            if(params.warps > max_pairs){
+                SDL_Log("ワープ土管は%d組までです（%d組に制限）", max_pairs, max_pairs);
+            }
+            for(int k = 0; k < n; k++){
+                char anchor = Stage::WARP_ANCHORS[k];
+                //地上は等間隔、地下は少しずらして置く。埋まっていたら空いている所を探す
+                int col_over = 10 + span * (k + 1) / (n + 1);
+                int col_under = 10 + span * k / (n + 1) + rand_int(0,3);
+                if(!is_free(over_used,col_over - 1,col_over + 3)) col_over = find_free(over_used,2);
+                if(!is_free(under_used,col_under - 1,col_under + 3)) col_under = find_free(under_used,2);
+                //片方だけだと出口のない土管になるので、両方置けるときだけ置く
+                if(col_over < 0 || col_under < 0){
+                    SDL_Log("ワープ土管 %c の置き場所がありません（この組は置きません）", anchor);
+                    continue;
+                }
+                put_warp_pipe(over,col_over,anchor);
+                reserve(over_used,col_over - 1,col_over + 3);
+                put_warp_pipe(under,col_under,anchor);
+                reserve(under_used,col_under - 1,col_under + 3);
+            }
+        }
+        void place_lava(){
+            int target = (int)(params.lava * (params.width - 20));
+            int placed = 0;
+            while(placed < target){
+                int len = rand_int(2,5);
+                int col = find_free(over_used,len);
+                if(col < 0) break;
+                for(int c = col; c < col + len; c++){
+                    over[GROUND_ROW][c] = 'L';
+                }
+                reserve(over_used,col - 1,col + len + 1);
+                placed += len;
+            }
+        }
+        void place_water(){
+            int target = (int)(params.water * (params.width - 20));
+            int placed = 0;
+            while(placed < target){
+                int len = rand_int(5,12);
+                int col = find_free(under_used,len);
+                if(col < 0) break;
+                for(int row = 1; row < GROUND_ROW; row++){
+                    for(int c = col; c < col + len; c++){
+                        under[row][c] = 'O';
+                    }
+                }
+                //水中には魚
+                for(int c = col + 1; c < col + len - 1; c++){
+                    if(chance(params.enemy_density * 2)){
+                        under[rand_int(2,GROUND_ROW - 2)][c] = 'F';
+                    }
+                }
+                reserve(under_used,col - 1,col + len + 1);
+                placed += len;
+            }
+        }
+        void place_pits_and_pipes(){
+            for(int col = 8; col < params.width - 12; col++){
+                if(chance(0.02)){
+                    int len = rand_int(2,3);
+                    if(!is_free(over_used,col - 1,col + len + 1)) continue;
+                    for(int row = GROUND_ROW; row < SECTION_HEIGHT; row++){
+                        for(int c = col; c < col + len; c++){
+                            over[row][c] = '0';
+                        }
+                    }
+                    reserve(over_used,col - 1,col + len + 1);
+                }
+                else if(chance(0.02)){
+                    //パックンフラワーの土管
+                    if(!is_free(over_used,col - 1,col + 3)) continue;
+                    for(int row = GROUND_ROW - 2; row < GROUND_ROW; row++){
+                        over[row][col] = 'H';
+                        over[row][col + 1] = 'H';
+                    }
+                    reserve(over_used,col - 1,col + 3);
+                }
+            }
+        }
+        void place_enemies(std::vector<std::string>& sec,std::vector<bool>& used){
+            for(int col = 8; col < params.width - 12; col++){
+                if(used[col] || !chance(params.enemy_density)) continue;
+                if(sec[GROUND_ROW][col] != '1') continue;
+                if(chance(0.02)){
+                    //クッパは2x2なので1段上に置く
+                    if(!is_free(used,col,col + 2)) continue;
+                    sec[GROUND_ROW - 2][col] = 'B';
+                    reserve(used,col,col + 2);
+                }
+                else{
+                    sec[GROUND_ROW - 1][col] = chance(0.5) ? 'M' : 'T';
+                    used[col] = true;
+                }
+            }
+        }
+        void place_items(std::vector<std::string>& sec){
+            const char boxes[] = {'c','m','s','f'};
+            for(int col = 8; col < params.width - 14; col++){
+                if(!chance(params.item_density)) continue;
+                if(chance(0.5)){
+                    //浮いているコイン
+                    if(sec[4][col] == '0') sec[4][col] = '4';
+                }
+                else{
+                    //ブロックに挟まれたアイテムボックス
+                    if(sec[7][col] != '0' || sec[7][col + 1] != '0' || sec[7][col + 2] != '0') continue;
+                    sec[7][col] = '2';
+                    sec[7][col + 1] = boxes[rand_int(0,3)];
+                    sec[7][col + 2] = '2';
+                    col += 2;
+                }
+            }
+        }
+};
+
+//ステージファイルの変更を検知する（Linuxはinotify、それ以外は更新時刻を見る）
+class StageWatcher{
+    public:
+        ~StageWatcher(){
+#ifdef __linux__
+            if(fd >= 0) close(fd);
+#endif
+        }
+        bool start(const char* filename){
+#ifdef __linux__
+            //別のファイルを見直すときは前の監視を閉じる
+            if(fd >= 0){
+                close(fd);
+                fd = -1;
+            }
+#endif
+            path = filename;
+            std::string dir = ".";
+            size_t slash = path.find_last_of('/');
+            if(slash != std::string::npos){
+                dir = path.substr(0,slash);
+                name = path.substr(slash + 1);
+            }
+            else{
+                name = path;
+            }
+#ifdef __linux__
+            //エディタは別名で書いて置き換えることが多いのでディレクトリごと見る
+            fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if(fd >= 0 && inotify_add_watch(fd,dir.c_str(),IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) >= 0){
+                return true;
+            }
+            SDL_Log("inotifyが使えないので更新時刻で監視します: %s", filename);
+#endif
+            last_mtime = mtime();
+            return true;
+        }
+        //前回から変更があればtrue（毎フレーム呼んでよい）
+        bool changed(){
+            bool hit = false;
+#ifdef __linux__
+            if(fd >= 0){
+                alignas(inotify_event) char buf[4096];
+                ssize_t len;
+                while((len = read(fd,buf,sizeof(buf))) > 0){
+                    for(char* p = buf; p < buf + len; ){
+                        auto* ev = reinterpret_cast<inotify_event*>(p);
+                        if(ev->len > 0 && name == ev->name) hit = true;
+                        p += sizeof(inotify_event) + ev->len;
+                    }
+                }
+                return hit;
+            }
+#endif
+            //更新時刻のポーリングは30フレームに1回
+            if(++poll_counter % 30 != 0) return false;
+            long long t = mtime();
+            if(t != last_mtime){
+                last_mtime = t;
+                hit = true;
+            }
+            return hit;
+        }
+    private:
+        std::string path;
+        std::string name;
+        int fd = -1;
+        long long last_mtime = 0;
+        int poll_counter = 0;
+        long long mtime()const{
+            struct stat st;
+            if(stat(path.c_str(),&st) != 0) return 0;
+            return (long long)st.st_mtime;
+        }
+};
+
+class GameObject{
+    public:
+        SDL_Rect dstRect;
+        SDL_Texture* texture = nullptr;  //アトラス
+        SDL_FRect uv = {0,0,0,0};        //アトラスの中の画像（アニメーションしないとき）
+        AnimPlayer anim;                 //クリップがあればこちらのコマを出す
+        virtual ~GameObject() = default;
+        float vx,vy;
+        bool is_alive;
+        bool is_underground;
+        bool is_ocean;
+        int ocean_region = -1;
+        float Gravity_status = Gravity;
+        //生成元のタイル（ストリーミングやホットリロードで破棄するときに使う）
+        int spawn_row = -1;
+        int spawn_col = -1;
+        //時間切れの知らせ（codeは派生クラスごとの意味）
+        TimerNode timer;
+        void arm_timer(int code,Uint32 ms){
+            world->timers.arm(timer,this,code,ticks_for_ms(ms));
+        }
+        virtual void on_timer(int){}
+        virtual void init(int bx,int by){
+            dstRect.x = bx;dstRect.y = by;
+            is_alive = true;
+        }
+        virtual void render(DrawList& out,int cameraX,int cameraY){
+            if(!texture || !is_alive)return;
+            SDL_Rect Screen = dstRect;
+            Screen.x = dstRect.x - cameraX;
+            Screen.y = dstRect.y - cameraY;
+            draw(out,Screen);
+        };
+        //アトラスから切り出して積む（クリップがあればいまのコマ。flipは向きの反転）
+        void draw(DrawList& out,const SDL_Rect& dst,SDL_RendererFlip flip = SDL_FLIP_NONE){
+            if(!anim.clip){
+                out.copy(texture,dst,layer(),flip,uv);
+                return;
+            }
+            const AnimFrame& f = anim.frame(world->frame);
+            if(!f.asset) return;
+            out.copy(texture,dst,layer(),(SDL_RendererFlip)(flip ^ f.flip),f.uv);
+        }
+        //描画の層（ファイアボールなどはこのまま）
+        virtual DrawLayer layer()const{ return LAYER_EFFECT; }
+        virtual void cheak_is_ocean(Stage* stage){
+            // チェックする4点（少し内側を取って誤判定防止）を環境マップから引く
+            Stage::Environment env = stage->query_environment(
+                dstRect.x + 1,                 // 左
+                dstRect.y + 1,                 // 上
+                dstRect.x + dstRect.w - 1,     // 右
+                dstRect.y + dstRect.h - 1);    // 下
+            is_ocean = (env.medium & Stage::MEDIUM_WATER) != 0;
+            ocean_region = env.region;
+        }
+        void update_gravity_status(Stage* stage){
+            cheak_is_ocean(stage);
+            if(is_ocean){
+                Gravity_status = Gravity * stage->region_gravity_scale(ocean_region);
+            }
+            else{
+                Gravity_status = Gravity;
+            }
+        }
+        bool check_LAVA(Stage* stage){
+            // マリオの足元付近の座標を取得
+            float foot_y  = dstRect.y + dstRect.h - 1;   // 足の少し上
+            float left_x  = dstRect.x + 1;               // 左端から少し内側
+            float right_x = dstRect.x + dstRect.w - 1;   // 右端から少し内側
+
+            // 左足・右足下のどちらかが溶岩なら true（ステージ範囲外は溶岩ではないとみなす）
+            return stage->is_hazard_under(static_cast<int>(left_x),static_cast<int>(right_x),static_cast<int>(foot_y));
+        }
+    };
+
+class Goal{
+    public:
+        SDL_Rect dstRect = {0,0,32,32*7};
+        SDL_Texture* texture = nullptr;
+        SDL_FRect uv = {0,0,0,0};
+        bool load_texture(SDL_Renderer* renderer){
+            texture = texture_cache.sprite(renderer,Assets::GOAL,uv);
+            return texture != nullptr;
+        };
+        void render(DrawList& out,int cameraX,int cameraY){
+            if(texture){                
                 SDL_Rect Screen = dstRect;
                 Screen.x = dstRect.x - cameraX;
                 Screen.y = dstRect.y - cameraY;
-                SDL_RenderCopy(renderer,texture,NULL,&Screen);}
+                out.copy(texture,Screen,LAYER_GOAL,SDL_FLIP_NONE,uv);}
         };
         void init(int bx,int by,Stage* stage){
             dstRect.x = bx;
             dstRect.y = by - stage->TILE_SIZE*6;
+            is_placed = true;
         };
+        //ステージにゴールがあって、rectがポールに触れたか
+        bool is_touch(const SDL_Rect& rect)const{
+            return is_placed && SDL_HasIntersection(&rect,&dstRect);
+        }
+        bool is_placed = false;
+        int spawn_row = -1, spawn_col = -1;  //Gのタイル
 };
 //mario
 class Mario : public GameObject{
@@ -460,6 +2537,9 @@ class Mario : public GameObject{
         float jump_power = -15;
         bool is_running = false;
         Uint32 wall_kick_lock_until = 0;
+        //ジャンプの先行入力（押してからこのtick数のうちに跳べるようになれば跳ぶ）
+        static constexpr int JUMP_BUFFER_TICKS = 6;
+        int jump_buffer = 0;
         //コイン枚数
         int coin_count = 0;
         //状態
@@ -475,74 +2555,57 @@ class Mario : public GameObject{
         Uint32 invincible = 0;
         bool can_warp = true;
         bool face_right = true;
-        //テクスチャ
-        SDL_Texture* default_texture;
-        SDL_Texture* fire_texture;
-        SDL_Texture* star_texture;
-
+        bool is_spawned = false;
         bool load_texture(SDL_Renderer* renderer){
-            IMG_Init(IMG_INIT_JPG | IMG_INIT_PNG);
-            SDL_Surface* default_surface = IMG_Load(Assets::MARIO);
-            SDL_Surface* fire_surface = IMG_Load(Assets::FIREMARIO);
-            SDL_Surface* star_surface = IMG_Load(Assets::STARMARIO);
-            if (!default_surface || !fire_surface || !star_surface) {
-                SDL_Log("SDL_LoadBMP Error: %s", SDL_GetError());
-                return false;
-            }
-        
-            default_texture = SDL_CreateTextureFromSurface(renderer,default_surface);
-            fire_texture   = SDL_CreateTextureFromSurface(renderer,fire_surface);
-            star_texture   = SDL_CreateTextureFromSurface(renderer,star_surface);
-
-            SDL_FreeSurface(default_surface);
-            SDL_FreeSurface(fire_surface);
-            SDL_FreeSurface(star_surface);
-            if (!default_texture || !fire_texture || !star_texture) {
-                SDL_Log("SDL_CreateTextureFromSurface Error: %s", SDL_GetError());
-                return false;
-            }
-            return true;
+            texture = texture_cache.atlas(renderer);
+            anim.clip = &Anims::MARIO;
+            return texture != nullptr;
         };
-        //ジャンプ判定をする
-        void jump(const Stage* stage){
+        //ジャンプ判定をする（跳んだらtrue）
+        bool jump(const Stage* stage){
             if(is_ocean){
                 is_jumping = true;
                 vy = jump_power / 3;
+                world->emit(EVENT_JUMP,dstRect.y / Stage::TILE_SIZE,dstRect.x / Stage::TILE_SIZE);
+                return true;
             }
             else if(!is_jumping && (stage->is_solid_at_pixel(dstRect.x,dstRect.y + dstRect.h + 1) || stage->is_solid_at_pixel(dstRect.x + dstRect.w,dstRect.y + dstRect.h + 1))){
                 is_jumping = true;
                 vy = jump_power;
+                world->emit(EVENT_JUMP,dstRect.y / Stage::TILE_SIZE,dstRect.x / Stage::TILE_SIZE);
+                return true;
             }
+            return false;
         }
         //マリオの行動を更新
-        void update(Stage* stage,SDL_Renderer* renderer,std::vector<item*>& items,const Uint8* keys){
+        void update(Stage* stage,const Uint8* keys){
             if(check_LAVA(stage))is_alive = false;
             update_gravity_status(stage);
-            handle_vertical(stage,renderer,items,keys);
+            handle_vertical(stage,keys);
             handle_horizonal(keys,stage);
         }
-        void render(SDL_Renderer* renderer,int cameraX,int cameraY)override{
+        void render(DrawList& out,int cameraX,int cameraY)override{
             //状態で切り分け
             if(state == Super || state == Default){
-                texture = default_texture;
+                anim.play(Anims::MARIO,world->frame);
             }
             else if(state == Fire){
-                texture = fire_texture;
+                anim.play(Anims::FIRE_MARIO,world->frame);
             }
             else if(state == Star){
-                texture = star_texture;
+                anim.play(Anims::STAR_MARIO,world->frame);
             }
-            if(!texture || !is_alive)return;
-            if(state == Flash){
-                Uint32 t = SDL_GetTicks();
-                if(t % 2 == 1){return;}  
+            else if(state == Flash){
+                anim.play(prev_state == Fire ? Anims::FIRE_MARIO_FLASH : Anims::MARIO_FLASH,world->frame);
             }
+            if(!texture || !is_alive)return;
             SDL_Rect Screen = dstRect;
             Screen.x = dstRect.x - cameraX;
             Screen.y = dstRect.y - cameraY;
             SDL_RendererFlip flip = face_right ? SDL_FLIP_NONE : SDL_FLIP_HORIZONTAL;
-            SDL_RenderCopyEx(renderer,texture,NULL,&Screen,0,NULL,flip);
+            draw(out,Screen,flip);
         };
+        DrawLayer layer()const override{ return LAYER_MARIO; }
         void power_up(Stage* stage,MarioState s){
             if(s == Super && !(state == Fire)){
                 prev_state = state;
@@ -559,65 +2622,79 @@ class Mario : public GameObject{
             else if(s == Star){
                 prev_state = state;
                 state = Star;
-                invincible = SDL_GetTicks() + 5000;          
+                set_invincible(5000);
             }
 
         }
+        //無敵時間を決める（時間切れでFlash・Starから元に戻る）
+        void set_invincible(Uint32 ms){
+            invincible = world->ticks + ms;
+            arm_timer(0,ms);
+        }
+        void on_timer(int)override{
+            //マリオを無敵状態から戻す
+            if(state == Flash || state == Star){
+                state = prev_state;
+                invincible = 0;
+            }
+        }
         void power_down(Stage* stage){
             //無敵状態か判定
-            if(SDL_GetTicks() <= invincible){
+            if(world->ticks <= invincible){
                 return;
             }
             else{
                 if(state == Super){
                     prev_state = Default;
                     state = Flash;
-                    invincible = SDL_GetTicks() + 1500;
+                    set_invincible(1500);
                     dstRect.h = 32;
                     dstRect.y += stage->TILE_SIZE;    
                 }
                 else if(state == Fire){
                     prev_state = Super;
                     state = Flash;
-                    invincible = SDL_GetTicks() + 1500;
+                    set_invincible(1500);
                 }
                 else if(state == Default){
                     is_alive = false;
                 }
             }
         }
-        void wall_kick(Stage* stage,const Uint8* keys){
+        //壁キック（蹴ったらtrue）
+        bool wall_kick(Stage* stage,const Uint8* keys){
             float Right_x = dstRect.x + dstRect.w + 1;
             float Left_x = dstRect.x - 1;
             float mario_y = dstRect.y + dstRect.h / 2;
             float foot_y = dstRect.y + dstRect.h;
             //地面判定
             bool foot_solid = stage->is_solid_at_pixel((Right_x + Left_x)/2,foot_y);
-            if(foot_solid)return;
+            if(foot_solid)return false;
             //左右が壁ならtrue
             bool is_touch_right = stage->is_solid_at_pixel(Right_x,mario_y);
             bool is_touch_left = stage->is_solid_at_pixel(Left_x,mario_y);
-            if (!(is_touch_left || is_touch_right)) return;
+            if (!(is_touch_left || is_touch_right)) return false;
             if(is_touch_left){
                 vy -= 15;
                 vx = 10;
                 face_right = true;
-                wall_kick_lock_until = SDL_GetTicks() + 180;
+                wall_kick_lock_until = world->ticks + 180;
             }
             if(is_touch_right){
                 vy -= 15;
                 vx = -10;
                 face_right = false;
-                wall_kick_lock_until = SDL_GetTicks() + 180;
+                wall_kick_lock_until = world->ticks + 180;
             }        
+            return true;
         }
         void try_warp(Stage* stage);
         void fire(SDL_Renderer* renderer);
+        int warp_point(const Stage* stage)const;
 
     private:
-        Warp_Pipe* warp_point();
         //縦方向
-        void handle_vertical(Stage* stage,SDL_Renderer* renderer,std::vector<item*>& items,const Uint8* keys){
+        void handle_vertical(Stage* stage,const Uint8* keys){
             float max_fall_speed = 15.0f;
             if(vy >= max_fall_speed){
                 vy = max_fall_speed;
@@ -653,7 +2730,7 @@ class Mario : public GameObject{
             }
             //上が固体の時
             else if(head_solidL || head_solidR){
-                stage->hit_blocks(Left_x,head_y-4,items,renderer);
+                stage->hit_blocks(Left_x,head_y-4);
                 tileRow  = head_y / stage->TILE_SIZE;
                 int groundBottom = (tileRow + 1) * stage->TILE_SIZE + 1;
                 dstRect.y = groundBottom;
@@ -675,7 +2752,7 @@ class Mario : public GameObject{
             float Left_x = dstRect.x;
 
             // 壁キック直後は入力に関わらず、キック方向の速度を維持して移動する
-            if(SDL_GetTicks() < wall_kick_lock_until && vx != 0){
+            if(world->ticks < wall_kick_lock_until && vx != 0){
                 if(vx < 0){
                     face_right = false;
                     newleft = Left_x + vx;newright = Right_x + vx;
@@ -721,7 +2798,7 @@ class Mario : public GameObject{
 
             if(keys[SDL_SCANCODE_A]){
                 face_right = false;
-                if(SDL_GetTicks() < wall_kick_lock_until){
+                if(world->ticks < wall_kick_lock_until){
                     newleft = Left_x + vx;newright = Right_x + vx;   
                 }
                 else{
@@ -736,7 +2813,7 @@ class Mario : public GameObject{
             }
             if(keys[SDL_SCANCODE_D]){
                 face_right = true;
-                if(SDL_GetTicks() < wall_kick_lock_until){
+                if(world->ticks < wall_kick_lock_until){
                     newleft = Left_x + vx;newright = Right_x + vx;   
                 }
                 else{
@@ -754,12 +2831,12 @@ class Mario : public GameObject{
 
 class Fireball : public GameObject{
     public:
+        Fireball* clone()const{ return new Fireball(*this); }
         Fireball(){
             dstRect.h = 8;
             dstRect.w = 8;
             Gravity_status = Gravity;
         }
-        Uint32 duration = 0;
         void init(Mario* mario){
             //マリオの方向で分ける
             if(mario->vx >= 0){
@@ -770,33 +2847,24 @@ class Fireball : public GameObject{
                 vx = -4;
             }
             is_alive = true;
-            duration = SDL_GetTicks() + 5000;
+            arm_timer(0,5000);  //5秒で消える
             vy = 0;
         }
         bool load_texture(SDL_Renderer* renderer){
-            IMG_Init(IMG_INIT_JPG | IMG_INIT_PNG);
-            SDL_Surface* surface = IMG_Load(Assets::FIREBALL);
-            if (!surface) {
-                SDL_Log("SDL_LoadBMP Error: %s", SDL_GetError());
-                return false;
-            }
-        
-            texture = SDL_CreateTextureFromSurface(renderer,surface);
-            SDL_FreeSurface(surface);
-            if (!texture) {
-                SDL_Log("SDL_CreateTextureFromSurface Error: %s", SDL_GetError());
-                return false;
-            }
-            return true;
+            texture = texture_cache.sprite(renderer,Assets::FIREBALL,uv);
+            return texture != nullptr;
         };
         void update(Stage* stage){
             cheak_is_ocean(stage);
             handle_vertical(stage);
             handle_horizonal(stage);
-            if(SDL_GetTicks() >= duration || check_LAVA(stage)){
+            if(check_LAVA(stage)){
                 is_alive = false;
             }
         }        
+        void on_timer(int)override{
+            is_alive = false;
+        }
     private:
         void handle_vertical(const Stage* stage){
         vy += Gravity_status;        
@@ -850,6 +2918,8 @@ class Fireball : public GameObject{
     //enemy
 class Enemy : public GameObject{
     public:
+        //スナップショット用の複製（派生クラスごとに自分の型で写す）
+        virtual Enemy* clone()const{ return new Enemy(*this); }
         Enemy(){
             dstRect.h = 32;
             dstRect.w = 32;
@@ -857,7 +2927,90 @@ class Enemy : public GameObject{
             vy = 0;
         }
         bool face_right = true;
-        virtual void is_collision_mario(Mario* mario,Stage* stage){
+
+        //振る舞いのコルーチンが待っているもの。待っている間は何もしない（タイマー・着地・マリオに触られたときだけ起こす）
+        //写しはコルーチンを持たず、次に起こされたときに頭から作り直す。作り直したコルーチンは最初のco_awaitで
+        //写した待ちを引き継ぐので、ループの頭から今の待ちにたどり着くように書く（どこで待っているかはメンバーに持つ）
+        enum Wait : Uint8{
+            WAIT_START,   //まだ始めていない（最初のupdateの後に始める）
+            WAIT_NONE,    //振る舞いがない・終わった
+            WAIT_TICKS,
+            WAIT_LANDED,
+            WAIT_TOUCH,
+        };
+        //マリオに触られた向き（WAIT_TOUCHで受け取る）
+        struct Touch{
+            bool from_above = false;
+            bool mario_right = false;  //マリオが右側にいた
+        };
+        Wait wait = WAIT_START;
+        bool woke = true;       //待ちが終わった（次のresume_scriptで進める）
+        bool adopting = false;  //作り直したコルーチンが、最初のco_awaitで記録どおりの待ちを引き継ぐ
+        Touch touch;
+        Script script;
+
+        //振る舞い（コルーチンにするものだけ上書きする）
+        virtual Script behave(){ return {}; }
+        //起こされた振る舞いを次の待ちまで進める（シミュレーションの順番が決まったところでだけ呼ぶ）
+        void resume_script(){
+            woke = false;
+            if(!is_alive || wait == WAIT_NONE) return;
+            if(!script){
+                adopting = wait != WAIT_START;
+                script = behave();
+                if(!script){
+                    wait = WAIT_NONE;
+                    return;
+                }
+            }
+            script.resume();
+            if(script.done()){
+                wait = WAIT_NONE;
+                script.reset();
+            }
+        }
+        //co_awaitで待つもの
+        struct Await{
+            Enemy* self;
+            Wait kind;
+            Uint64 due;
+            bool await_ready(){
+                if(self->adopting){
+                    //写した待ちはもう終わっている（終わったので起こされ、作り直した）
+                    self->adopting = false;
+                    if(self->wait == kind) return true;
+                }
+                return kind == WAIT_TICKS && due <= world->frame;
+            }
+            void await_suspend(std::coroutine_handle<>){
+                self->wait = kind;
+                //写しのタイマーは同じ時刻で繋ぎ直されるので、待ちの種類だけ覚えておけばよい
+                if(kind == WAIT_TICKS) world->timers.arm(self->timer,self,0,due - world->frame);
+            }
+            Touch await_resume()const{ return self->touch; }
+        };
+        //n tick後まで
+        Await ticks(Uint64 n){ return {this,WAIT_TICKS,world->frame + n}; }
+        //足元に地面があって止まるまで
+        Await until_landed(){ return {this,WAIT_LANDED,0}; }
+        //マリオに触られるまで（触られ方を返す）
+        Await touched(){ return {this,WAIT_TOUCH,0}; }
+        void on_timer(int)override{
+            if(wait == WAIT_TICKS) resume_script();
+        }
+        //マリオに触られたことを振る舞いに知らせる（当たり判定から呼ぶ）
+        void notify_touch(const Mario* mario,bool from_above){
+            if(wait != WAIT_TOUCH) return;
+            touch.from_above = from_above;
+            touch.mario_right = mario->dstRect.x > dstRect.x;
+            resume_script();
+        }
+        bool standing(const Stage* stage)const{
+            float foot_y = dstRect.y + dstRect.h;
+            return vy == 0 && (stage->is_solid_at_pixel(dstRect.x,foot_y) || stage->is_solid_at_pixel(dstRect.x + dstRect.w,foot_y));
+        }
+
+        virtual void is_collision_mario(Mario* mario){
             if (!is_alive) return;
         
             float m_foot = mario->dstRect.y + mario->dstRect.h;
@@ -871,19 +3024,21 @@ class Enemy : public GameObject{
                 }
                 if(m_foot <= e_head + margin){
                     is_alive = false;
-                    if(mario->is_ocean){
-                        mario->vy = -2;
-                    }
-                    else{
-                        mario->vy = -10;
-                    }
+                    stomp(mario);
                 }
                 else{
-                    mario->power_down(stage);
+                    damage(mario);
                 }
             }
         
         }
+        //マリオへの影響は出来事として積む（踏んだら跳ね返り、横から当たったらダメージ）
+        void stomp(const Mario* mario){
+            world->emit(EVENT_STOMP,dstRect.y / Stage::TILE_SIZE,dstRect.x / Stage::TILE_SIZE,mario->is_ocean ? -2 : -10);
+        }
+        void damage(const Mario* mario){
+            world->emit(EVENT_DAMAGE,mario->dstRect.y / Stage::TILE_SIZE,mario->dstRect.x / Stage::TILE_SIZE);
+        }
         void is_collision_fireball(Fireball* fire){
             if (!is_alive || !fire->is_alive) return;
             if (SDL_HasIntersection(&fire->dstRect,&dstRect)){
@@ -899,34 +3054,25 @@ class Enemy : public GameObject{
             update_gravity_status(stage);
             handle_horizonal(stage);
             handle_vertical(stage);
+            //着地を待っている振る舞いは、この後の決まった順番のところで起こす
+            if(wait == WAIT_LANDED && standing(stage)) woke = true;
         }
 
         virtual bool load_texture(SDL_Renderer* renderer){
-            IMG_Init(IMG_INIT_JPG | IMG_INIT_PNG);
-            SDL_Surface* surface = IMG_Load(Assets::ENEMY_MASHROOM);
-            if (!surface) {
-                SDL_Log("SDL_LoadBMP Error: %s", SDL_GetError());
-                return false;
-            }
-        
-            texture = SDL_CreateTextureFromSurface(renderer,surface);
-            SDL_FreeSurface(surface);
-            if (!texture) {
-                SDL_Log("SDL_CreateTextureFromSurface Error: %s", SDL_GetError());
-                return false;
-            }
-
-            return true;
+            texture = texture_cache.atlas(renderer);
+            anim.clip = &Anims::MASHROOM_WALK;
+            return texture != nullptr;
         };
 
-        virtual void render(SDL_Renderer* renderer,int cameraX,int cameraY){
+        virtual void render(DrawList& out,int cameraX,int cameraY){
             if(texture && is_alive){                
                 SDL_Rect Screen = dstRect;
                 Screen.x = dstRect.x - cameraX;
                 Screen.y = dstRect.y - cameraY;
                 SDL_RendererFlip flip = face_right ? SDL_FLIP_NONE : SDL_FLIP_HORIZONTAL;
-                SDL_RenderCopyEx(renderer,texture,NULL,&Screen,0,NULL,flip);  }
+                draw(out,Screen,flip);  }
         };
+        DrawLayer layer()const override{ return LAYER_ENEMY; }
     protected:
         virtual void handle_horizonal(const Stage* stage){
             float newleft,newright;
@@ -978,12 +3124,12 @@ class Enemy : public GameObject{
     };
 
 class Mashroom : public Enemy{
+    public:
+        Enemy* clone()const override{ return new Mashroom(*this); }
 };
 
 class GreemTurtle : public Enemy{
     private:
-        SDL_Texture* texture_turtle = nullptr;
-        SDL_Texture* texture_shell = nullptr;
         enum State{
             WALK,
             STAMPED,
@@ -991,7 +3137,23 @@ class GreemTurtle : public Enemy{
         };
         State state = WALK;
     public:
-        void is_collision_mario(Mario* mario,Stage* stage)override{
+        Enemy* clone()const override{ return new GreemTurtle(*this); }
+        //踏まれたら甲羅になり、止まった甲羅は踏まれても横から触られても蹴られて走る。走る甲羅は踏まれると止まる
+        Script behave()override{
+            for(;;){
+                Touch t = co_await touched();
+                if(state == STAMPED){
+                    state = KICKED;
+                    world->emit(EVENT_KICK,dstRect.y / Stage::TILE_SIZE,dstRect.x / Stage::TILE_SIZE);
+                    vx = t.mario_right ? -4 : 4;
+                }
+                else if(t.from_above){
+                    state = STAMPED;
+                    vx = 0;
+                }
+            }
+        }
+        void is_collision_mario(Mario* mario)override{
             if (!is_alive) return;
         
             float m_foot = mario->dstRect.y + mario->dstRect.h;
@@ -1003,86 +3165,39 @@ class GreemTurtle : public Enemy{
                     is_alive = false;
                     return;
                 }
-                if(m_foot <= e_head + margin){
-                    //踏まれたら甲羅になる
-                    if(state == WALK){
-                        state = STAMPED;
-                        vx = 0;
-                    }
-                    //甲羅状態で踏まれたら走る
-                    else if(state == STAMPED){
-                        state = KICKED;
-                        mario->invincible = SDL_GetTicks() + 800;
-                        if(mario->dstRect.x > dstRect.x){
-                            vx = -4;
-                        }
-                        else{
-                            vx = 4;
-                        }
-                    }
-                    else if(state == KICKED){
-                        state = STAMPED;
-                        vx = 0;
-                    }
-                    if(mario->is_ocean){
-                        mario->vy = -2;
-                    }
-                    else{
-                        mario->vy = -10;
-                    }
+                bool from_above = m_foot <= e_head + margin;
+                //止まった甲羅は横から触っても痛くない（触られる前の状態で決める）
+                bool harmless = from_above || state == STAMPED;
+                notify_touch(mario,from_above);
+                if(from_above){
+                    stomp(mario);
                 }
-                else{
-                    if(state == STAMPED){
-                        state = KICKED;
-                        mario->invincible = SDL_GetTicks() + 800;
-                        if(mario->dstRect.x > dstRect.x){
-                            vx = -4;
-                        }
-                        else{
-                            vx = 4;
-                        }
-                    }
-                    else{
-                        mario->power_down(stage);
-                    }
+                else if(!harmless){
+                    damage(mario);
                 }
             }
         }
         bool load_texture(SDL_Renderer* renderer)override{
-            IMG_Init(IMG_INIT_JPG | IMG_INIT_PNG);
-            SDL_Surface* surface_turtle = IMG_Load(Assets::ENEMY_GREENTURTLE);
-            SDL_Surface* surface_shell = IMG_Load(Assets::ENEMY_GREENTURTLE_SHELL);
-            if (!surface_turtle || !surface_shell) {
-                SDL_Log("SDL_LoadBMP Error: %s", SDL_GetError());
-                return false;
-            }
-        
-            texture_turtle = SDL_CreateTextureFromSurface(renderer,surface_turtle);
-            texture_shell = SDL_CreateTextureFromSurface(renderer,surface_shell);
-            SDL_FreeSurface(surface_turtle);
-            SDL_FreeSurface(surface_shell);
-            if (!texture_shell || !texture_turtle) {
-                SDL_Log("SDL_CreateTextureFromSurface Error: %s", SDL_GetError());
-                return false;
-            }
-            texture = texture_turtle;
-
-            return true;
+            texture = texture_cache.atlas(renderer);
+            anim.clip = &Anims::TURTLE_WALK;
+            return texture != nullptr;
         };
-        void render(SDL_Renderer* renderer,int cameraX,int cameraY)override{
+        void render(DrawList& out,int cameraX,int cameraY)override{
             if(texture && is_alive){                
                 SDL_Rect Screen = dstRect;
                 Screen.x = dstRect.x - cameraX;
                 Screen.y = dstRect.y - cameraY;
                 SDL_RendererFlip flip = !face_right ? SDL_FLIP_NONE : SDL_FLIP_HORIZONTAL;
                 if(state == WALK){
-                    texture = texture_turtle;
-                    SDL_RenderCopyEx(renderer,texture,NULL,&Screen,0,NULL,flip);
+                    anim.play(Anims::TURTLE_WALK,world->frame);
+                }
+                else if(state == STAMPED){
+                    anim.play(Anims::SHELL_STOP,world->frame);
                 }
                 else{
-                    texture = texture_shell;
-                    SDL_RenderCopyEx(renderer,texture,NULL,&Screen,0,NULL,flip);
+                    anim.play(Anims::SHELL_SPIN,world->frame);
                 }
+                draw(out,Screen,flip);
             }
         };
 };
@@ -1097,10 +3212,21 @@ class Flower : public Enemy{
             HIDING,
         };
         State state = HIDDEN;
+        //各段階の長さ（ms）
+        static constexpr Uint32 PHASE_TIME[] = {2000,1000,2000,1000};
         Uint32 state_start = 0;
         int base_y = 0;
     public:
-        void render(SDL_Renderer* renderer,int cameraX,int cameraY)override{
+        Enemy* clone()const override{ return new Flower(*this); }
+        //段階ごとに決まった時間だけ待って次の段階へ
+        Script behave()override{
+            for(;;){
+                co_await ticks(ticks_for_ms(PHASE_TIME[state]));
+                state = static_cast<State>((state + 1) % 4);
+                state_start = world->ticks;
+            }
+        }
+        void render(DrawList& out,int cameraX,int cameraY)override{
             if (!texture || !is_alive) return;
 
             // ドカンの上端。ここより下は描画しない
@@ -1123,19 +3249,10 @@ class Flower : public Enemy{
             int visibleHeight = visibleBottom - spriteTop;
             if (visibleHeight <= 0) return;
         
-            // テクスチャのサイズを取得
-            int texW = 0, texH = 0;
-            SDL_QueryTexture(texture, nullptr, nullptr, &texW, &texH);
-        
-            // テクスチャ側での見える高さ（縦方向を同じ割合でトリム）
-            int srcH = texH * visibleHeight / dstRect.h;
-            int srcY = texH - srcH;  // 下から伸びてくるタイプならこういう指定もアリ
-        
-            SDL_Rect src;
-            src.x = 0;
-            src.y = srcY;
-            src.w = texW;
-            src.h = srcH;
+            // テクスチャ側での見える高さ（いまのコマの縦方向を同じ割合でトリム）
+            float srcH = (float)visibleHeight / dstRect.h;
+            const SDL_FRect& frame = anim.frame(world->frame).uv;
+            SDL_FRect uv = {frame.x,frame.y + frame.h * (1 - srcH),frame.w,frame.h * srcH};  // 下から伸びてくるタイプならこういう指定もアリ
         
             SDL_Rect dst;
             dst.x = dstRect.x - cameraX;
@@ -1143,34 +3260,17 @@ class Flower : public Enemy{
             dst.w = dstRect.w;
             dst.h = visibleHeight;    // 下は clipY までに抑える
         
-            SDL_RenderCopy(renderer, texture, &src, &dst);
+            out.copy(texture, dst, layer(), SDL_FLIP_NONE, uv);
         };
         bool load_texture(SDL_Renderer* renderer)override{
-            IMG_Init(IMG_INIT_JPG | IMG_INIT_PNG);
-            SDL_Surface* surface = IMG_Load(Assets::ENEMY_FLOWER);
-            if (!surface) {
-                SDL_Log("SDL_LoadBMP Error: %s", SDL_GetError());
-                return false;
-            }
-        
-            texture = SDL_CreateTextureFromSurface(renderer,surface);
-            SDL_FreeSurface(surface);
-            if (!texture) {
-                SDL_Log("SDL_CreateTextureFromSurface Error: %s", SDL_GetError());
-                return false;
-            }
-
-            return true;
+            texture = texture_cache.atlas(renderer);
+            anim.clip = &Anims::FLOWER_CHOMP;
+            return texture != nullptr;
         };
         void handle_horizonal(const Stage* stage)override{}
-        //上下に出たり消えたりする
+        //上下に出たり消えたりする（段階の切り替えはbehaveで、ここでは今の段階の位置を決めるだけ）
         void handle_vertical(const Stage* stage) override{
-            const Uint32 HIDDEN_TIME   = 2000;
-            const Uint32 APPEAR_TIME   = 1000;
-            const Uint32 APPEARED_TIME = 2000;
-            const Uint32 HIDE_TIME     = 1000;
-
-            Uint32 now = SDL_GetTicks();
+            Uint32 now = world->ticks;
 
             // 初回呼び出し時に基準位置と開始時間を記録
             if (state_start == 0) {
@@ -1185,39 +3285,21 @@ class Flower : public Enemy{
             switch (state){
                 case HIDDEN:
                     dstRect.y = static_cast<int>(bottom_y);
-                    if (elapsed >= HIDDEN_TIME) {
-                        state = APPEARING;
-                        state_start = now;
-                    }
                     break;
 
                 case APPEARING: {
-                    float t = std::min(1.0f, elapsed / static_cast<float>(APPEAR_TIME));
+                    float t = std::min(1.0f, elapsed / static_cast<float>(PHASE_TIME[APPEARING]));
                     dstRect.y = static_cast<int>(bottom_y - stage->TILE_SIZE * t);
-                    if (elapsed >= APPEAR_TIME) {
-                        state = APPEARED;
-                        state_start = now;
-                        dstRect.y = static_cast<int>(top_y);
-                    }
                     break;
                 }
 
                 case APPEARED:
                     dstRect.y = static_cast<int>(top_y);
-                    if (elapsed >= APPEARED_TIME) {
-                        state = HIDING;
-                        state_start = now;
-                    }
                     break;
 
                 case HIDING: {
-                    float t = std::min(1.0f, elapsed / static_cast<float>(HIDE_TIME));
+                    float t = std::min(1.0f, elapsed / static_cast<float>(PHASE_TIME[HIDING]));
                     dstRect.y = static_cast<int>(top_y + stage->TILE_SIZE * t);
-                    if (elapsed >= HIDE_TIME) {
-                        state = HIDDEN;
-                        state_start = now;
-                        dstRect.y = static_cast<int>(bottom_y);
-                    }
                     break;
                 }
             }
@@ -1226,25 +3308,13 @@ class Flower : public Enemy{
 
 class Fish : public Enemy{
     public:
+        Enemy* clone()const override{ return new Fish(*this); }
         Fish(){
             vx = -2;
         }
         bool load_texture(SDL_Renderer* renderer)override{
-            IMG_Init(IMG_INIT_JPG | IMG_INIT_PNG);
-            SDL_Surface* surface = IMG_Load(Assets::ENEMY_FISH);
-            if (!surface) {
-                SDL_Log("SDL_LoadBMP Error: %s", SDL_GetError());
-                return false;
-            }
-        
-            texture = SDL_CreateTextureFromSurface(renderer,surface);
-            SDL_FreeSurface(surface);
-            if (!texture) {
-                SDL_Log("SDL_CreateTextureFromSurface Error: %s", SDL_GetError());
-                return false;
-            }
-
-            return true;
+            texture = texture_cache.sprite(renderer,Assets::ENEMY_FISH,uv);
+            return texture != nullptr;
         };
         void handle_vertical(const Stage* stage)override{
             if(is_ocean)return;
@@ -1272,55 +3342,55 @@ class Fish : public Enemy{
 
 class Bowser : public Enemy{
     public:
+    Enemy* clone()const override{ return new Bowser(*this); }
     bool is_spawn = false;
     bool can_move = true;
     float spawn_x = 0;
     float spawn_y = 0;
+    bool jump_planned = false;  //次に着地したら大ジャンプ
+    //確率は自分の乱数で引く（タイマーで起こされる順番によらないように。最初に世界の乱数から種をもらう）
+    std::minstd_rand rng;
+    bool seeded = false;
+    SDL_Renderer* renderer = nullptr;  //炎の画像用
     Bowser(){
         dstRect.h = 32*2;
         dstRect.w = 32*2;
         vx = -2;
     }
     bool load_texture(SDL_Renderer* renderer)override{
-        IMG_Init(IMG_INIT_JPG | IMG_INIT_PNG);
-        SDL_Surface* surface = IMG_Load(Assets::ENEMY_BOWSER);
-        if (!surface) {
-            SDL_Log("SDL_LoadBMP Error: %s", SDL_GetError());
-            return false;
-        }
-    
-        texture = SDL_CreateTextureFromSurface(renderer,surface);
-        SDL_FreeSurface(surface);
-        if (!texture) {
-            SDL_Log("SDL_CreateTextureFromSurface Error: %s", SDL_GetError());
-            return false;
-        }
-
-        return true;
+        texture = texture_cache.sprite(renderer,Assets::ENEMY_BOWSER,uv);
+        return texture != nullptr;
     };
     void update(Stage* stage,SDL_Renderer* renderer)override{
-        if(check_LAVA(stage)){
-            is_alive = false;
-            return;
-        };
-        // Bowserも毎フレーム重力値を更新してジャンプが減衰するようにする
-        update_gravity_status(stage);
-        fire(renderer);
-        handle_horizonal(stage);
-        handle_vertical(stage);
+        this->renderer = renderer;
+        Enemy::update(stage,renderer);
     }
-    void fire(SDL_Renderer* renderer);
-    void handle_horizonal(const Stage* stage)override{
-        //スポーン位置を記録
+    //1秒ごとに、止まる（また歩き出す）か、炎を吐くか、次の着地で大ジャンプするかを決める
+    Script behave()override{
+        if(!seeded){
+            rng.seed(world->rng());
+            seeded = true;
+        }
+        for(;;){
+            if(jump_planned){
+                co_await until_landed();
+                vy = -15;
+                jump_planned = false;
+            }
+            co_await ticks(FPS);
+            if(chance(0.30)) can_move = !can_move;
+            if(chance(0.25)) fire(renderer);
+            jump_planned = chance(0.10);
+        }
+    }
+    void fire(SDL_Renderer* renderer);
+    void handle_horizonal(const Stage* stage)override{
+        //スポーン位置を記録
         if(!is_spawn){
             spawn_x = dstRect.x;
             spawn_y = dstRect.y;
             is_spawn = true;
         }
-        if(p_30){
-            can_move = !can_move;
-            p_30 = false;
-        }
         if(!can_move){
             return;
         }
@@ -1381,21 +3451,20 @@ class Bowser : public Enemy{
         else{
             dstRect.y = newY;
         }
-        //10秒に一回ランダムに大ジャンプ
-        if(p_10 && (foot_solidL || foot_solidR) && vy == 0){
-            vy = -15;
-            p_10 = false;
-        }
+    }
+    private:
+    bool chance(double p){
+        return std::uniform_real_distribution<double>(0.0,1.0)(rng) < p;
     }
 };
 
 class Fire : public GameObject{
     public:
+        Fire* clone()const{ return new Fire(*this); }
         Fire(){
             dstRect.h = 32;
             dstRect.w = 32;
         }
-        Uint32 duration = 0;
         void init(Bowser* bowser){
             //Bowserの方向で分ける
             if(bowser->vx >= 0){
@@ -1406,34 +3475,25 @@ class Fire : public GameObject{
                 vx = -4;
             }
             is_alive = true;
-            duration = SDL_GetTicks() + 5000;
+            arm_timer(0,5000);  //5秒で消える
             vy = 0;
         }
         bool load_texture(SDL_Renderer* renderer){
-            IMG_Init(IMG_INIT_JPG | IMG_INIT_PNG);
-            SDL_Surface* surface = IMG_Load(Assets::FIRE);
-            if (!surface) {
-                SDL_Log("SDL_LoadBMP Error: %s", SDL_GetError());
-                return false;
-            }
-        
-            texture = SDL_CreateTextureFromSurface(renderer,surface);
-            SDL_FreeSurface(surface);
-            if (!texture) {
-                SDL_Log("SDL_CreateTextureFromSurface Error: %s", SDL_GetError());
-                return false;
-            }
-            return true;
+            texture = texture_cache.sprite(renderer,Assets::FIRE,uv);
+            return texture != nullptr;
         };
         void update(Stage* stage){
             cheak_is_ocean(stage);
             handle_vertical(stage);
             handle_horizonal(stage);
-            if(SDL_GetTicks() >= duration || check_LAVA(stage)){
+            if(check_LAVA(stage)){
                 is_alive = false;
             }
         }        
-        void is_collision_mario(Mario* mario,Stage* stage){
+        void on_timer(int)override{
+            is_alive = false;
+        }
+        void is_collision_mario(Mario* mario){
             if (!is_alive) return;
             if(SDL_HasIntersection(&mario->dstRect,&dstRect)){
                 if(mario->state == Mario::Star){
@@ -1441,7 +3501,7 @@ class Fire : public GameObject{
                     return;
                 }
                 else{
-                    mario->power_down(stage);
+                    world->emit(EVENT_DAMAGE,mario->dstRect.y / Stage::TILE_SIZE,mario->dstRect.x / Stage::TILE_SIZE);
                 }
             }
         
@@ -1476,6 +3536,8 @@ class Fire : public GameObject{
 //item
 class item : public GameObject{
     public:
+        //スナップショット用の複製
+        virtual item* clone()const{ return new item(*this); }
         item(){
             dstRect.h = 32;
             dstRect.w = 32;
@@ -1483,11 +3545,12 @@ class item : public GameObject{
             vy = 0;
         }
         ~item() = default;
-        virtual void on_touch(Mario* mario,Stage* stage){}
-        bool check_touch(Mario* mario,Stage* stage){
+        //取られたときの出来事を積む
+        virtual void on_touch(){}
+        bool check_touch(const Mario* mario){
             if(!is_alive)return false;
             if(SDL_HasIntersection(&mario->dstRect,&dstRect)){
-                on_touch(mario,stage);
+                on_touch();
                 is_alive = false;
                 return true;
             };
@@ -1498,29 +3561,17 @@ class item : public GameObject{
             handle_vertical(stage);
         }
         virtual bool load_texture(SDL_Renderer* renderer){
-            IMG_Init(IMG_INIT_JPG | IMG_INIT_PNG);
-            SDL_Surface* surface = IMG_Load(Assets::SUPERMASHROOM);
-            if (!surface) {
-                SDL_Log("SDL_LoadBMP Error: %s", SDL_GetError());
-                return false;
-            }
-        
-            texture = SDL_CreateTextureFromSurface(renderer,surface);
-            SDL_FreeSurface(surface);
-            if (!texture) {
-                SDL_Log("SDL_CreateTextureFromSurface Error: %s", SDL_GetError());
-                return false;
-            }
-
-            return true;
+            texture = texture_cache.sprite(renderer,Assets::SUPERMASHROOM,uv);
+            return texture != nullptr;
         };
-        void render(SDL_Renderer* renderer,int cameraX,int cameraY){
+        void render(DrawList& out,int cameraX,int cameraY){
             if(texture && is_alive){                
                 SDL_Rect Screen = dstRect;
                 Screen.x = dstRect.x - cameraX;
                 Screen.y = dstRect.y - cameraY;
-                SDL_RenderCopy(renderer,texture,NULL,&Screen);}
+                draw(out,Screen);}
         };
+        DrawLayer layer()const override{ return LAYER_ITEM; }
     protected:
         virtual void handle_vertical(const Stage* stage){
             vy += Gravity_status;        
@@ -1572,25 +3623,13 @@ class item : public GameObject{
 
 class Coin : public item{
     public:
-        void on_touch(Mario* mario,Stage* stage)override{
-            mario->coin_count += 1;
+        item* clone()const override{ return new Coin(*this); }
+        void on_touch()override{
+            world->emit(EVENT_COIN,dstRect.y / Stage::TILE_SIZE,dstRect.x / Stage::TILE_SIZE);
         }
         bool load_texture(SDL_Renderer* renderer)override{
-            IMG_Init(IMG_INIT_JPG | IMG_INIT_PNG);
-            SDL_Surface* surface = IMG_Load(Assets::COIN);
-            if (!surface) {
-                SDL_Log("SDL_LoadBMP Error: %s", SDL_GetError());
-                return false;
-            }
-        
-            texture = SDL_CreateTextureFromSurface(renderer,surface);
-            SDL_FreeSurface(surface);
-            if (!texture) {
-                SDL_Log("SDL_CreateTextureFromSurface Error: %s", SDL_GetError());
-                return false;
-            }
-
-            return true;
+            texture = texture_cache.sprite(renderer,Assets::COIN,uv);
+            return texture != nullptr;
         };
         void handle_horizonal(const Stage* stage)override{}
         void handle_vertical(const Stage* stage)override{}
@@ -1598,52 +3637,28 @@ class Coin : public item{
 
 class SuperMashroom : public item{
     public:
-        void on_touch(Mario* mario,Stage* stage)override{
-            mario->power_up(stage,Mario::Super);
+        item* clone()const override{ return new SuperMashroom(*this); }
+        void on_touch()override{
+            world->emit(EVENT_POWER_UP,dstRect.y / Stage::TILE_SIZE,dstRect.x / Stage::TILE_SIZE,Mario::Super);
         }
         bool load_texture(SDL_Renderer* renderer)override{
-            IMG_Init(IMG_INIT_JPG | IMG_INIT_PNG);
-            SDL_Surface* surface = IMG_Load(Assets::SUPERMASHROOM);
-            if (!surface) {
-                SDL_Log("SDL_LoadBMP Error: %s", SDL_GetError());
-                return false;
-            }
-        
-            texture = SDL_CreateTextureFromSurface(renderer,surface);
-            SDL_FreeSurface(surface);
-            if (!texture) {
-                SDL_Log("SDL_CreateTextureFromSurface Error: %s", SDL_GetError());
-                return false;
-            }
-
-            return true;
+            texture = texture_cache.sprite(renderer,Assets::SUPERMASHROOM,uv);
+            return texture != nullptr;
         };
 };
 
 class Star : public item{
     public:
+        item* clone()const override{ return new Star(*this); }
         Star(){
             vy = -10;
         }
-        void on_touch(Mario* mario,Stage* stage)override{
-            mario->power_up(stage,Mario::Star);
+        void on_touch()override{
+            world->emit(EVENT_POWER_UP,dstRect.y / Stage::TILE_SIZE,dstRect.x / Stage::TILE_SIZE,Mario::Star);
         }
         bool load_texture(SDL_Renderer* renderer)override{
-            IMG_Init(IMG_INIT_JPG | IMG_INIT_PNG);
-            SDL_Surface* surface = IMG_Load(Assets::STAR);
-            if (!surface) {
-                SDL_Log("SDL_LoadBMP Error: %s", SDL_GetError());
-                return false;
-            }
-        
-            texture = SDL_CreateTextureFromSurface(renderer,surface);
-            SDL_FreeSurface(surface);
-            if (!texture) {
-                SDL_Log("SDL_CreateTextureFromSurface Error: %s", SDL_GetError());
-                return false;
-            }
-
-            return true;
+            texture = texture_cache.sprite(renderer,Assets::STAR,uv);
+            return texture != nullptr;
         };
         void handle_vertical(const Stage* stage)override{
             vy += Gravity_status;        
@@ -1670,28 +3685,16 @@ class Star : public item{
 };
 class FireFlower : public item{
     public:
+        item* clone()const override{ return new FireFlower(*this); }
         FireFlower(){
             vx = 0;
         }
-        void on_touch(Mario* mario,Stage* stage)override{
-            mario->power_up(stage,Mario::Fire);
+        void on_touch()override{
+            world->emit(EVENT_POWER_UP,dstRect.y / Stage::TILE_SIZE,dstRect.x / Stage::TILE_SIZE,Mario::Fire);
         }
         bool load_texture(SDL_Renderer* renderer)override{
-            IMG_Init(IMG_INIT_JPG | IMG_INIT_PNG);
-            SDL_Surface* surface = IMG_Load(Assets::FIREFLOWER);
-            if (!surface) {
-                SDL_Log("SDL_LoadBMP Error: %s", SDL_GetError());
-                return false;
-            }
-        
-            texture = SDL_CreateTextureFromSurface(renderer,surface);
-            SDL_FreeSurface(surface);
-            if (!texture) {
-                SDL_Log("SDL_CreateTextureFromSurface Error: %s", SDL_GetError());
-                return false;
-            }
-
-            return true;
+            texture = texture_cache.sprite(renderer,Assets::FIREFLOWER,uv);
+            return texture != nullptr;
         };
         void handle_vertical(const Stage* stage)override{
             vy += Gravity_status;        
@@ -1719,8 +3722,14 @@ class FireFlower : public item{
 //土管
 class Pipe{
     public:
+        //スナップショット用の複製
+        virtual Pipe* clone()const{ return new Pipe(*this); }
         SDL_Rect dstRect;
         SDL_Texture* texture = nullptr;
+        SDL_FRect uv = {0,0,0,0};
+        int spawn_row = -1;
+        int spawn_col = -1;
+        virtual ~Pipe() = default;
         void init(int bx,int by,int pipe_h,int pipe_w){
             dstRect.x = bx;
             dstRect.y = by;
@@ -1731,185 +3740,2835 @@ class Pipe{
             handle_horizonal(stage);
             handle_vertical(stage);
         }
-        virtual bool load_texture(SDL_Renderer* renderer){
-            IMG_Init(IMG_INIT_JPG | IMG_INIT_PNG);
-            SDL_Surface* surface = IMG_Load(Assets::PIPE);
-            if (!surface) {
-                SDL_Log("SDL_LoadBMP Error: %s", SDL_GetError());
-                return false;
+        virtual bool load_texture(SDL_Renderer* renderer){
+            texture = texture_cache.sprite(renderer,Assets::PIPE,uv);
+            return texture != nullptr;
+        };
+        void render(DrawList& out,int cameraX,int cameraY){
+            if(texture){                
+                SDL_Rect Screen = dstRect;
+                Screen.x = dstRect.x - cameraX;
+                Screen.y = dstRect.y - cameraY;
+                out.copy(texture,Screen,LAYER_PIPE,SDL_FLIP_NONE,uv);}
+        };
+    protected:
+        virtual void handle_vertical(const Stage* stage){
+        }
+        virtual void handle_horizonal(const Stage* stage){
+        }
+};
+
+class Warp_Pipe : public Pipe{
+    public:
+        Pipe* clone()const override{ return new Warp_Pipe(*this); }
+};
+
+//足元のワープ土管をステージの索引から引く（土管の数によらず1回）
+int Mario::warp_point(const Stage* stage) const {
+    int mario_center_x = dstRect.x + dstRect.w / 2;
+    int mario_foot_y   = dstRect.y + dstRect.h;
+    if (mario_center_x < 0 || mario_foot_y + 2 < 0) return -1;
+
+    int row = (mario_foot_y + 2) / stage->TILE_SIZE;
+    int col = mario_center_x / stage->TILE_SIZE;
+    int id = stage->warp_at(row, col);
+    if (id < 0) return -1;
+
+    int top = stage->warps[id].row * stage->TILE_SIZE;
+    if (abs(mario_foot_y - top) > 2) return -1;
+    return id;
+}
+
+//叩いたブロックを書き換え、出来事を積む（アイテムはWorld::flush_eventsで出す）
+void Stage::hit_blocks(int px, int py){
+    int col = px / TILE_SIZE;
+    int row = py / TILE_SIZE;
+
+    //頭が上端より上や行の右端より先にあるときは叩くブロックがない
+    if(px < 0 || py < 0 || !in_stage(row,col)){
+        rejected_lookups++;
+        return;
+    }
+    if(frozen || !is_resident(col)) return;
+    int s = slot(col);
+    TileType t = tiles[row][s];
+    if(t == TILE_BLOCK){
+        set_tile(row,col,TILE_EMPTY);
+        world->emit(EVENT_BLOCK_BROKEN,row,col);
+    }
+    else if(t == TILE_ITEMBOX){
+        world->emit(EVENT_ITEM_BOX,row,col,boxes[row][s]);
+        set_tile(row,col,TILE_BLOCK);
+    }
+}
+
+void Mario::try_warp(Stage* stage) {
+    float foot_y = dstRect.y + dstRect.h;
+    float left_x = dstRect.x;
+    float right_x = dstRect.x + dstRect.w;
+
+    bool foot_solidL = stage->is_solid_at_pixel(left_x,  foot_y + 1);
+    bool foot_solidR = stage->is_solid_at_pixel(right_x, foot_y + 1);
+    if (!(foot_solidL || foot_solidR)) {
+        return;
+    }
+
+    int pipeRow      = static_cast<int>(foot_y) / stage->TILE_SIZE;
+    int pipeColLeft  = static_cast<int>(left_x)  / stage->TILE_SIZE;
+    int pipeColRight = static_cast<int>(right_x) / stage->TILE_SIZE;
+
+    //足元がステージの外（左端より左・行の右端より先）なら土管ではない
+    auto is_warp_at = [&](int col){
+        if(left_x < 0 || !stage->in_stage(pipeRow,col)){
+            stage->rejected_lookups++;
+            return false;
+        }
+        return stage->get_pipetype(pipeRow,col) == Stage::PIPE_WARP;
+    };
+    bool on_warp = is_warp_at(pipeColLeft) || is_warp_at(pipeColRight);
+
+    if (!on_warp) {
+        return;
+    }
+
+    int id = warp_point(stage);
+    if (id < 0) return;
+    const Stage::WarpEntry& wp = stage->warps[id];
+    if (!wp.can_in) return;
+    if (wp.target < 0) return;
+    const Stage::WarpEntry& next_wp = stage->warps[wp.target];
+
+    dstRect.x = next_wp.col * stage->TILE_SIZE;
+    dstRect.y = next_wp.row * stage->TILE_SIZE - dstRect.h;
+    world->emit(EVENT_WARP,next_wp.row,next_wp.col,id);
+
+    //行き先は同じ面のこともあるので、出口の行で地上・地下を決める
+    stage->is_underground = (next_wp.row >= stage->start_underground_row);
+    if (stage->is_underground) {
+        world->cameraY = stage->start_underground_row * stage->TILE_SIZE;
+    } else {
+        world->cameraY = 0;
+    }
+}
+
+void Mario::fire(SDL_Renderer* renderer){
+     if(state == Fire || (state == Star && prev_state == Fire)){
+        Fireball* f = new Fireball();
+        f->init(this);
+        f->load_texture(renderer);
+        world->fire_balls.push_back(f);  
+        world->emit(EVENT_FIREBALL,dstRect.y / Stage::TILE_SIZE,dstRect.x / Stage::TILE_SIZE);
+     }
+     else{
+        return;
+     }
+
+}
+
+void Bowser::fire(SDL_Renderer* renderer){
+    Fire* f = new Fire();
+    f->init(this);
+    f->load_texture(renderer);
+    world->fires.push_back(f);
+    world->emit(EVENT_BOWSER_FIRE,dstRect.y / Stage::TILE_SIZE,dstRect.x / Stage::TILE_SIZE);
+}
+
+//./mario --gen out.map [--width N] [--scale K] [--seed S] [--enemy-density p] [--item-density p] [--water p] [--lava p] [--warps n]
+int run_stage_generator(int argc,char* argv[]){
+    if(argc < 3){
+        SDL_Log("使い方: %s --gen out.map [--width N] [--scale K] [--seed S] [--enemy-density p] [--item-density p] [--water p] [--lava p] [--warps n]", argv[0]);
+        return 1;
+    }
+    const char* out = argv[2];
+    StageGenerator::Params params;
+    for(int i = 3; i < argc; i += 2){
+        std::string opt = argv[i];
+        if(i + 1 >= argc){
+            SDL_Log("オプションの値がありません: %s", opt.c_str());
+            return 1;
+        }
+        const char* val = argv[i + 1];
+        if(opt == "--width") params.width = std::atoi(val);
+        //--scale Kは1-1の横幅のK倍
+        else if(opt == "--scale") params.width = 116 * std::atoi(val);
+        else if(opt == "--seed") params.seed = (unsigned int)std::strtoul(val,nullptr,10);
+        else if(opt == "--enemy-density") params.enemy_density = std::atof(val);
+        else if(opt == "--item-density") params.item_density = std::atof(val);
+        else if(opt == "--water") params.water = std::atof(val);
+        else if(opt == "--lava") params.lava = std::atof(val);
+        else if(opt == "--warps") params.warps = std::atoi(val);
+        else{
+            SDL_Log("不明なオプション: %s", opt.c_str());
+            return 1;
+        }
+    }
+    StageGenerator generator(params);
+    if(!generator.write(out)){
+        return 1;
+    }
+    SDL_Log("%s を生成しました（幅 %d, seed %u）", out, params.width, params.seed);
+    return 0;
+}
+
+//タイル単位の矩形 [row_begin,row_end) x [col_begin,col_end)
+struct TileRect{
+    int row_begin,row_end,col_begin,col_end;
+    bool intersects(const TileRect& o)const{
+        return row_begin < o.row_end && o.row_begin < row_end && col_begin < o.col_end && o.col_begin < col_end;
+    }
+    bool contains(int row,int col)const{
+        return row >= row_begin && row < row_end && col >= col_begin && col < col_end;
+    }
+    void unite(const TileRect& o){
+        row_begin = std::min(row_begin,o.row_begin);
+        row_end = std::max(row_end,o.row_end);
+        col_begin = std::min(col_begin,o.col_begin);
+        col_end = std::max(col_end,o.col_end);
+    }
+};
+
+//cameraXのときに常駐させるチャンクの範囲 [first, last]
+void stream_window(Stage& stage,int cameraX,int& first,int& last){
+    const int BEHIND = 2;
+    int count = stage.chunk_count();
+    int cam_chunk = std::max(0,cameraX / stage.TILE_SIZE) / Stage::CHUNK_COLS;
+    first = std::max(0,std::min(cam_chunk - BEHIND,count - Stage::RESIDENT_CHUNKS));
+    last = std::min(count - 1,first + Stage::RESIDENT_CHUNKS - 1);
+}
+
+//1フレーム分の入力（押している間のキーと、押した瞬間のキー）
+struct Action{
+    bool left = false;   //A
+    bool right = false;  //D
+    bool run = false;    //C
+    bool down = false;   //M（押している間）
+    bool jump = false;   //SPACE（押した瞬間）
+    bool warp = false;   //M（押した瞬間）
+    bool fire = false;   //N（押した瞬間）
+    bool restart = false; //R（押した瞬間。ステージの最初からやり直す）
+};
+
+//裏で読み込んだ次のステージ（解析済みのステージと、生成するタイルの一覧）
+struct PreparedStage{
+    Stage stage;
+    std::string filename;
+    std::vector<std::pair<int,int>> spawn_cells;
+    bool ok = false;
+};
+
+//ステージ全体から、敵・アイテム・土管などを生成するタイルを集める
+void collect_spawn_cells(PreparedStage& next){
+    Stage& stage = next.stage;
+    for(int row = 0; row < stage.stageHeightInTiles(); row++){
+        for(int col = 0; col < stage.row_width(row); col++){
+            Stage::TileType t = stage.get_tiletype(row,col);
+            if(t == Stage::TILE_COIN || t == Stage::TILE_ENEMY || t == Stage::TILE_GOAL ||
+               t == Stage::TILE_START || t == Stage::TILE_PIPE){
+                next.spawn_cells.push_back({row,col});
+            }
+        }
+    }
+}
+
+//読み込みスレッドで動く。ステージの解析・環境マップ・生成リスト・画像のデコードまで済ませる
+//（SDL_Rendererやエンティティの一覧には触らない）
+std::unique_ptr<PreparedStage> prepare_stage(std::string filename,bool use_stream,bool decode_images = true){
+    auto next = std::make_unique<PreparedStage>();
+    next->filename = filename;
+    Stage& stage = next->stage;
+    if(use_stream){
+        next->ok = stage.open_stream(filename.c_str());
+        if(next->ok){
+            int first,last;
+            stream_window(stage,0,first,last);
+            for(int chunk = first; chunk <= last; chunk++){
+                stage.load_chunk(chunk);
+            }
+            stage.build_environment();
+        }
+    }
+    else{
+        stage.load_stage(filename.c_str());
+        next->ok = stage.stageHeightInTiles() > 0;
+        if(next->ok){
+            collect_spawn_cells(*next);
+            stage.build_environment();
+        }
+    }
+    if(decode_images){
+        texture_cache.preload();
+    }
+    return next;
+}
+
+//StageGeneratorで作ったステージを、ファイルを通さずに準備する（画像は読まない）
+std::unique_ptr<PreparedStage> prepare_generated_stage(const StageGenerator::Params& params){
+    auto next = std::make_unique<PreparedStage>();
+    next->filename = "(generated)";
+    Stage& stage = next->stage;
+    StageGenerator generator(params);
+    stage.load_generated(generator.generate());
+    next->ok = stage.stageHeightInTiles() > 0;
+    if(next->ok){
+        collect_spawn_cells(*next);
+        stage.build_environment();
+    }
+    return next;
+}
+
+//決まった数のスレッドで仕事を分け合う（呼んだスレッドも手伝い、parallel_forが戻るときには全部終わっている）
+class ThreadPool{
+    public:
+        explicit ThreadPool(int n){
+            if(n < 1) n = 1;
+            for(int i = 1; i < n; i++){
+                threads.emplace_back([this]{ worker(); });
+            }
+        }
+        ~ThreadPool(){
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                stopping = true;
+            }
+            cv_work.notify_all();
+            for(auto& t : threads) t.join();
+        }
+        int size()const{
+            return (int)threads.size() + 1;
+        }
+        //fn(0)〜fn(count-1)を手の空いたスレッドから順に取っていく
+        void parallel_for(int count,const std::function<void(int)>& fn){
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                job = &fn;
+                job_count = count;
+                next_index = 0;
+                active = (int)threads.size();
+                generation++;
+            }
+            cv_work.notify_all();
+            run_job(fn,count);
+            std::unique_lock<std::mutex> lock(mtx);
+            cv_done.wait(lock,[this]{ return active == 0; });
+            job = nullptr;
+        }
+    private:
+        std::vector<std::thread> threads;
+        std::mutex mtx;
+        std::condition_variable cv_work;
+        std::condition_variable cv_done;
+        const std::function<void(int)>* job = nullptr;
+        int job_count = 0;
+        std::atomic<int> next_index{0};
+        int active = 0;
+        unsigned generation = 0;
+        bool stopping = false;
+
+        void run_job(const std::function<void(int)>& fn,int count){
+            int i;
+            while((i = next_index.fetch_add(1)) < count){
+                fn(i);
+            }
+        }
+        void worker(){
+            unsigned seen = 0;
+            while(true){
+                const std::function<void(int)>* fn;
+                int count;
+                {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    cv_work.wait(lock,[&]{ return stopping || generation != seen; });
+                    if(stopping) return;
+                    seen = generation;
+                    fn = job;
+                    count = job_count;
+                }
+                run_job(*fn,count);
+                {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    active--;
+                }
+                cv_done.notify_one();
+            }
+        }
+};
+
+//仕事（0〜count-1）をスレッドごとの列に分けて配り、自分の列が空いたら他の列の後ろから盗む
+//重さがばらついても（敵の多い領域があっても）手の空いたスレッドが引き受ける
+class WorkStealingScheduler{
+    public:
+        explicit WorkStealingScheduler(ThreadPool& pool) : pool(pool),queues(pool.size()){}
+        WorkStealingScheduler(const WorkStealingScheduler&) = delete;
+        WorkStealingScheduler& operator=(const WorkStealingScheduler&) = delete;
+
+        void run(int count,const std::function<void(int)>& fn){
+            Uint64 begin = SDL_GetPerformanceCounter();
+            int n = (int)queues.size();
+            //隣どうしの仕事が同じスレッドに行くように、ひと続きずつ配る
+            for(int q = 0; q < n; q++){
+                queues[q].tasks.clear();
+                for(int t = count * q / n; t < count * (q + 1) / n; t++){
+                    queues[q].tasks.push_back(t);
+                }
+            }
+            pool.parallel_for(n,[&](int self){
+                int task;
+                while(pop(self,task) || steal(self,task)){
+                    fn(task);
+                }
+            });
+            runs++;
+            tasks += count;
+            elapsed += SDL_GetPerformanceCounter() - begin;
+        }
+        void log()const{
+            if(runs == 0) return;
+            double ms = elapsed * 1000.0 / SDL_GetPerformanceFrequency();
+            SDL_Log("領域ごとの更新: %ld 回, 平均 %.3fms, 領域 平均 %.1f 個, 盗んだ %ld 回 (%d threads)",
+                runs, ms / runs, (double)tasks / runs, steals.load(), (int)queues.size());
+        }
+    private:
+        struct Queue{
+            std::mutex mtx;
+            std::deque<int> tasks;
+        };
+        bool pop(int self,int& task){
+            Queue& q = queues[self];
+            std::lock_guard<std::mutex> lock(q.mtx);
+            if(q.tasks.empty()) return false;
+            task = q.tasks.front();
+            q.tasks.pop_front();
+            return true;
+        }
+        bool steal(int self,int& task){
+            int n = (int)queues.size();
+            for(int k = 1; k < n; k++){
+                Queue& q = queues[(self + k) % n];
+                std::lock_guard<std::mutex> lock(q.mtx);
+                if(q.tasks.empty()) continue;
+                task = q.tasks.back();
+                q.tasks.pop_back();
+                steals++;
+                return true;
+            }
+            return false;
+        }
+
+        ThreadPool& pool;
+        std::vector<Queue> queues;
+        std::atomic<long> steals{0};
+        long runs = 0;
+        long tasks = 0;
+        Uint64 elapsed = 0;
+};
+
+//ある時点の世界の写し（World::snapshotで作り、World::restoreで戻す）
+//エンティティは複製を持ち、ステージは読み込み後に書き換わったタイルだけを持つので、ステージが長くても軽い
+//戻せるのは同じファイルを読み込んだ（ストリーミングしていない）世界だけ
+class WorldSnapshot{
+    public:
+        WorldContext context;   //fire_balls・firesはこのスナップショットが持つ複製
+        Mario mario;
+        Goal goal;
+        std::vector<item*> items;
+        std::vector<Enemy*> enemies;
+        std::vector<Pipe*> pipes;
+        std::vector<Stage::TileEdit> edits;
+        bool is_underground = false;
+
+        WorldSnapshot() = default;
+        WorldSnapshot(const WorldSnapshot&) = delete;
+        WorldSnapshot& operator=(const WorldSnapshot&) = delete;
+        ~WorldSnapshot(){
+            for (auto* it : items) delete it;
+            for (auto* e : enemies) delete e;
+            for (auto* p : pipes) delete p;
+            for (auto* f : context.fire_balls) delete f;
+            for (auto* f : context.fires) delete f;
+        }
+};
+
+//toの中身を消して、fromの各要素の複製に置き換える
+template<class T>
+void clone_all(const std::vector<T*>& from,std::vector<T*>& to){
+    for (auto* p : to) delete p;
+    to.clear();
+    to.reserve(from.size());
+    for (auto* p : from) to.push_back(p->clone());
+}
+
+//出来事の配り先。種類ごとに購読し、World::flush_eventsがフレームの決まったところでまとめて配る
+//（HUD・統計・プロファイラなど、更新のループに手を入れずに受け手を足せる）
+class EventBus{
+    public:
+        using Handler = std::function<void(const GameEvent&)>;
+        void subscribe(std::initializer_list<GameEventType> types,Handler handler){
+            Uint32 mask = 0;
+            for(GameEventType t : types) mask |= 1u << t;
+            subscribers.push_back({mask,std::move(handler)});
+        }
+        void subscribe_all(Handler handler){
+            subscribers.push_back({~0u,std::move(handler)});
+        }
+        //バッチごとに呼ばれる（どこで配ったかと件数。プロファイラ用）
+        void on_batch(std::function<void(const char* point,size_t count)> handler){
+            batch_handlers.push_back(std::move(handler));
+        }
+        bool empty()const{ return subscribers.empty() && batch_handlers.empty(); }
+        void publish(const char* point,const std::vector<GameEvent>& batch){
+            for(auto& h : batch_handlers) h(point,batch.size());
+            for(const Subscriber& sub : subscribers){
+                for(const GameEvent& e : batch){
+                    if(sub.mask & (1u << e.type)) sub.handler(e);
+                }
+            }
+        }
+    private:
+        struct Subscriber{
+            Uint32 mask;
+            Handler handler;
+        };
+        std::vector<Subscriber> subscribers;
+        std::vector<std::function<void(const char*,size_t)>> batch_handlers;
+};
+
+//1つのゲーム世界。ステージとその上のマリオ・敵・アイテム・土管をまとめて持つ
+//いくつ作っても互いに干渉しないので、別々のスレッドで同時に動かせる（rendererがnullptrなら描画しない）
+class World : public WorldContext{
+    public:
+        Stage stage;
+        Mario mario;
+        Goal goal;
+        std::vector<item*> items;
+        std::vector<Enemy*> enemies;
+        std::vector<Pipe*> pipes;
+        SDL_Renderer* renderer = nullptr;
+        EventBus bus;
+        //ストリーミング中に生成済みのチャンクの範囲 [first, last]
+        int spawned_chunk_first = 0;
+        int spawned_chunk_last = -1;
+        //trueならenterのたびに入った直後の写しを取っておく（restart用。遊ぶ世界だけ）
+        bool keep_baseline = false;
+        std::unique_ptr<WorldSnapshot> baseline;
+        //あれば敵・アイテムの移動を領域ごとに並列に行う（当たり判定は元の順番で1つずつなので、結果は1スレッドと同じ）
+        WorkStealingScheduler* update_scheduler = nullptr;
+        static constexpr int REGION_COLS = 16;            //1つの領域の幅（タイル）
+        static constexpr int PARALLEL_MIN_OBJECTS = 64;   //これより少なければ並列にしない
+    private:
+        std::vector<GameEvent> dispatching;
+        //領域分けの作業用（毎tick使い回す）
+        std::vector<std::pair<int,int>> region_members;  //(領域,objectsの番号)を並べたもの
+        std::vector<int> region_tasks;    //仕事tは region_members[region_tasks[t] 〜 region_tasks[t+1]-1]
+    public:
+
+        explicit World(SDL_Renderer* r = nullptr,unsigned seed = std::random_device{}()) : WorldContext(seed),renderer(r){}
+        World(const World&) = delete;
+        World& operator=(const World&) = delete;
+        ~World(){
+            for (auto* it : items) delete it;
+            for (auto* e : enemies) delete e;
+            for (auto* p : pipes) delete p;
+            for (auto* f : fire_balls) delete f;
+            for (auto* f : fires) delete f;
+        }
+
+        //今の状態を写す（ステージは書き換わったタイルだけ）
+        std::unique_ptr<WorldSnapshot> snapshot()const{
+            auto snap = std::make_unique<WorldSnapshot>();
+            WorldContext& ctx = snap->context;
+            ctx = *this;
+            ctx.fire_balls.clear();
+            ctx.fires.clear();
+            clone_all(fire_balls,ctx.fire_balls);
+            clone_all(fires,ctx.fires);
+            snap->mario = mario;
+            snap->goal = goal;
+            clone_all(items,snap->items);
+            clone_all(enemies,snap->enemies);
+            clone_all(pipes,snap->pipes);
+            snap->edits = stage.edits;
+            snap->is_underground = stage.is_underground;
+            return snap;
+        }
+        //snapshotの時点に戻す（rendererと読み込んだステージはこの世界のものをそのまま使う）
+        void restore(const WorldSnapshot& snap){
+            std::vector<Fireball*> own_balls = std::move(fire_balls);
+            std::vector<Fire*> own_fires = std::move(fires);
+            static_cast<WorldContext&>(*this) = snap.context;
+            fire_balls = std::move(own_balls);
+            fires = std::move(own_fires);
+            clone_all(snap.context.fire_balls,fire_balls);
+            clone_all(snap.context.fires,fires);
+            mario = snap.mario;
+            goal = snap.goal;
+            clone_all(snap.items,items);
+            clone_all(snap.enemies,enemies);
+            clone_all(snap.pipes,pipes);
+            //写しのタイマーは繋がっていないので、同じ時刻で登録し直す
+            timers.relink(probability_timer,nullptr);
+            timers.relink(mario.timer,&mario);
+            for (auto* e : enemies) timers.relink(e->timer,e);
+            for (auto* it : items) timers.relink(it->timer,it);
+            for (auto* f : fire_balls) timers.relink(f->timer,f);
+            for (auto* f : fires) timers.relink(f->timer,f);
+            stage.restore_edits(snap.edits);
+            stage.is_underground = snap.is_underground;
+        }
+
+        //出来事をこの世界に反映する（マリオの状態・アイテムの出現）
+        void apply_event(const GameEvent& e){
+            switch(e.type){
+                case EVENT_COIN:
+                    mario.coin_count += 1;
+                    break;
+                case EVENT_STOMP:
+                    mario.vy = e.value;
+                    break;
+                case EVENT_KICK:
+                    mario.set_invincible(800);
+                    break;
+                case EVENT_POWER_UP:
+                    mario.power_up(&stage,static_cast<Mario::MarioState>(e.value));
+                    break;
+                case EVENT_DAMAGE:
+                    mario.power_down(&stage);
+                    break;
+                case EVENT_ITEM_BOX:
+                    spawn_box_item(e.row,e.col,static_cast<Stage::ITEM_IN_BOX>(e.value));
+                    break;
+                default:
+                    break;
+            }
+        }
+        //叩いたアイテムボックスの上に中身を出す
+        void spawn_box_item(int row,int col,Stage::ITEM_IN_BOX box){
+            item* c = nullptr;
+            if(box == Stage::BOX_COIN) c = new Coin();
+            else if(box == Stage::BOX_SUPERMASHROOM) c = new SuperMashroom();
+            else if(box == Stage::BOX_STAR) c = new Star();
+            else if(box == Stage::BOX_FIREFLOWER) c = new FireFlower();
+            if(!c) return;
+            c->init(col * stage.TILE_SIZE,(row - 1) * stage.TILE_SIZE);
+            c->spawn_row = row;
+            c->spawn_col = col;
+            c->load_texture(renderer);
+            items.push_back(c);
+        }
+
+        //1タイル分の敵・アイテム・土管などを生成する
+        void spawn_cell(int row,int col){
+            if(stage.is_consumed(row,col)) return;
+            if(stage.get_tiletype(row,col) == Stage::TILE_COIN){
+                int worldX = col * stage.TILE_SIZE;
+                int worldY = row * stage.TILE_SIZE;
+
+                Coin* c = new Coin();
+                if(row <= stage.start_underground_row){
+                    c->is_underground = false;
+                }else{
+                    c->is_underground = true;
+                }
+                c->init(worldX,worldY);
+                c->spawn_row = row;
+                c->spawn_col = col;
+                c->load_texture(renderer);
+                items.push_back(c);      
+            }
+            //水の中の敵はタイルが水に書き換わっているので、敵の種類で見る（チャンクを読み直したとき）
+            else if(stage.get_tiletype(row,col) == Stage::TILE_ENEMY || stage.get_enemytype(row,col) != Stage::NO_ENEMY){
+                int worldX = col * stage.TILE_SIZE;
+                int worldY = row * stage.TILE_SIZE;
+                Enemy* e = nullptr;
+                auto kind = stage.get_enemytype(row,col);
+                if(kind == Stage::ENEMY_MASHROOM){
+                    e = new Mashroom();
+                    e->load_texture(renderer);
+                }
+                else if(kind == Stage::ENEMY_GREENTURTLE){
+                    e = new GreemTurtle();
+                    e->load_texture(renderer);          
+                }
+                else if(kind == Stage::ENEMY_FISH){
+                    e = new Fish();
+                    e->load_texture(renderer);          
+                }
+                else if(kind == Stage::ENEMY_BOWSER){
+                    e = new Bowser();
+                    e->load_texture(renderer);          
+                }
+                if(e){
+                    e->init(worldX,worldY);
+                    e->spawn_row = row;
+                    e->spawn_col = col;
+                    if(row <= stage.start_underground_row){
+                        e->is_underground = false;
+                    }else{
+                        e->is_underground = true;
+                    }
+                    enemies.push_back(e);   
+                } 
+                int ocean_count = 0;
+                int H = stage.stageHeightInTiles();
+                int W = stage.stageWidthInTiles();
+
+                if (row > 0 && stage.get_tiletype(row-1, col) == Stage::TILE_OCEAN) ocean_count++;
+                if (row+1 < H && stage.get_tiletype(row+1, col) == Stage::TILE_OCEAN) ocean_count++;
+                if (col > 0 && stage.get_tiletype(row, col-1) == Stage::TILE_OCEAN) ocean_count++;
+                if (col+1 < W && stage.get_tiletype(row, col+1) == Stage::TILE_OCEAN) ocean_count++;
+
+                if (ocean_count >= 2) {
+                    stage.change_tiles(row, col, Stage::TILE_OCEAN);
+                }
+            }
+            else if(stage.get_tiletype(row,col) == Stage::TILE_GOAL){
+                int worldX = col * stage.TILE_SIZE;
+                int worldY = row * stage.TILE_SIZE;
+                goal.init(worldX,worldY,&stage);
+                goal.spawn_row = row;
+                goal.spawn_col = col;
+                if(!goal.texture) goal.load_texture(renderer);
+            }
+            else if(stage.get_tiletype(row,col) == Stage::TILE_START){
+                //チャンクを読み直しても位置はリセットしない
+                if(mario.is_spawned) return;
+                int worldX = col * stage.TILE_SIZE;
+                int worldY = row * stage.TILE_SIZE;
+                mario.init(worldX,worldY);
+                mario.load_texture(renderer);  
+                mario.is_spawned = true;
+            }
+            else if(stage.get_tiletype(row,col) == Stage::TILE_PIPE){
+                //左か右がドカンならスキップ
+                bool left_is_pipe = (col > 0) &&
+                (stage.get_tiletype(row, col-1) == Stage::TILE_PIPE);
+                bool up_is_pipe = (row > 0) &&
+                    (stage.get_tiletype(row-1, col) == Stage::TILE_PIPE);
+
+                if (left_is_pipe || up_is_pipe) return;
+
+
+                int worldX = col * stage.TILE_SIZE;
+                int worldY = row * stage.TILE_SIZE;
+                //土管の大きさを取得
+                int pipe_h = 1;
+                while (row + pipe_h < stage.stageHeightInTiles() && stage.get_tiletype(row + pipe_h, col) == Stage::TILE_PIPE) {
+                    pipe_h++;
+                }
+                int pipe_w = 1;
+                while (col + pipe_w < stage.stageWidthInTiles() && stage.get_tiletype(row, col + pipe_w) == Stage::TILE_PIPE) {
+                    pipe_w++;
+                }
+                //ワープの入口・出口・行き先はStage::warpsで引くので、土管自体は形だけ
+                Pipe* pipe = (stage.get_pipetype(row,col) == Stage::PIPE_WARP) ? new Warp_Pipe() : new Pipe();
+                pipe->init(worldX,worldY,pipe_h * stage.TILE_SIZE,pipe_w * stage.TILE_SIZE);
+                pipe->spawn_row = row;
+                pipe->spawn_col = col;
+                pipe->load_texture(renderer);
+                pipes.push_back(pipe);
+            }
+        }
+
+        //タイル情報から生成（col_begin〜col_end、row_begin〜row_endの範囲だけ）
+        void spawn_tiles(int col_begin,int col_end,int row_begin = 0,int row_end = INT_MAX){
+            row_end = std::min(row_end,stage.stageHeightInTiles());
+            for(int row = std::max(row_begin,0); row < row_end; row++){
+                int end = std::min(col_end,stage.row_width(row));
+                for(int col = col_begin; col < end; col++){
+                    spawn_cell(row,col);
+                }
+            }
+        }
+
+        //生成元のタイルが範囲内のものを破棄する
+        void despawn_tiles(int col_begin,int col_end,int row_begin = 0,int row_end = INT_MAX){
+            despawn_where([&](int row,int col){
+                return col >= col_begin && col < col_end && row >= row_begin && row < row_end;
+            });
+        }
+        //出てきたタイルがin_rangeに入る敵・アイテム・土管を消す（それぞれ1回ずつ見るだけ）
+        template<class InRange>
+        void despawn_where(InRange in_range){
+            for (auto it = enemies.begin(); it != enemies.end(); ) {
+                if (in_range((*it)->spawn_row,(*it)->spawn_col)) {
+                    //倒した敵・取ったアイテムはチャンクが戻ってきても出し直さない
+                    if (!(*it)->is_alive) stage.consume((*it)->spawn_row,(*it)->spawn_col);
+                    delete *it;
+                    it = enemies.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            for (auto it = items.begin(); it != items.end(); ) {
+                if (in_range((*it)->spawn_row,(*it)->spawn_col)) {
+                    if (!(*it)->is_alive) stage.consume((*it)->spawn_row,(*it)->spawn_col);
+                    delete *it;
+                    it = items.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            for (auto it = pipes.begin(); it != pipes.end(); ) {
+                if (in_range((*it)->spawn_row,(*it)->spawn_col)) {
+                    delete *it;
+                    it = pipes.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+
+        //ステージファイルの変更を差分だけ反映する（マリオの位置や状態はそのまま）
+        //変わった行のうち変わった列だけを解析し直し、その周りの敵・アイテム・土管を作り直す
+        void hot_reload(const char* filename){
+            WorldScope scope(this);
+            //入った直後の写しはもう今のファイルと合わない
+            baseline.reset();
+            std::vector<std::string> lines;
+            int underground_row = -1;
+            if(!Stage::read_stage_lines(filename,lines,underground_row) || lines.empty()){
+                return;
+            }
+            if(underground_row < 0) underground_row = stage.start_underground_row;
+
+            //行の数や地下の位置が変わったら全体を読み直す
+            if((int)lines.size() != stage.stageHeightInTiles() || underground_row != stage.start_underground_row){
+                despawn_tiles(0,INT_MAX);
+                //Gが消えていても古いポールが残らないよう外しておく（まだあればspawn_tilesで置き直す）
+                goal.is_placed = false;
+                stage.load_stage(filename);
+                spawn_tiles(0,stage.stageWidthInTiles());
+                stage.build_environment();
+                SDL_Log("ステージを全体再読み込みしました: %s", filename);
+                return;
+            }
+
+            std::vector<TileRect> dirty;
+            bool rebuild_environment = false;
+            std::vector<int> changed_rows;
+            std::string warp_anchors;  //索引し直したワープ土管の組
+            for(int row = 0; row < (int)lines.size(); row++){
+                const std::string& before = stage.raw_lines[row];
+                const std::string& after = lines[row];
+                if(before == after) continue;
+                int common = (int)std::min(before.size(),after.size());
+                int col_begin = 0;
+                while(col_begin < common && before[col_begin] == after[col_begin]) col_begin++;
+                int col_end = (int)std::max(before.size(),after.size());
+                if(before.size() == after.size()){
+                    while(col_end > col_begin && before[col_end - 1] == after[col_end - 1]) col_end--;
+                }
+                //この行が上段か下段になっているワープ土管は、書き換える前に索引から外す
+                stage.unindex_warp_row(row - 1,warp_anchors);
+                stage.unindex_warp_row(row,warp_anchors);
+                changed_rows.push_back(row);
+                rebuild_environment |= stage.reparse_cells(row,after,col_begin,col_end);
+                //土管の大きさや水中判定は隣のタイルで決まるので1マス広げる
+                dirty.push_back({row - 1,row + 2,col_begin - 1,col_end + 1});
+            }
+            if(dirty.empty()) return;
+
+            //変更範囲にかかる土管は丸ごと作り直すので範囲に含め、重なる範囲はまとめる
+            int ts = stage.TILE_SIZE;
+            bool grown = true;
+            while(grown){
+                grown = false;
+                for(auto* p : pipes){
+                    TileRect pr = {p->spawn_row,p->spawn_row + p->dstRect.h / ts,p->spawn_col,p->spawn_col + p->dstRect.w / ts};
+                    for(auto& r : dirty){
+                        if(r.intersects(pr) && !(r.row_begin <= pr.row_begin && pr.row_end <= r.row_end && r.col_begin <= pr.col_begin && pr.col_end <= r.col_end)){
+                            r.unite(pr);
+                            grown = true;
+                        }
+                    }
+                }
+                for(size_t i = 0; i < dirty.size(); i++){
+                    for(size_t j = i + 1; j < dirty.size(); ){
+                        if(dirty[i].intersects(dirty[j])){
+                            dirty[i].unite(dirty[j]);
+                            dirty.erase(dirty.begin() + j);
+                            grown = true;
+                        }
+                        else{
+                            j++;
+                        }
+                    }
+                }
+            }
+
+            //敵・アイテム・土管は1回ずつ、全部の範囲と比べる
+            auto in_dirty = [&](int row,int col){
+                for(const auto& r : dirty){
+                    if(r.contains(row,col)) return true;
+                }
+                return false;
+            };
+            despawn_where(in_dirty);
+            //Gを消したときに古いポールが残らないよう外しておく（まだあれば下で置き直す）
+            if(goal.is_placed && in_dirty(goal.spawn_row,goal.spawn_col)) goal.is_placed = false;
+            for(const auto& r : dirty){
+                spawn_tiles(std::max(r.col_begin,0),r.col_end,r.row_begin,r.row_end);
+            }
+            //水・溶岩はreparse_cellsでタイルごとに直してある。環境マップの幅を超えて増えたときだけ作り直す
+            if(rebuild_environment){
+                stage.build_environment();
+            }
+            //変わった行にかかるワープ土管だけ拾い直し、その組の行き先だけ決め直す
+            int reindexed = -1;
+            for(int row : changed_rows){
+                for(int r = std::max(row - 1,reindexed + 1); r <= row; r++){
+                    stage.reindex_warp_row(r,warp_anchors);
+                }
+                reindexed = row;
+            }
+            if(!warp_anchors.empty()) stage.resolve_warps(&warp_anchors);
+            //書き換えの記録は読み込み直した内容とは合わないので捨てる
+            stage.clear_edits();
+            SDL_Log("ステージを再読み込みしました: %zu箇所", dirty.size());
+        }
+
+        //cameraXに合わせてチャンクを読み込み・破棄する
+        void update_stream(int cameraX){
+            int count = stage.chunk_count();
+            int first,last;
+            stream_window(stage,cameraX,first,last);
+            //端のチャンクは隣が読み込まれていないので生成しない（ステージの端は除く）
+            int spawn_first = (first > 0) ? first + 1 : first;
+            int spawn_last = (last < count - 1) ? last - 1 : last;
+
+            for(int chunk = spawned_chunk_first; chunk <= spawned_chunk_last; chunk++){
+                if(chunk < spawn_first || chunk > spawn_last){
+                    despawn_tiles(chunk * Stage::CHUNK_COLS,(chunk + 1) * Stage::CHUNK_COLS);
+                }
+            }
+            bool loaded = false;
+            for(int chunk = first; chunk <= last; chunk++){
+                if(!stage.is_chunk_resident(chunk)){
+                    stage.load_chunk(chunk);
+                    loaded = true;
+                }
+            }
+            for(int chunk = spawn_first; chunk <= spawn_last; chunk++){
+                if(chunk < spawned_chunk_first || chunk > spawned_chunk_last){
+                    spawn_tiles(chunk * Stage::CHUNK_COLS,(chunk + 1) * Stage::CHUNK_COLS);
+                }
+            }
+            //常駐範囲が変わったら水・溶岩の領域を作り直す（常駐分だけなので一定コスト）
+            if(loaded){
+                stage.forget_far_chunks(first,last);
+                stage.build_environment();
+            }
+            spawned_chunk_first = spawn_first;
+            spawned_chunk_last = spawn_last;
+        }
+
+        //入れるワープ土管の上にいる間に、行き先のチャンクを先読みしておく（ワープした瞬間に読まずに済む）
+        void prefetch_warp_destination(){
+            int id = mario.warp_point(&stage);
+            if(id < 0) return;
+            const Stage::WarpEntry& wp = stage.warps[id];
+            if(!wp.can_in || wp.target < 0) return;
+            const Stage::WarpEntry& dest = stage.warps[wp.target];
+            int first,last;
+            stream_window(stage,dest.col * stage.TILE_SIZE + mario.dstRect.w / 2 - SCREEN_WIDTH / 2,first,last);
+            for(int chunk = first; chunk <= last; chunk++){
+                stage.prefetch_chunk(chunk);
+            }
+        }
+
+        //読み込み済みのステージに入れ替える（マリオの状態やコインは持ち越し、位置は新しいSから）
+        void enter(PreparedStage& next){
+            WorldScope scope(this);
+            despawn_tiles(0,INT_MAX);
+            for (auto* f : fire_balls) delete f;
+            fire_balls.clear();
+            for (auto* f : fires) delete f;
+            fires.clear();
+
+            stage = std::move(next.stage);
+            goal.is_placed = false;
+            mario.is_spawned = false;
+            mario.vy = 0;
+            mario.is_jumping = false;
+            cameraX = 0;
+            cameraY = 0;
+            if(stage.streaming){
+                spawned_chunk_first = 0;
+                spawned_chunk_last = -1;
+                update_stream(0);
+            }
+            else{
+                for(const auto& cell : next.spawn_cells){
+                    spawn_cell(cell.first,cell.second);
+                }
+            }
+            //ストリーミング中は常駐していない所を写せないので取らない
+            baseline.reset();
+            if(keep_baseline && !stage.streaming){
+                baseline = snapshot();
+            }
+        }
+
+        //ステージに入った直後に戻す（ファイルを読み直さず写しから戻すので、敵の数だけの手間で済む。テクスチャもそのまま）
+        //写しがなければ（ストリーミング中・ステージを読み直した後）何もせずfalse
+        bool restart(){
+            if(!baseline) return false;
+            restore(*baseline);
+            return true;
+        }
+        //マリオがやられたか、ステージの下に落ちた
+        bool is_lost(){
+            return !mario.is_alive || mario.dstRect.y > stage.stageHeightInTiles() * stage.TILE_SIZE;
+        }
+
+        //マリオだけを入力どおりに1フレーム動かす（時刻は呼ぶ側で進め、worldも呼ぶ側で設定しておく）
+        //到達解析はこれだけを使って、敵やアイテム抜きでマリオの動きを調べる
+        void move_mario(const Action& action){
+            Uint8 keys[SDL_NUM_SCANCODES] = {};
+            keys[SDL_SCANCODE_A] = action.left;
+            keys[SDL_SCANCODE_D] = action.right;
+            keys[SDL_SCANCODE_C] = action.run;
+            keys[SDL_SCANCODE_M] = action.down;
+
+            //ジャンプは押してから数tickの間持っておき、着地の少し前に押しても跳べるようにする
+            if(action.jump){
+                mario.jump_buffer = Mario::JUMP_BUFFER_TICKS;
+            }
+            if(mario.jump_buffer > 0){
+                mario.jump_buffer--;
+                bool jumped = mario.jump(&stage);
+                if(mario.wall_kick(&stage,keys)) jumped = true;
+                if(jumped) mario.jump_buffer = 0;
+            }
+            if(action.warp){
+                mario.try_warp(&stage);
+                //移動先を次の更新より前に読み込んでおく（足場がないまま落ちないように）
+                if (stage.streaming) {
+                    update_stream(mario.dstRect.x + mario.dstRect.w/2 - SCREEN_WIDTH/2);
+                }
+            }
+            if(action.fire){
+                mario.fire(renderer);
+            }
+
+            mario.update(&stage,keys);
+            flush_events("mario");
+        }
+
+        //積まれた出来事をまとめて反映し、購読者に配る（敵やアイテムの一覧を回している最中には呼ばない）
+        void flush_events(const char* point){
+            if(events.empty()) return;
+            dispatching.swap(events);
+            for(const GameEvent& e : dispatching){
+                apply_event(e);
+            }
+            if(!bus.empty()) bus.publish(point,dispatching);
+            dispatching.clear();
+        }
+
+        //1フレーム進める（入力はActionで受け取り、キーボードの状態は見ない）
+        void step(const Action& action){
+            WorldScope scope(this);
+            ticks += frameDeray;
+            frame++;
+            //このtickで時間切れになったものだけ呼ぶ
+            timers.advance(frame,[this](TimerNode& node){
+                if(node.owner) node.owner->on_timer(node.code);
+                else refresh_probabilities_each_second();
+            });
+            move_mario(action);
+            bool enemies_moved = move_by_region(enemies,[this](Enemy* e){
+                e->update(&stage,renderer);
+            });
+            for(auto* e : enemies){
+                if(!enemies_moved) e->update(&stage,renderer);
+                //始める・着地した振る舞いはここで順番に進める（タイマーで起こすものは時間切れのときに進んでいる）
+                if(e->woke) e->resume_script();
+                e->is_collision_mario(&mario);
+                for(auto* f : fire_balls){
+                    e->is_collision_fireball(f);
+                }
+            }
+            flush_events("enemies");
+            bool items_moved = move_by_region(items,[this](item* it){
+                it->update(&stage);
+            });
+            for(auto* it : items){
+                if(!items_moved) it->update(&stage);
+                it->check_touch(&mario);
+            }
+            flush_events("items");
+            for (auto it = fire_balls.begin(); it != fire_balls.end(); ) {
+                Fireball* f = *it;
+                f->update(&stage);
+            
+                if (!f->is_alive) {
+                    emit(EVENT_FIREBALL_END,(f->dstRect.y + f->dstRect.h / 2) / stage.TILE_SIZE,(f->dstRect.x + f->dstRect.w / 2) / stage.TILE_SIZE);
+                    delete f;
+                    it = fire_balls.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            for (auto it = fires.begin(); it != fires.end();) {
+                Fire* f = *it;
+                f->update(&stage);
+                f->is_collision_mario(&mario);
+            
+                if (!f->is_alive) {
+                    delete f;
+                    it = fires.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            flush_events("fires");
+            // カメラをマリオに追従させる
+            cameraX = mario.dstRect.x + mario.dstRect.w/2 - SCREEN_WIDTH/2;
+
+            // ステージ範囲からはみ出ないようにクランプ
+            int stagePixelWidth = stage.stageWidthInTiles() * stage.TILE_SIZE;
+            if (cameraX < 0) cameraX = 0;
+            if (cameraX > stagePixelWidth - SCREEN_WIDTH)
+                cameraX = stagePixelWidth - SCREEN_WIDTH;
+            if (stage.streaming) {
+                prefetch_warp_destination();
+                update_stream(cameraX);
+            }
+        }
+
+        //objectsをx座標で領域に分け、move_oneを領域ごとに並列に呼ぶ（move_oneは自分のものだけ書き換えること）
+        //並列にしなかったらfalse（呼ぶ側が元の順番で動かす）
+        template<class T,class Move>
+        bool move_by_region(const std::vector<T*>& objects,Move move_one){
+            if(!update_scheduler || (int)objects.size() < PARALLEL_MIN_OBJECTS) return false;
+            int region_px = REGION_COLS * stage.TILE_SIZE;
+            //領域の番号で並べ、同じ領域の続きを1つの仕事にする（領域の中は元の順番のまま）
+            //領域ごとの表は作らないので、手間はステージの長さによらず数の分だけ
+            int n = (int)objects.size();
+            region_members.resize(n);
+            for(int i = 0; i < n; i++){
+                region_members[i] = {std::max(objects[i]->dstRect.x / region_px,0),i};
+            }
+            std::sort(region_members.begin(),region_members.end());
+            region_tasks.clear();
+            for(int k = 0; k < n; k++){
+                if(k == 0 || region_members[k].first != region_members[k - 1].first) region_tasks.push_back(k);
+            }
+            region_tasks.push_back(n);
+            update_scheduler->run((int)region_tasks.size() - 1,[&](int task){
+                WorldScope scope(this);
+                for(int k = region_tasks[task]; k < region_tasks[task + 1]; k++){
+                    move_one(objects[region_members[k].second]);
+                }
+            });
+            return true;
+        }
+
+        //描画命令を積むだけ（SDL_Rendererには触らないのでどのスレッドからでも呼べる）
+        void render(DrawList& out){
+            WorldScope scope(this);
+            out.reset();
+            //レンダリング（画面外のものは積まれない。描く順番は層で決まる）
+            stage.render(out,cameraX,cameraY);
+            goal.render(out,cameraX,cameraY);
+            mario.render(out,cameraX,cameraY);
+            for (auto* e : enemies){
+                e->render(out,cameraX,cameraY);
+            }
+            for (auto* it : items){
+                it->render(out,cameraX,cameraY);
+            }
+            for (auto* p : pipes){
+                p->render(out,cameraX,cameraY);
+            }
+            for (auto* f : fire_balls){
+                f->render(out,cameraX,cameraY);
+            }
+            for (auto* f : fires){
+                f->render(out,cameraX,cameraY);
+            }
+            out.sort();
+        }
+};
+
+//ヘッドレスの世界1つ分の、1フレーム後の様子
+struct Observation{
+    int x,y;
+    float vx,vy;
+    bool alive;
+    int state;
+    int coins;
+    bool goal;      //ゴールに触れた
+    Uint32 ticks;
+};
+
+//同じステージのヘッドレスの世界をN個まとめて持ち、スレッドプールで一斉に1フレームずつ進める
+class WorldBatch{
+    public:
+        WorldBatch(const std::string& filename,int n,unsigned seed,int thread_count) : pool(thread_count){
+            //ステージの解析は1回だけにして、各世界にはコピーを渡す
+            auto proto = prepare_stage(filename,false,false);
+            if(!proto->ok) return;
+            for(int i = 0; i < n; i++){
+                auto w = std::make_unique<World>(nullptr,seed + i);
+                PreparedStage copy = *proto;
+                w->enter(copy);
+                worlds.push_back(std::move(w));
+            }
+        }
+        bool ok()const{
+            return !worlds.empty();
+        }
+        int size()const{
+            return (int)worlds.size();
+        }
+        World& at(int i){
+            return *worlds[i];
+        }
+        //actions[i]を世界iに与えて1フレーム進め、observations[i]を返す
+        std::vector<Observation> step(const std::vector<Action>& actions){
+            std::vector<Observation> observations(worlds.size());
+            pool.parallel_for((int)worlds.size(),[&](int i){
+                World& w = *worlds[i];
+                w.step(actions[i]);
+                Observation& o = observations[i];
+                o.x = w.mario.dstRect.x;
+                o.y = w.mario.dstRect.y;
+                o.vx = w.mario.vx;
+                o.vy = w.mario.vy;
+                o.alive = w.mario.is_alive;
+                o.state = w.mario.state;
+                o.coins = w.mario.coin_count;
+                o.goal = w.goal.is_touch(w.mario.dstRect);
+                o.ticks = w.ticks;
+            });
+            return observations;
+        }
+    private:
+        ThreadPool pool;
+        std::vector<std::unique_ptr<World>> worlds;
+};
+
+//./mario --batch N [--frames F] [--threads T] [--seed S] stage.map
+//N個の世界を乱数の入力でヘッドレスに動かし、1秒あたりのフレーム数を測る
+int run_batch(int argc,char* argv[]){
+    int n = 64;
+    int frames = 600;
+    int thread_count = (int)std::thread::hardware_concurrency();
+    unsigned seed = 1;
+    const char* filename = "1-1.map";
+    for(int i = 1; i < argc; i++){
+        std::string opt = argv[i];
+        const char* val = (i + 1 < argc) ? argv[i + 1] : nullptr;
+        if(opt == "--batch" && val){ n = std::atoi(val); i++; }
+        else if(opt == "--frames" && val){ frames = std::atoi(val); i++; }
+        else if(opt == "--threads" && val){ thread_count = std::atoi(val); i++; }
+        else if(opt == "--seed" && val){ seed = (unsigned)std::strtoul(val,nullptr,10); i++; }
+        else filename = argv[i];
+    }
+    if(n < 1 || frames < 1){
+        SDL_Log("使い方: %s --batch N [--frames F] [--threads T] [--seed S] stage.map", argv[0]);
+        return 1;
+    }
+    WorldBatch batch(filename,n,seed,thread_count);
+    if(!batch.ok()){
+        SDL_Log("ステージを読み込めませんでした: %s", filename);
+        return 1;
+    }
+    //右に進みながらときどきジャンプ・ダッシュ・ファイアする入力
+    std::vector<std::mt19937> policy;
+    for(int i = 0; i < n; i++) policy.emplace_back(seed * 7919u + i);
+    std::vector<Action> actions(n);
+    int goals = 0, alive = 0;
+
+    Uint64 start = SDL_GetPerformanceCounter();
+    for(int f = 0; f < frames; f++){
+        for(int i = 0; i < n; i++){
+            std::uniform_int_distribution<int> d100(0,99);
+            Action& a = actions[i];
+            a = Action();
+            a.right = d100(policy[i]) < 85;
+            a.left = !a.right && d100(policy[i]) < 50;
+            a.run = d100(policy[i]) < 50;
+            a.jump = d100(policy[i]) < 10;
+            a.fire = d100(policy[i]) < 2;
+            a.warp = d100(policy[i]) < 2;
+        }
+        std::vector<Observation> obs = batch.step(actions);
+        if(f == frames - 1){
+            for(const auto& o : obs){
+                goals += o.goal;
+                alive += o.alive;
+            }
+        }
+    }
+    double sec = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+    double ticks = (double)n * frames;
+    SDL_Log("%d worlds x %d frames, %d threads: %.3f s, %.0f ticks/s (生存 %d, ゴール %d)",
+            n, frames, thread_count, sec, ticks / sec, alive, goals);
+    return 0;
+}
+
+//ステージのワープ土管の書き間違いを探す（アンカーなし・行き先なし・i/oの置き場所違い）
+std::vector<std::string> check_warp_pipes(const Stage& stage){
+    std::vector<std::string> problems;
+    char buf[160];
+    //ファイル上の行番号（先頭の'#'の行と、地下の前の'*'の行も数える）
+    auto line_of = [&](int row){
+        return row + 1 + stage.directive_lines + ((stage.start_underground_row > 0 && row >= stage.start_underground_row) ? 1 : 0);
+    };
+    std::vector<bool> is_target(stage.warps.size(),false);
+    for(const auto& w : stage.warps){
+        if(w.target >= 0) is_target[w.target] = true;
+    }
+    for(int i = 0; i < (int)stage.warps.size(); i++){
+        const Stage::WarpEntry& w = stage.warps[i];
+        if(!Stage::is_warp_anchor(w.anchor)){
+            snprintf(buf,sizeof(buf),"行%d 列%d: W の右にアンカー文字がない",line_of(w.row),w.col + 1);
+            problems.push_back(buf);
+            continue;
+        }
+        if(!w.can_in && !w.can_out){
+            snprintf(buf,sizeof(buf),"行%d 列%d (%c): 下段に i も o もない",line_of(w.row),w.col + 1,w.anchor);
+            problems.push_back(buf);
+        }
+        if(w.can_in && w.target < 0){
+            if(w.dest != '\0'){
+                snprintf(buf,sizeof(buf),"行%d 列%d (%c): 行き先の組 %c に出口(o)がない",line_of(w.row),w.col + 1,w.anchor,w.dest);
+            }
+            else{
+                snprintf(buf,sizeof(buf),"行%d 列%d (%c): 同じアンカーの出口(o)がない",line_of(w.row),w.col + 1,w.anchor);
+            }
+            problems.push_back(buf);
+        }
+        if(w.can_out && !is_target[i]){
+            snprintf(buf,sizeof(buf),"行%d 列%d (%c): どの入口からも来ない出口",line_of(w.row),w.col + 1,w.anchor);
+            problems.push_back(buf);
+        }
+    }
+    //i は W の真下、o は W の右下にしか置けない
+    for(int row = 0; row < (int)stage.raw_lines.size(); row++){
+        const std::string& line = stage.raw_lines[row];
+        for(int col = 0; col < (int)line.size(); col++){
+            char c = line[col];
+            if(c == 'i' && stage.raw_at(row - 1,col) != 'W'){
+                snprintf(buf,sizeof(buf),"行%d 列%d: i の上に W がない",line_of(row),col + 1);
+                problems.push_back(buf);
+            }
+            else if(c == 'o' && stage.raw_at(row - 1,col - 1) != 'W'){
+                snprintf(buf,sizeof(buf),"行%d 列%d: o の左上に W がない",line_of(row),col + 1);
+                problems.push_back(buf);
+            }
+        }
+    }
+    return problems;
+}
+
+//ステージのSからGまでマリオがたどり着けるかを、本物のマリオの動き（jump/wall_kick/update）で総当たりに調べる
+//状態（位置・速度・ジャンプ中・大きさ・水中・壁キックの残り時間）を丸めて重複を除き、HOLD_FRAMESごとに幅優先で広げる
+//見つかった道は実際の動きをなぞったものなので「届く」は確か。丸めで捨てた状態もあるので「届かない」は--cellを小さくして確かめる
+//敵とアイテムは無視し、ブロックは壊れないものとして扱う（壊さないと通れないステージは届かない判定になる）
+class ReachabilityAnalyzer{
+    public:
+        struct State{
+            int x,y;
+            float vx,vy;
+            bool is_jumping;
+            bool is_super;
+            bool is_ocean;
+            int lock_ms;   //壁キックで入力が効かない残り時間
+        };
+        struct Result{
+            bool reachable = false;
+            int frames = -1;        //ゴールまでの最短フレーム数
+            size_t states = 0;      //調べた状態の数
+            int furthest_col = 0;   //届いた一番右の列
+            int warps_used = 0;     //通れた入口の数
+        };
+
+        //cellは状態を同じとみなす位置の幅（小さいほど細かい動きまで試すが遅くなる）
+        ReachabilityAnalyzer(const std::string& filename,int thread_count,int cell_px = 16) : cell(std::max(1,cell_px)),pool(thread_count){
+            auto proto = prepare_stage(filename,false,false);
+            if(!proto->ok) return;
+            //スレッドごとに世界を1つ持つ（ワープでステージの地上・地下の状態が変わるので共有しない）
+            for(int i = 0; i < pool.size(); i++){
+                auto w = std::make_unique<World>(nullptr,1);
+                PreparedStage copy = *proto;
+                w->enter(copy);
+                w->stage.frozen = true;
+                workers.push_back(std::move(w));
+            }
+        }
+        bool ok()const{
+            return !workers.empty();
+        }
+        const Stage& stage()const{
+            return workers[0]->stage;
+        }
+        bool has_start()const{
+            return workers[0]->mario.is_spawned;
+        }
+        bool has_goal()const{
+            return workers[0]->goal.is_placed;
+        }
+
+        Result run(bool start_super,int max_frames){
+            Result result;
+            World& w0 = *workers[0];
+            State start;
+            start.x = w0.mario.dstRect.x;
+            start.y = w0.mario.dstRect.y;
+            start.vx = w0.mario.vx;
+            start.vy = w0.mario.vy;
+            start.is_jumping = false;
+            start.is_super = start_super;
+            start.is_ocean = false;
+            start.lock_ms = 0;
+            if(start_super) start.y -= w0.stage.TILE_SIZE;
+
+            //到達済みの状態。探索中のスレッドは読むだけで、入れるのは段ごとのまとめのときだけ
+            std::unordered_set<Uint64> visited;
+            std::vector<bool> entered(w0.stage.warps.size(),false);
+            std::mutex entered_mtx;
+            visited.insert(key_of(start));
+            std::vector<State> frontier = {start};
+            int furthest = start.x;
+            std::atomic<int> best{INT_MAX};
+            int n = (int)workers.size();
+            //スレッドごとの候補（丸めた状態と、元の状態）
+            std::vector<std::vector<std::pair<Uint64,State>>> next(n);
+            std::vector<std::pair<Uint64,State>> candidates;
+
+            int frame = 0;
+            while(!frontier.empty() && frame < max_frames && best == INT_MAX){
+                pool.parallel_for(n,[&](int k){
+                    World& w = *workers[k];
+                    WorldScope scope(&w);
+                    std::vector<std::pair<Uint64,State>>& out = next[k];
+                    out.clear();
+                    //この担当分をk, k+n, k+2n... と取る
+                    for(size_t i = k; i < frontier.size(); i += n){
+                        const State& s = frontier[i];
+                        for(const Action& a : actions){
+                            load(w,s);
+                            int warp_id = -1;
+                            if(a.warp){
+                                //土管の上にいないときは試さない
+                                warp_id = w.mario.warp_point(&w.stage);
+                                if(warp_id < 0) continue;
+                            }
+                            //ジャンプと土管は押した瞬間だけ、左右とダッシュはHOLD_FRAMESのあいだ押し続ける
+                            Action held = a;
+                            bool alive = true;
+                            for(int f = 0; f < HOLD_FRAMES && alive; f++){
+                                w.ticks = BASE_TICKS + frameDeray * (f + 1);
+                                w.move_mario(held);
+                                held.jump = false;
+                                held.warp = false;
+                                const Mario& m = w.mario;
+                                alive = m.is_alive && m.dstRect.x + m.dstRect.w >= 0 && m.dstRect.y <= stage_bottom(w);
+                                if(alive && w.goal.is_touch(m.dstRect)){
+                                    int at = frame + f + 1;
+                                    int cur = best.load();
+                                    while(at < cur && !best.compare_exchange_weak(cur,at)){}
+                                }
+                            }
+                            if(!alive) continue;
+                            if(warp_id >= 0 && abs(w.mario.dstRect.x - s.x) > w.stage.TILE_SIZE){
+                                std::lock_guard<std::mutex> lock(entered_mtx);
+                                entered[warp_id] = true;
+                            }
+                            State t = save(w);
+                            Uint64 key = key_of(t);
+                            if(!visited.count(key)) out.push_back({key,t});
+                        }
+                    }
+                });
+                frame += HOLD_FRAMES;
+                //段ごとに1つのスレッドでまとめる。丸めた状態の順に並べ、同じものは元の状態が一番小さいものを残す
+                //（残る状態と次の段の順番がスレッドの数や速さによらない）
+                candidates.clear();
+                for(auto& v : next){
+                    candidates.insert(candidates.end(),v.begin(),v.end());
+                }
+                std::sort(candidates.begin(),candidates.end(),[](const auto& a,const auto& b){
+                    if(a.first != b.first) return a.first < b.first;
+                    return less_state(a.second,b.second);
+                });
+                frontier.clear();
+                for(size_t i = 0; i < candidates.size(); i++){
+                    if(i > 0 && candidates[i].first == candidates[i - 1].first) continue;
+                    visited.insert(candidates[i].first);
+                    frontier.push_back(candidates[i].second);
+                    furthest = std::max(furthest,candidates[i].second.x);
+                }
+            }
+            result.reachable = (best != INT_MAX);
+            result.frames = result.reachable ? best.load() : -1;
+            result.states = visited.size();
+            result.furthest_col = furthest / w0.stage.TILE_SIZE;
+            for(bool e : entered) result.warps_used += e;
+            return result;
+        }
+    private:
+        //壁キックの時刻を比べるための基準の時刻（何でもよい）
+        static const Uint32 BASE_TICKS = 1000000;
+        //1つの入力を続けるフレーム数（細かく分けるほど正確だが状態が増える）
+        static const int HOLD_FRAMES = 6;
+        int cell;
+        ThreadPool pool;
+        std::vector<std::unique_ptr<World>> workers;
+        //1フレームに試す入力（左右・ダッシュ・ジャンプの組み合わせと、土管に入る）
+        std::vector<Action> actions = make_actions();
+
+        static std::vector<Action> make_actions(){
+            std::vector<Action> list;
+            for(int dir = 0; dir < 3; dir++){
+                for(int run = 0; run < 2; run++){
+                    for(int jump = 0; jump < 2; jump++){
+                        Action a;
+                        a.left = (dir == 1);
+                        a.right = (dir == 2);
+                        a.run = run;
+                        a.jump = jump;
+                        list.push_back(a);
+                    }
+                }
+            }
+            Action warp;
+            warp.warp = true;
+            list.push_back(warp);
+            return list;
+        }
+        static int stage_bottom(World& w){
+            return w.stage.stageHeightInTiles() * w.stage.TILE_SIZE;
+        }
+        //状態を世界のマリオに書き込む
+        static void load(World& w,const State& s){
+            Mario& m = w.mario;
+            m.dstRect.x = s.x;
+            m.dstRect.y = s.y;
+            m.dstRect.w = 32;
+            m.dstRect.h = s.is_super ? 64 : 32;
+            m.state = s.is_super ? Mario::Super : Mario::Default;
+            m.vx = s.vx;
+            m.vy = s.vy;
+            m.is_jumping = s.is_jumping;
+            m.is_ocean = s.is_ocean;
+            m.is_alive = true;
+            m.wall_kick_lock_until = BASE_TICKS + s.lock_ms;
+            m.jump_buffer = 0;
+        }
+        static State save(const World& w){
+            const Mario& m = w.mario;
+            State s;
+            s.x = m.dstRect.x;
+            s.y = m.dstRect.y;
+            s.vx = m.vx;
+            s.vy = m.vy;
+            s.is_jumping = m.is_jumping;
+            s.is_super = (m.dstRect.h == 64);
+            s.is_ocean = m.is_ocean;
+            s.lock_ms = std::max(0,(int)m.wall_kick_lock_until - (int)w.ticks);
+            return s;
+        }
+        static bool less_state(const State& a,const State& b){
+            return std::tie(a.x,a.y,a.vx,a.vy,a.is_jumping,a.is_super,a.is_ocean,a.lock_ms) <
+                   std::tie(b.x,b.y,b.vx,b.vy,b.is_jumping,b.is_super,b.is_ocean,b.lock_ms);
+        }
+        //丸めた状態を64bitに詰める（位置はcellピクセル、横速度は1、縦速度は4単位）
+        Uint64 key_of(const State& s)const{
+            auto field = [](long v,long lo,long hi){ return (Uint64)std::max(lo,std::min(hi,v)); };
+            Uint64 k = field((s.x + 64) / cell,0,(1 << 20) - 1);
+            k = (k << 12) | field((s.y + 2048) / cell,0,(1 << 12) - 1);
+            k = (k << 7) | field(lround(s.vx) + 64,0,127);
+            k = (k << 7) | field(lround(s.vy / 4) + 64,0,127);
+            k = (k << 4) | field((s.lock_ms + frameDeray - 1) / frameDeray,0,15);
+            k = (k << 3) | (s.is_jumping << 2) | (s.is_super << 1) | s.is_ocean;
+            return k;
+        }
+};
+
+//./mario --analyze stage.map [--threads T] [--cell PX] [--super] [--max-frames F]
+//Gまでたどり着けるか・最短何フレームかと、ワープ土管の書き間違いを表示する（問題があれば終了コード2）
+int run_analyzer(int argc,char* argv[]){
+    int thread_count = (int)std::thread::hardware_concurrency();
+    int max_frames = FPS * 600;
+    int cell = 16;
+    bool start_super = false;
+    const char* filename = nullptr;
+    for(int i = 2; i < argc; i++){
+        std::string opt = argv[i];
+        const char* val = (i + 1 < argc) ? argv[i + 1] : nullptr;
+        if(opt == "--threads" && val){ thread_count = std::atoi(val); i++; }
+        else if(opt == "--max-frames" && val){ max_frames = std::atoi(val); i++; }
+        else if(opt == "--cell" && val){ cell = std::atoi(val); i++; }
+        else if(opt == "--super") start_super = true;
+        else filename = argv[i];
+    }
+    if(!filename){
+        SDL_Log("使い方: %s --analyze stage.map [--threads T] [--cell PX] [--super] [--max-frames F]", argv[0]);
+        return 1;
+    }
+    ReachabilityAnalyzer analyzer(filename,thread_count,cell);
+    if(!analyzer.ok()){
+        SDL_Log("ステージを読み込めませんでした: %s", filename);
+        return 1;
+    }
+    bool broken = false;
+    for(const auto& p : check_warp_pipes(analyzer.stage())){
+        SDL_Log("ワープ土管: %s", p.c_str());
+        broken = true;
+    }
+    if(!analyzer.has_start() || !analyzer.has_goal()){
+        SDL_Log("%s: %s がありません", filename, analyzer.has_start() ? "G" : "S");
+        return 2;
+    }
+
+    Uint64 start = SDL_GetPerformanceCounter();
+    ReachabilityAnalyzer::Result r = analyzer.run(start_super,max_frames);
+    double sec = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+    if(r.reachable){
+        SDL_Log("%s: ゴールに届きます（最短 %d フレーム = %.2f 秒）", filename, r.frames, (double)r.frames / FPS);
+    }
+    else{
+        SDL_Log("%s: ゴールに届きません（届いたのは %d 列目まで）", filename, r.furthest_col + 1);
+        broken = true;
+    }
+    SDL_Log("状態 %zu 個, 使えた入口 %d 本, %d threads: %.3f s", r.states, r.warps_used, thread_count, sec);
+    return broken ? 2 : 0;
+}
+
+//ビームサーチでステージを自動で攻略する
+//残っている世界をスナップショットから戻して入力ごとに枝分かれさせ、ゴールに近いものだけをbeam_width個残していく
+//（枝はスレッドプールで並列に動かす。長時間動かす試験と、シミュレーションの負荷試験を兼ねる）
+class Autoplayer{
+    public:
+        struct Result{
+            bool reached = false;
+            int frames = 0;         //ゴールまでのフレーム数
+            long long ticks = 0;    //全部の枝で進めたフレームの合計
+            int best_col = 0;       //一番ゴールに近づいた世界の列
+            bool replay_ok = false; //見つけた入力を最初から再生して同じ結果になったか
+        };
+
+        Autoplayer(const std::string& filename,int beam_width,int thread_count,unsigned seed)
+            : beam_width(std::max(1,beam_width)),seed(seed),pool(thread_count){
+            proto = prepare_stage(filename,false,false);
+            if(!proto->ok) return;
+            for(int i = 0; i < pool.size(); i++){
+                workers.push_back(make_world());
+            }
+        }
+        bool ok()const{
+            return !workers.empty();
+        }
+
+        Result run(int max_frames){
+            Result result;
+            std::vector<Node> beam(1);
+            beam[0].snap = workers[0]->snapshot();
+            int n = (int)workers.size();
+            int nm = (int)moves.size();
+            std::vector<long long> ticks(n,0);
+            std::vector<Uint8> goal_moves;
+            int frame = 0;
+
+            while(frame < max_frames && !result.reached && !beam.empty()){
+                int count = (int)beam.size() * nm;
+                std::vector<Node> children(count);
+                pool.parallel_for(n,[&](int k){
+                    World& w = *workers[k];
+                    for(int i = k; i < count; i += n){
+                        const Node& parent = beam[i / nm];
+                        Node& child = children[i];
+                        w.restore(*parent.snap);
+                        int f = play(w,moves[i % nm],child.goal_frame);
+                        ticks[k] += f;
+                        if(!w.mario.is_alive || w.mario.dstRect.y > w.stage.stageHeightInTiles() * w.stage.TILE_SIZE){
+                            continue;
+                        }
+                        child.alive = true;
+                        child.score = score(w);
+                        child.x = w.mario.dstRect.x;
+                        child.y = w.mario.dstRect.y;
+                        child.moves = parent.moves;
+                        child.moves.push_back((Uint8)(i % nm));
+                        child.snap = w.snapshot();
+                    }
+                });
+                frame += HOLD_FRAMES;
+
+                for(const Node& c : children){
+                    if(c.alive && c.goal_frame >= 0){
+                        result.reached = true;
+                        result.frames = frame - HOLD_FRAMES + c.goal_frame + 1;
+                        goal_moves = c.moves;
+                        break;
+                    }
+                }
+                beam = select(children);
+                if(!beam.empty()) result.best_col = beam[0].x / Stage::TILE_SIZE;
+            }
+            for(long long t : ticks) result.ticks += t;
+
+            //見つけた入力を新しい世界で最初から再生して、同じフレームでゴールに着くか確かめる
+            if(result.reached){
+                auto w = make_world();
+                int at = -1;
+                for(size_t i = 0; i < goal_moves.size() && at < 0; i++){
+                    int goal_frame;
+                    play(*w,moves[goal_moves[i]],goal_frame);
+                    if(goal_frame >= 0) at = (int)i * HOLD_FRAMES + goal_frame + 1;
+                }
+                result.replay_ok = (at == result.frames);
+            }
+            return result;
+        }
+    private:
+        //1つの入力を続けるフレーム数
+        static const int HOLD_FRAMES = 4;
+        struct Node{
+            std::unique_ptr<WorldSnapshot> snap;
+            std::vector<Uint8> moves;   //最初からの入力（movesの番号）
+            double score = 0;
+            int x = 0,y = 0;
+            bool alive = false;
+            int goal_frame = -1;        //この入力の何フレーム目でゴールに触れたか
+        };
+        int beam_width;
+        unsigned seed;
+        ThreadPool pool;
+        std::unique_ptr<PreparedStage> proto;
+        std::vector<std::unique_ptr<World>> workers;
+        std::vector<Action> moves = make_moves();
+
+        std::unique_ptr<World> make_world()const{
+            auto w = std::make_unique<World>(nullptr,seed);
+            PreparedStage copy = *proto;
+            w->enter(copy);
+            return w;
+        }
+        //A/D/C/SPACE/M/Nの組み合わせ。SPACE・M・Nは最初のフレームだけ押した扱い、Mは押している間も有効
+        static std::vector<Action> make_moves(){
+            struct Keys{ bool a,d,c,space,m,n; };
+            const Keys table[] = {
+                {0,1,0,0,0,0},  //D
+                {0,1,1,0,0,0},  //D+C
+                {0,1,0,1,0,0},  //D+SPACE
+                {0,1,1,1,0,0},  //D+C+SPACE
+                {0,1,1,0,0,1},  //D+C+N
+                {1,0,0,0,0,0},  //A
+                {1,0,0,1,0,0},  //A+SPACE
+                {1,0,1,1,0,0},  //A+C+SPACE
+                {0,0,0,0,0,0},  //何もしない
+                {0,0,0,1,0,0},  //SPACE
+                {0,0,0,0,1,0},  //M（土管に入る）
+            };
+            std::vector<Action> list;
+            for(const Keys& k : table){
+                Action a;
+                a.left = k.a;
+                a.right = k.d;
+                a.run = k.c;
+                a.jump = k.space;
+                a.down = k.m;
+                a.warp = k.m;
+                a.fire = k.n;
+                list.push_back(a);
+            }
+            return list;
+        }
+        //HOLD_FRAMESだけ進める。死ぬかゴールに触れたらそこで止め、進めたフレーム数を返す
+        static int play(World& w,const Action& move,int& goal_frame){
+            goal_frame = -1;
+            Action a = move;
+            for(int f = 0; f < HOLD_FRAMES; f++){
+                w.step(a);
+                a.jump = false;
+                a.warp = false;
+                a.fire = false;
+                if(!w.mario.is_alive) return f + 1;
+                if(w.goal.is_touch(w.mario.dstRect)){
+                    goal_frame = f;
+                    return f + 1;
+                }
+            }
+            return HOLD_FRAMES;
+        }
+        //ゴールまでの横の距離が近いほど高い。コインと変身は少しだけ加点
+        static double score(const World& w){
+            const Mario& m = w.mario;
+            double s = 0;
+            if(w.goal.is_placed){
+                s -= abs((w.goal.dstRect.x + w.goal.dstRect.w / 2) - (m.dstRect.x + m.dstRect.w / 2));
+            }
+            else{
+                s += m.dstRect.x;
+            }
+            s += m.coin_count * 2;
+            if(m.state != Mario::Default) s += 16;
+            return s;
+        }
+        //点数の高い順に並べ、同じ場所（1タイル単位）にいるものは1つだけ残して上位beam_width個を選ぶ
+        std::vector<Node> select(std::vector<Node>& children)const{
+            std::vector<int> order;
+            for(int i = 0; i < (int)children.size(); i++){
+                if(children[i].alive) order.push_back(i);
+            }
+            std::stable_sort(order.begin(),order.end(),[&](int a,int b){
+                return children[a].score > children[b].score;
+            });
+            std::vector<Node> beam;
+            std::unordered_set<long long> cells;
+            for(int i : order){
+                if((int)beam.size() >= beam_width) break;
+                Node& c = children[i];
+                long long cell = ((long long)(c.x / Stage::TILE_SIZE) << 32) | (unsigned int)(c.y / Stage::TILE_SIZE + 1024);
+                if(!cells.insert(cell).second) continue;
+                beam.push_back(std::move(c));
+            }
+            return beam;
+        }
+};
+
+//./mario --autoplay stage.map [--beam W] [--frames F] [--threads T] [--seed S]
+int run_autoplay(int argc,char* argv[]){
+    int beam_width = 64;
+    int max_frames = FPS * 300;
+    int thread_count = (int)std::thread::hardware_concurrency();
+    unsigned seed = 1;
+    const char* filename = "1-1.map";
+    for(int i = 2; i < argc; i++){
+        std::string opt = argv[i];
+        const char* val = (i + 1 < argc) ? argv[i + 1] : nullptr;
+        if(opt == "--beam" && val){ beam_width = std::atoi(val); i++; }
+        else if(opt == "--frames" && val){ max_frames = std::atoi(val); i++; }
+        else if(opt == "--threads" && val){ thread_count = std::atoi(val); i++; }
+        else if(opt == "--seed" && val){ seed = (unsigned)std::strtoul(val,nullptr,10); i++; }
+        else filename = argv[i];
+    }
+    Autoplayer player(filename,beam_width,thread_count,seed);
+    if(!player.ok()){
+        SDL_Log("ステージを読み込めませんでした: %s", filename);
+        return 1;
+    }
+    Uint64 start = SDL_GetPerformanceCounter();
+    Autoplayer::Result r = player.run(max_frames);
+    double sec = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+    if(r.reached){
+        SDL_Log("%s: %d フレーム（%.2f 秒）でゴール, 再生 %s", filename, r.frames, (double)r.frames / FPS,
+                r.replay_ok ? "一致" : "不一致");
+    }
+    else{
+        SDL_Log("%s: ゴールに着けませんでした（%d 列目まで）", filename, r.best_col + 1);
+    }
+    SDL_Log("beam %d, %d threads: %lld ticks, %.3f s, %.0f ticks/s", beam_width, thread_count, r.ticks, sec, r.ticks / sec);
+    return (r.reached && r.replay_ok) ? 0 : 2;
+}
+
+//ファザーが毎フレーム確かめる決まりが破れたときの内容
+struct Violation{
+    enum Kind{
+        NONE,
+        NOT_FINITE,     //速度や位置がNaN・無限大
+        INSIDE_SOLID,   //固いタイルにめり込んでいる
+    };
+    Kind kind = NONE;
+    std::string message;
+};
+
+//rectが固いタイルにめり込んでいるか
+//着地などは1フレームだけ最大15px（落下の最高速度）めり込んでから押し戻されるので、それより内側の4隅と中心だけを見る
+bool is_inside_solid(const Stage& stage,const SDL_Rect& r){
+    const int max_step = 15;
+    int mx = std::min(max_step,r.w / 2 - 1);
+    int my = std::min(max_step,r.h / 2 - 1);
+    int x1 = r.x + mx, x2 = r.x + r.w - 1 - mx;
+    int y1 = r.y + my, y2 = r.y + r.h - 1 - my;
+    if(x2 < x1 || y2 < y1) return false;
+    return stage.is_solid_at_pixel(x1,y1) || stage.is_solid_at_pixel(x2,y1) ||
+           stage.is_solid_at_pixel(x1,y2) || stage.is_solid_at_pixel(x2,y2) ||
+           stage.is_solid_at_pixel((x1 + x2) / 2,(y1 + y2) / 2);
+}
+
+//世界の全員について決まりを確かめる（土管から出てくるパックンと、置いてあるだけのコインはめり込みを見ない）
+Violation check_invariants(const World& w){
+    Violation v;
+    char buf[160];
+    auto check = [&](const GameObject& o,const char* name,bool solid_check){
+        if(v.kind != Violation::NONE || !o.is_alive) return;
+        if(!std::isfinite(o.vx) || !std::isfinite(o.vy)){
+            v.kind = Violation::NOT_FINITE;
+            snprintf(buf,sizeof(buf),"%s の速度が有限でない (vx=%f vy=%f)",name,o.vx,o.vy);
+            v.message = buf;
+        }
+        else if(solid_check && is_inside_solid(w.stage,o.dstRect)){
+            v.kind = Violation::INSIDE_SOLID;
+            snprintf(buf,sizeof(buf),"%s が固いタイルにめり込んでいる (x=%d y=%d w=%d h=%d)",name,o.dstRect.x,o.dstRect.y,o.dstRect.w,o.dstRect.h);
+            v.message = buf;
+        }
+    };
+    check(w.mario,"マリオ",true);
+    for(const auto* e : w.enemies){
+        check(*e,"敵",dynamic_cast<const Flower*>(e) == nullptr);
+    }
+    for(const auto* it : w.items){
+        check(*it,"アイテム",dynamic_cast<const Coin*>(it) == nullptr);
+    }
+    for(const auto* f : w.fire_balls){
+        check(*f,"ファイアボール",true);
+    }
+    for(const auto* f : w.fires){
+        check(*f,"クッパの炎",false);
+    }
+    return v;
+}
+
+//乱数で作ったステージを乱数の入力でヘッドレスに動かし、毎フレーム決まりを確かめる
+//破れたら入力を減らしても同じ種類の違反が起きるところまで縮めて、再現手順として返す
+class PhysicsFuzzer{
+    public:
+        struct Report{
+            unsigned seed = 0;
+            int width = 0;
+            long long ticks = 0;        //進めたフレーム数（縮める途中の再生も含む）
+            int rejected = 0;           //ステージの外を指して弾かれた問い合わせ
+            bool failed = false;
+            int frame = -1;             //縮めた入力で違反が起きたフレーム
+            Violation violation;
+            std::vector<Action> inputs; //縮めた入力（違反が起きたフレームまで）
+        };
+
+        //seedからステージと入力を決めて1回動かす（同じseedなら同じ結果）
+        static Report run(unsigned seed,int frames,bool minimize){
+            Report report;
+            report.seed = seed;
+            std::mt19937 rng(seed);
+            StageGenerator::Params params;
+            params.seed = seed;
+            params.width = std::uniform_int_distribution<int>(StageGenerator::MIN_WIDTH,400)(rng);
+            params.enemy_density = std::uniform_real_distribution<double>(0.0,0.3)(rng);
+            params.item_density = std::uniform_real_distribution<double>(0.0,0.3)(rng);
+            params.water = std::uniform_real_distribution<double>(0.0,0.4)(rng);
+            params.lava = std::uniform_real_distribution<double>(0.0,0.1)(rng);
+            params.warps = std::uniform_int_distribution<int>(0,3)(rng);
+            report.width = params.width;
+
+            auto prepared = prepare_generated_stage(params);
+            if(!prepared->ok) return report;
+            World w(nullptr,seed);
+            w.enter(*prepared);
+            auto start = w.snapshot();
+
+            std::vector<Action> inputs = random_inputs(rng,frames);
+            int frame = replay(w,*start,inputs,report.violation,report.ticks);
+            report.rejected = w.stage.rejected_lookups;
+            if(frame < 0) return report;
+
+            report.failed = true;
+            inputs.resize(frame + 1);
+            if(minimize){
+                shrink(w,*start,inputs,report.violation.kind,report.ticks);
+                frame = replay(w,*start,inputs,report.violation,report.ticks);
+                inputs.resize(frame + 1);
+            }
+            report.frame = frame;
+            report.inputs = inputs;
+            return report;
+        }
+        //入力を「D+C×12 SPACE ...」のように続けて押した分をまとめて書く
+        static std::string describe(const std::vector<Action>& inputs){
+            std::string out;
+            for(size_t i = 0; i < inputs.size(); ){
+                size_t j = i;
+                while(j < inputs.size() && same(inputs[j],inputs[i])) j++;
+                std::string keys = keys_of(inputs[i]);
+                if(!out.empty()) out += ' ';
+                out += keys.empty() ? "-" : keys;
+                if(j - i > 1) out += "x" + std::to_string(j - i);
+                i = j;
+            }
+            return out;
+        }
+    private:
+        //押したまま数フレーム続ける入力を、ランダムな長さでつないでいく
+        static std::vector<Action> random_inputs(std::mt19937& rng,int frames){
+            std::uniform_int_distribution<int> d100(0,99);
+            std::uniform_int_distribution<int> hold(1,30);
+            std::vector<Action> inputs;
+            while((int)inputs.size() < frames){
+                Action a;
+                a.right = d100(rng) < 60;
+                a.left = !a.right && d100(rng) < 60;
+                a.run = d100(rng) < 50;
+                a.down = d100(rng) < 10;
+                int n = hold(rng);
+                for(int f = 0; f < n && (int)inputs.size() < frames; f++){
+                    Action b = a;
+                    b.jump = d100(rng) < 8;
+                    b.warp = b.down && d100(rng) < 20;
+                    b.fire = d100(rng) < 3;
+                    inputs.push_back(b);
+                }
+            }
+            return inputs;
+        }
+        //startから入力を流し、最初に決まりが破れたフレームを返す（破れなければ-1）
+        static int replay(World& w,const WorldSnapshot& start,const std::vector<Action>& inputs,Violation& v,long long& ticks){
+            w.restore(start);
+            w.stage.rejected_lookups = 0;
+            for(int f = 0; f < (int)inputs.size(); f++){
+                w.step(inputs[f]);
+                ticks++;
+                v = check_invariants(w);
+                if(v.kind != Violation::NONE) return f;
+                if(!w.mario.is_alive) break;
+            }
+            return -1;
+        }
+        //入力の区間を「何も押さない」に置き換えても同じ種類の違反が起きるなら置き換える（区間を半分ずつ細かくしていく）
+        static void shrink(World& w,const WorldSnapshot& start,std::vector<Action>& inputs,Violation::Kind kind,long long& ticks){
+            Violation v;
+            for(size_t chunk = inputs.size() / 2; chunk >= 1; chunk /= 2){
+                for(size_t begin = 0; begin < inputs.size(); begin += chunk){
+                    size_t end = std::min(inputs.size(),begin + chunk);
+                    bool any = false;
+                    for(size_t i = begin; i < end; i++) any |= !same(inputs[i],Action());
+                    if(!any) continue;
+                    std::vector<Action> trial = inputs;
+                    std::fill(trial.begin() + begin,trial.begin() + end,Action());
+                    int frame = replay(w,start,trial,v,ticks);
+                    if(frame >= 0 && v.kind == kind){
+                        trial.resize(frame + 1);
+                        inputs = trial;
+                    }
+                }
+            }
+        }
+        static bool same(const Action& a,const Action& b){
+            return a.left == b.left && a.right == b.right && a.run == b.run && a.down == b.down &&
+                   a.jump == b.jump && a.warp == b.warp && a.fire == b.fire;
+        }
+        static std::string keys_of(const Action& a){
+            std::string keys;
+            auto add = [&](bool on,const char* k){
+                if(!on) return;
+                if(!keys.empty()) keys += '+';
+                keys += k;
+            };
+            add(a.left,"A");
+            add(a.right,"D");
+            add(a.run,"C");
+            add(a.down && !a.warp,"M");
+            add(a.warp,"M!");
+            add(a.jump,"SPACE");
+            add(a.fire,"N");
+            return keys;
+        }
+};
+
+//./mario --fuzz [--runs N] [--frames F] [--threads T] [--seed S] [--no-shrink]
+//N個のステージ（seed, seed+1, ...）を並列に動かし、決まりが破れたものを縮めた入力つきで表示する
+int run_fuzzer(int argc,char* argv[]){
+    int runs = 256;
+    int frames = 3600;
+    int thread_count = (int)std::thread::hardware_concurrency();
+    unsigned seed = 1;
+    bool minimize = true;
+    for(int i = 2; i < argc; i++){
+        std::string opt = argv[i];
+        const char* val = (i + 1 < argc) ? argv[i + 1] : nullptr;
+        if(opt == "--runs" && val){ runs = std::atoi(val); i++; }
+        else if(opt == "--frames" && val){ frames = std::atoi(val); i++; }
+        else if(opt == "--threads" && val){ thread_count = std::atoi(val); i++; }
+        else if(opt == "--seed" && val){ seed = (unsigned)std::strtoul(val,nullptr,10); i++; }
+        else if(opt == "--no-shrink") minimize = false;
+        else{
+            SDL_Log("使い方: %s --fuzz [--runs N] [--frames F] [--threads T] [--seed S] [--no-shrink]", argv[0]);
+            return 1;
+        }
+    }
+    ThreadPool pool(thread_count);
+    std::vector<PhysicsFuzzer::Report> reports(std::max(runs,0));
+    Uint64 start = SDL_GetPerformanceCounter();
+    pool.parallel_for((int)reports.size(),[&](int i){
+        reports[i] = PhysicsFuzzer::run(seed + i,frames,minimize);
+    });
+    double sec = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+    long long ticks = 0;
+    long long rejected = 0;
+    int failures = 0;
+    for(const auto& r : reports){
+        ticks += r.ticks;
+        rejected += r.rejected;
+        if(!r.failed) continue;
+        failures++;
+        SDL_Log("seed %u (幅 %d): %d フレーム目 %s", r.seed, r.width, r.frame, r.violation.message.c_str());
+        SDL_Log("  入力: %s", PhysicsFuzzer::describe(r.inputs).c_str());
+    }
+    SDL_Log("%d runs, %d threads: 違反 %d 件, %lld ticks, %.3f s, %.0f ticks/min (範囲外の問い合わせ %lld 回)",
+            runs, thread_count, failures, ticks, sec, ticks / sec * 60, rejected);
+    return failures ? 2 : 0;
+}
+
+//書き手1つ・読み手1つだけで使う固定長のリングバッファ（ロックもメモリ確保もしない）
+template<class T,size_t N>
+class SpscQueue{
+    static_assert((N & (N - 1)) == 0,"N は2のべき乗");
+    public:
+        //いっぱいならfalse（捨てる）
+        bool push(const T& v){
+            size_t h = head.load(std::memory_order_relaxed);
+            if(h - tail.load(std::memory_order_acquire) == N) return false;
+            buf[h & (N - 1)] = v;
+            head.store(h + 1,std::memory_order_release);
+            return true;
+        }
+        bool pop(T& v){
+            size_t t = tail.load(std::memory_order_relaxed);
+            if(t == head.load(std::memory_order_acquire)) return false;
+            v = buf[t & (N - 1)];
+            tail.store(t + 1,std::memory_order_release);
+            return true;
+        }
+    private:
+        T buf[N];
+        alignas(64) std::atomic<size_t> head{0};
+        alignas(64) std::atomic<size_t> tail{0};
+};
+
+enum SoundId : Uint8{
+    SOUND_JUMP,
+    SOUND_COIN,
+    SOUND_STOMP,
+    SOUND_BUMP,
+    SOUND_BREAK,
+    SOUND_POWER_UP,
+    SOUND_FIREBALL,
+    SOUND_BOWSER_FIRE,
+    SOUND_DAMAGE,
+    SOUND_WARP,
+    SOUND_COUNT,
+};
+
+//効果音。PCMは起動時に全部作っておき、SDLのオーディオコールバックで混ぜる
+//ゲーム側（シミュレーションのスレッド）はplayでコマンドを積むだけ。コールバックの中ではロックもメモリ確保もしない
+class AudioEngine{
+    public:
+        static constexpr int RATE = 48000;
+        static constexpr int BUFFER_SAMPLES = 256;  //約5.3ms（鳴らしてから音が出るまでの遅れはほぼこれ1つ分）
+        static constexpr int MAX_VOICES = 48;
+
+        AudioEngine() = default;
+        AudioEngine(const AudioEngine&) = delete;
+        AudioEngine& operator=(const AudioEngine&) = delete;
+        ~AudioEngine(){
+            close();
+        }
+        //SDL_Quitより前に呼ぶ（その後だと閉じる相手がもうない）
+        void close(){
+            if(device) SDL_CloseAudioDevice(device);
+            device = 0;
+        }
+        bool open(){
+            build_samples();
+            SDL_AudioSpec want{};
+            want.freq = RATE;
+            want.format = AUDIO_S16SYS;
+            want.channels = 1;
+            want.samples = BUFFER_SAMPLES;
+            want.callback = &AudioEngine::callback;
+            want.userdata = this;
+            SDL_AudioSpec have;
+            device = SDL_OpenAudioDevice(nullptr,0,&want,&have,0);
+            if(!device){
+                SDL_Log("オーディオを開けません（音なしで続けます）: %s", SDL_GetError());
+                return false;
+            }
+            SDL_PauseAudioDevice(device,0);
+            return true;
+        }
+        void play(SoundId id,int volume = 255){
+            if(device) commands.push({id,(Uint8)volume});
+        }
+        //出来事に音を付ける
+        void subscribe(EventBus& bus){
+            bus.subscribe_all([this](const GameEvent& e){
+                switch(e.type){
+                    case EVENT_JUMP: play(SOUND_JUMP,160); break;
+                    case EVENT_COIN: play(SOUND_COIN); break;
+                    case EVENT_STOMP: case EVENT_KICK: play(SOUND_STOMP); break;
+                    case EVENT_ITEM_BOX: play(SOUND_BUMP); break;
+                    case EVENT_BLOCK_BROKEN: play(SOUND_BREAK); break;
+                    case EVENT_POWER_UP: play(SOUND_POWER_UP); break;
+                    case EVENT_FIREBALL: play(SOUND_FIREBALL,180); break;
+                    case EVENT_BOWSER_FIRE: play(SOUND_BOWSER_FIRE); break;
+                    case EVENT_DAMAGE: play(SOUND_DAMAGE); break;
+                    case EVENT_WARP: play(SOUND_WARP); break;
+                    default: break;
+                }
+            });
+        }
+    private:
+        struct Command{
+            SoundId id;
+            Uint8 volume;
+        };
+        struct Voice{
+            const Sint16* data = nullptr;  //nullptrなら空き
+            int length = 0;
+            int pos = 0;
+            int volume = 0;
+        };
+        static constexpr int MIX_CHUNK = 512;
+        std::vector<Sint16> samples[SOUND_COUNT];
+        Voice voices[MAX_VOICES];
+        Sint32 accum[MIX_CHUNK];
+        SpscQueue<Command,256> commands;
+        SDL_AudioDeviceID device = 0;
+
+        static void SDLCALL callback(void* userdata,Uint8* stream,int len){
+            static_cast<AudioEngine*>(userdata)->mix(reinterpret_cast<Sint16*>(stream),len / (int)sizeof(Sint16));
+        }
+        //オーディオのスレッドで呼ばれる
+        void mix(Sint16* out,int count){
+            Command c;
+            while(commands.pop(c)){
+                start_voice(c);
+            }
+            for(int done = 0; done < count; ){
+                int n = std::min(count - done,MIX_CHUNK);
+                std::fill(accum,accum + n,0);
+                for(Voice& v : voices){
+                    if(!v.data) continue;
+                    int k = std::min(n,v.length - v.pos);
+                    const Sint16* src = v.data + v.pos;
+                    for(int i = 0; i < k; i++) accum[i] += (src[i] * v.volume) >> 8;
+                    v.pos += k;
+                    if(v.pos >= v.length) v.data = nullptr;
+                }
+                for(int i = 0; i < n; i++){
+                    out[done + i] = (Sint16)std::max(-32768,std::min(32767,(int)accum[i]));
+                }
+                done += n;
+            }
+        }
+        //空いている声で鳴らす（全部使っていたら一番進んでいるものを止めて使う）
+        void start_voice(const Command& c){
+            const std::vector<Sint16>& pcm = samples[c.id];
+            if(pcm.empty()) return;
+            Voice* slot = nullptr;
+            for(Voice& v : voices){
+                if(!v.data){
+                    slot = &v;
+                    break;
+                }
+                if(!slot || v.pos > slot->pos) slot = &v;
+            }
+            slot->data = pcm.data();
+            slot->length = (int)pcm.size();
+            slot->pos = 0;
+            slot->volume = c.volume;
+        }
+
+        //周波数をf0からf1へ動かす音（squareなら矩形波、noiseならノイズ）。音量は最後に向けて下げる
+        static void tone(std::vector<Sint16>& out,float f0,float f1,float seconds,float amp,bool square = true,bool noise = false){
+            int n = (int)(seconds * RATE);
+            float phase = 0;
+            Uint32 rnd = 0x12345678u;
+            Sint16 held = 0;
+            for(int i = 0; i < n; i++){
+                float t = (float)i / n;
+                float f = f0 + (f1 - f0) * t;
+                float prev = phase;
+                phase += f / RATE;
+                phase -= (int)phase;
+                float v;
+                if(noise){
+                    //周波数ごとに値を取り直すノイズ
+                    if(phase < prev){
+                        rnd ^= rnd << 13; rnd ^= rnd >> 17; rnd ^= rnd << 5;
+                        held = (Sint16)(rnd & 0xffff);
+                    }
+                    v = held / 32768.0f;
+                }
+                else if(square){
+                    v = phase < 0.5f ? 1.0f : -1.0f;
+                }
+                else{
+                    v = phase < 0.5f ? phase * 4 - 1 : 3 - phase * 4;
+                }
+                float env = 1.0f - t;
+                out.push_back((Sint16)(v * env * amp * 32767));
+            }
+        }
+        void build_samples(){
+            const float A = 0.18f;  //何十音重なっても割れにくい大きさ
+            tone(samples[SOUND_JUMP],300,900,0.12f,A);
+            tone(samples[SOUND_COIN],988,988,0.06f,A);
+            tone(samples[SOUND_COIN],1319,1319,0.25f,A);
+            tone(samples[SOUND_STOMP],400,100,0.08f,A,false);
+            tone(samples[SOUND_BUMP],180,120,0.06f,A);
+            tone(samples[SOUND_BREAK],3000,800,0.2f,A,false,true);
+            const float notes[] = {523,659,784,1047,1319};
+            for(float f : notes) tone(samples[SOUND_POWER_UP],f,f,0.06f,A);
+            tone(samples[SOUND_FIREBALL],1200,500,0.06f,A);
+            tone(samples[SOUND_BOWSER_FIRE],2000,300,0.35f,A,false,true);
+            tone(samples[SOUND_DAMAGE],600,150,0.3f,A);
+            tone(samples[SOUND_WARP],200,60,0.4f,A,false);
+        }
+};
+
+//見た目だけの粒（ブロックの破片・踏みつけの土煙・ファイアボールの火花）
+//固定長のプールを配列ごとに持ち（SoA）、更新は単純なループなのでコンパイラがベクトル化できる
+//粒を出すときにメモリは確保しない。描画は三角形1つずつを積み、DrawListが1回で描く
+class ParticleSystem{
+    public:
+        static constexpr int CAPACITY = 1 << 17;
+        static constexpr float GRAVITY = 0.35f;
+        int stress = 0;  //これだけの数を出し続ける（--particles、負荷試験用）
+
+        ParticleSystem() : x(CAPACITY),y(CAPACITY),vx(CAPACITY),vy(CAPACITY),life(CAPACITY),color(CAPACITY){}
+        int size()const{ return count; }
+        void clear(){ count = 0; }
+
+        void subscribe(EventBus& bus){
+            bus.subscribe({EVENT_BLOCK_BROKEN,EVENT_STOMP,EVENT_FIREBALL_END},[this](const GameEvent& e){
+                float cx = (e.col + 0.5f) * Stage::TILE_SIZE;
+                float cy = (e.row + 0.5f) * Stage::TILE_SIZE;
+                if(e.type == EVENT_BLOCK_BROKEN) burst(cx,cy,32,4.0f,6.0f,50,{150,90,40,255});
+                if(e.type == EVENT_STOMP) burst(cx,cy,16,2.0f,2.0f,25,{230,230,230,255});
+                if(e.type == EVENT_FIREBALL_END) burst(cx,cy,12,3.0f,3.0f,20,{255,160,0,255});
+            });
+        }
+        //(cx,cy)から四方にn個。upだけ上向きに足す。framesは寿命
+        void burst(float cx,float cy,int n,float speed,float up,int frames,SDL_Color c){
+            for(int k = 0; k < n && count < CAPACITY; k++){
+                int i = count++;
+                x[i] = cx;
+                y[i] = cy;
+                vx[i] = (random01() * 2 - 1) * speed;
+                vy[i] = (random01() * 2 - 1) * speed - up * random01();
+                life[i] = frames * (0.5f + 0.5f * random01());
+                color[i] = c;
+            }
+        }
+        //負荷試験用に、(cx,cy)から噴き出してstress個を保つ
+        void fountain(float cx,float cy){
+            int want = std::min(stress,CAPACITY) - count;
+            if(want > 0) burst(cx,cy,std::min(want,stress / 30 + 1),3.0f,10.0f,60,{255,255,120,255});
+        }
+        //1フレーム進めて、寿命が尽きたものを詰める
+        void update(){
+            float* __restrict px = x.data();
+            float* __restrict py = y.data();
+            float* __restrict pvx = vx.data();
+            float* __restrict pvy = vy.data();
+            float* __restrict plife = life.data();
+            int n = count;
+            for(int i = 0; i < n; i++){
+                pvy[i] += GRAVITY;
+                px[i] += pvx[i];
+                py[i] += pvy[i];
+                plife[i] -= 1.0f;
+            }
+            int alive = 0;
+            for(int i = 0; i < n; i++){
+                if(plife[i] <= 0) continue;
+                if(alive != i){
+                    px[alive] = px[i];
+                    py[alive] = py[i];
+                    pvx[alive] = pvx[i];
+                    pvy[alive] = pvy[i];
+                    plife[alive] = plife[i];
+                    color[alive] = color[i];
+                }
+                alive++;
+            }
+            count = alive;
+        }
+        //画面に入っているものだけ三角形にする
+        void render(DrawList& out,int cameraX,int cameraY)const{
+            const float SIZE = 3.0f;
+            out.particles.reserve(count * 3);
+            for(int i = 0; i < count; i++){
+                float sx = x[i] - cameraX;
+                float sy = y[i] - cameraY;
+                if(sx < -SIZE || sy < -SIZE || sx > SCREEN_WIDTH || sy > SCREEN_HEIGHT) continue;
+                SDL_Color c = color[i];
+                c.a = (Uint8)std::min(255.0f,life[i] * 12);  //消える前に薄くする
+                out.particles.push_back({{sx,sy},c,{0,0}});
+                out.particles.push_back({{sx + SIZE,sy},c,{0,0}});
+                out.particles.push_back({{sx + SIZE * 0.5f,sy + SIZE},c,{0,0}});
+            }
+        }
+    private:
+        std::vector<float> x,y,vx,vy,life;
+        std::vector<SDL_Color> color;
+        int count = 0;
+        Uint32 rnd = 0x9e3779b9u;
+        //見た目だけなので世界の乱数は使わない（リプレイに影響しない）
+        float random01(){
+            rnd ^= rnd << 13;
+            rnd ^= rnd >> 17;
+            rnd ^= rnd << 5;
+            return (rnd >> 8) * (1.0f / 16777216.0f);
+        }
+};
+
+//HUD（コインの枚数などをウィンドウのタイトルに出す。タイトルを変えるのはメインスレッド）
+class Hud{
+    public:
+        void subscribe(EventBus& bus){
+            bus.subscribe({EVENT_COIN,EVENT_STOMP,EVENT_POWER_UP,EVENT_DAMAGE},[this](const GameEvent& e){
+                if(e.type == EVENT_COIN) coins++;
+                if(e.type == EVENT_STOMP) stomps++;
+                if(e.type == EVENT_POWER_UP) power_ups++;
+                if(e.type == EVENT_DAMAGE) damages++;
+                dirty = true;
+            });
+        }
+        //変わっていればtitleを書き換える
+        void write(std::string& title){
+            if(!dirty && !title.empty()) return;
+            char buf[128];
+            snprintf(buf,sizeof(buf),"My Mario  コイン %d  踏んだ敵 %d  パワーアップ %d  ダメージ %d",coins,stomps,power_ups,damages);
+            title = buf;
+            dirty = false;
+        }
+    private:
+        int coins = 0, stomps = 0, power_ups = 0, damages = 0;
+        bool dirty = true;
+};
+
+//出来事の種類ごとの件数（終了時に表示）
+class EventStats{
+    public:
+        void subscribe(EventBus& bus){
+            bus.subscribe_all([this](const GameEvent& e){ counts[e.type]++; });
+        }
+        void log()const{
+            static const char* NAMES[EVENT_TYPE_COUNT] = {"コイン","踏みつけ","甲羅キック","ブロック破壊","アイテムボックス","パワーアップ","ワープ","ダメージ","ジャンプ","ファイアボール","クッパの炎","ファイアボール消滅"};
+            for(int t = 0; t < EVENT_TYPE_COUNT; t++){
+                if(counts[t]) SDL_Log("  %s: %ld", NAMES[t], counts[t]);
+            }
+        }
+    private:
+        long counts[EVENT_TYPE_COUNT] = {};
+};
+
+//フレームのどこでどれだけ出来事が配られたか（終了時に表示）
+class EventProfiler{
+    public:
+        void subscribe(EventBus& bus){
+            bus.on_batch([this](const char* point,size_t count){
+                Point& p = points[point];
+                p.batches++;
+                p.events += (long)count;
+                p.largest = std::max(p.largest,(long)count);
+            });
+        }
+        void log()const{
+            for(const auto& p : points){
+                SDL_Log("  %s: %ld 回, %ld 件（最大 %ld 件）", p.first.c_str(), p.second.batches, p.second.events, p.second.largest);
+            }
+        }
+    private:
+        struct Point{
+            long batches = 0, events = 0, largest = 0;
+        };
+        std::map<std::string,Point> points;
+};
+
+//シミュレーションを別のスレッドで回す。メインスレッド（SDLの描画をするスレッド）は入力を渡し、
+//積み終わった前のフレームの描画リストを流す。リストは2枚あり、片方を描いている間にもう片方へ次のフレームを積む
+class FramePipeline{
+    public:
+        FramePipeline(std::function<void(const Action&,DrawList&)> frame)
+            :frame(std::move(frame)),worker([this]{ run(); }){}
+        ~FramePipeline(){
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                stop = true;
+            }
+            cv.notify_all();
+            worker.join();
+        }
+        FramePipeline(const FramePipeline&) = delete;
+        FramePipeline& operator=(const FramePipeline&) = delete;
+
+        //前のフレームを積み終わるのを待ってそのリストを返し、actionで次のフレームを始めさせる
+        //返したリストは次にexchangeを呼ぶまで書き換えられない
+        const DrawList& exchange(const Action& action){
+            std::unique_lock<std::mutex> lock(mtx);
+            cv.wait(lock,[this]{ return !busy; });
+            front ^= 1;
+            pending = action;
+            busy = true;
+            cv.notify_all();
+            return lists[front];
+        }
+    private:
+        void run(){
+            std::unique_lock<std::mutex> lock(mtx);
+            while(true){
+                cv.wait(lock,[this]{ return busy || stop; });
+                if(stop) return;
+                Action action = pending;
+                DrawList& back = lists[front ^ 1];
+                lock.unlock();
+                frame(action,back);
+                lock.lock();
+                busy = false;
+                cv.notify_all();
+            }
+        }
+
+        std::function<void(const Action&,DrawList&)> frame;
+        DrawList lists[2];
+        int front = 1;      //描画側が持っているリスト（もう片方にシミュレーションが積む）
+        Action pending;
+        bool busy = false;  //シミュレーションのスレッドがフレームを処理中
+        bool stop = false;
+        std::mutex mtx;
+        std::condition_variable cv;
+        std::thread worker; //最後に作る（他のメンバーができてから動き出す）
+};
+
+//キーボードとゲームパッドの入力。イベントが来たときだけ状態を変え、tickごとにActionを1つ作る
+//押した瞬間は回数で数えておくので、tickの間に押して離しても落ちない（2回押せば2tickに分けて渡す）
+class InputLayer{
+    public:
+        enum Button : Uint8{
+            BUTTON_LEFT,
+            BUTTON_RIGHT,
+            BUTTON_RUN,
+            BUTTON_DOWN,   //押した瞬間はワープ
+            BUTTON_JUMP,
+            BUTTON_FIRE,
+            BUTTON_RESTART,
+            BUTTON_COUNT,
+        };
+        static constexpr const char* NAMES[BUTTON_COUNT] = {"left","right","run","down","jump","fire","restart"};
+        static constexpr int MAX_PRESSES = 4;    //持ち越す押下の上限
+        static constexpr Sint16 DEAD_ZONE = 8000;  //スティックの遊び
+
+        InputLayer(){
+            key_map.fill(-1);
+            pad_map.fill(-1);
+            key_map[SDL_SCANCODE_A] = BUTTON_LEFT;
+            key_map[SDL_SCANCODE_D] = BUTTON_RIGHT;
+            key_map[SDL_SCANCODE_C] = BUTTON_RUN;
+            key_map[SDL_SCANCODE_M] = BUTTON_DOWN;
+            key_map[SDL_SCANCODE_SPACE] = BUTTON_JUMP;
+            key_map[SDL_SCANCODE_N] = BUTTON_FIRE;
+            key_map[SDL_SCANCODE_R] = BUTTON_RESTART;
+            pad_map[SDL_CONTROLLER_BUTTON_DPAD_LEFT] = BUTTON_LEFT;
+            pad_map[SDL_CONTROLLER_BUTTON_DPAD_RIGHT] = BUTTON_RIGHT;
+            pad_map[SDL_CONTROLLER_BUTTON_X] = BUTTON_RUN;
+            pad_map[SDL_CONTROLLER_BUTTON_DPAD_DOWN] = BUTTON_DOWN;
+            pad_map[SDL_CONTROLLER_BUTTON_A] = BUTTON_JUMP;
+            pad_map[SDL_CONTROLLER_BUTTON_B] = BUTTON_FIRE;
+            pad_map[SDL_CONTROLLER_BUTTON_BACK] = BUTTON_RESTART;
+        }
+        ~InputLayer(){
+            close_pads();
+        }
+        //SDL_Quitより前に呼ぶ（SDL_Quitが開いているゲームパッドを片付けてしまうので）
+        void close_pads(){
+            for(SDL_GameController* pad : pads) SDL_GameControllerClose(pad);
+            pads.clear();
+        }
+        InputLayer(const InputLayer&) = delete;
+        InputLayer& operator=(const InputLayer&) = delete;
+
+        //"jump=SPACE,K,pad:a" の形で割り当て直す（そのボタンの前の割り当ては消す）
+        bool rebind(const std::string& spec){
+            size_t eq = spec.find('=');
+            int button = -1;
+            for(int b = 0; b < BUTTON_COUNT; b++){
+                if(spec.compare(0,eq,NAMES[b]) == 0) button = b;
+            }
+            if(eq == std::string::npos || button < 0){
+                SDL_Log("割り当てられないボタンです: %s", spec.c_str());
+                return false;
+            }
+            std::vector<SDL_Scancode> keys;
+            std::vector<SDL_GameControllerButton> buttons;
+            size_t begin = eq + 1;
+            while(begin <= spec.size()){
+                size_t end = spec.find(',',begin);
+                if(end == std::string::npos) end = spec.size();
+                std::string name = spec.substr(begin,end - begin);
+                begin = end + 1;
+                if(name.empty()) continue;
+                if(name.compare(0,4,"pad:") == 0){
+                    SDL_GameControllerButton b = SDL_GameControllerGetButtonFromString(name.c_str() + 4);
+                    if(b == SDL_CONTROLLER_BUTTON_INVALID){
+                        SDL_Log("ゲームパッドのボタンがわかりません: %s", name.c_str());
+                        return false;
+                    }
+                    buttons.push_back(b);
+                }
+                else{
+                    SDL_Scancode k = SDL_GetScancodeFromName(name.c_str());
+                    if(k == SDL_SCANCODE_UNKNOWN){
+                        SDL_Log("キーがわかりません: %s", name.c_str());
+                        return false;
+                    }
+                    keys.push_back(k);
+                }
+            }
+            for(auto& b : key_map) if(b == button) b = -1;
+            for(auto& b : pad_map) if(b == button) b = -1;
+            for(SDL_Scancode k : keys) key_map[k] = (Sint8)button;
+            for(SDL_GameControllerButton b : buttons) pad_map[b] = (Sint8)button;
+            return true;
+        }
+        //いま押されているキーを読み込む（起動前から押していたキーはイベントが来ないので）
+        void sync_keyboard(){
+            int count = 0;
+            const Uint8* keys = SDL_GetKeyboardState(&count);
+            for(int k = 0; k < std::min(count,(int)SDL_NUM_SCANCODES); k++){
+                if(keys[k] && key_map[k] >= 0) held[key_map[k]]++;
+            }
+        }
+        void handle(const SDL_Event& e){
+            switch(e.type){
+                case SDL_KEYDOWN:
+                case SDL_KEYUP:
+                    if(e.key.repeat) return;
+                    if(e.key.keysym.scancode < 0 || e.key.keysym.scancode >= SDL_NUM_SCANCODES) return;
+                    if(key_map[e.key.keysym.scancode] >= 0){
+                        change(key_map[e.key.keysym.scancode],e.type == SDL_KEYDOWN,e.key.timestamp,held);
+                    }
+                    return;
+                case SDL_CONTROLLERBUTTONDOWN:
+                case SDL_CONTROLLERBUTTONUP:
+                    if(e.cbutton.button < SDL_CONTROLLER_BUTTON_MAX && pad_map[e.cbutton.button] >= 0){
+                        change(pad_map[e.cbutton.button],e.type == SDL_CONTROLLERBUTTONDOWN,e.cbutton.timestamp,held_pad);
+                    }
+                    return;
+                case SDL_CONTROLLERAXISMOTION:
+                    //左スティックの左右は十字キーと同じ扱い
+                    if(e.caxis.axis == SDL_CONTROLLER_AXIS_LEFTX){
+                        int dir = e.caxis.value < -DEAD_ZONE ? -1 : (e.caxis.value > DEAD_ZONE ? 1 : 0);
+                        if(dir == stick) return;
+                        if(stick != 0) change(stick < 0 ? BUTTON_LEFT : BUTTON_RIGHT,false,e.caxis.timestamp,held_pad);
+                        if(dir != 0) change(dir < 0 ? BUTTON_LEFT : BUTTON_RIGHT,true,e.caxis.timestamp,held_pad);
+                        stick = dir;
+                    }
+                    return;
+                case SDL_CONTROLLERDEVICEADDED:
+                    if(SDL_GameController* pad = SDL_GameControllerOpen(e.cdevice.which)) pads.push_back(pad);
+                    return;
+                case SDL_CONTROLLERDEVICEREMOVED:
+                    if(SDL_GameController* pad = SDL_GameControllerFromInstanceID(e.cdevice.which)){
+                        pads.erase(std::remove(pads.begin(),pads.end(),pad),pads.end());
+                        SDL_GameControllerClose(pad);
+                    }
+                    //押したまま抜けたボタンが残らないように
+                    held_pad.fill(0);
+                    stick = 0;
+                    return;
+            }
+        }
+        //このtickのAction。押している間のものは、前のtickから今までに一度でも押されていれば立てる
+        Action next_action(){
+            Action a;
+            a.left = active(BUTTON_LEFT);
+            a.right = active(BUTTON_RIGHT);
+            a.run = active(BUTTON_RUN);
+            a.down = active(BUTTON_DOWN);
+            a.jump = take(BUTTON_JUMP);
+            a.fire = take(BUTTON_FIRE);
+            a.warp = take(BUTTON_DOWN);
+            a.restart = take(BUTTON_RESTART);
+            tapped.fill(false);
+            //渡した押下のうち一番古いものから今までの時間
+            press_age = oldest ? SDL_GetTicks() - oldest : 0;
+            oldest = 0;
+            for(int b = 0; b < BUTTON_COUNT; b++){
+                if(presses[b] > 0) oldest = oldest ? std::min(oldest,pending_since[b]) : pending_since[b];
             }
-        
-            texture = SDL_CreateTextureFromSurface(renderer,surface);
-            SDL_FreeSurface(surface);
-            if (!texture) {
-                SDL_Log("SDL_CreateTextureFromSurface Error: %s", SDL_GetError());
-                return false;
+            return a;
+        }
+        //直前のnext_actionで渡した押下が、押されてから何ms待ったか（なければ0）
+        Uint32 last_press_age()const{ return press_age; }
+    private:
+        void change(int button,bool down,Uint32 timestamp,std::array<int,BUTTON_COUNT>& counts){
+            if(down){
+                counts[button]++;
+                tapped[button] = true;
+                if(presses[button] < MAX_PRESSES){
+                    if(presses[button] == 0) pending_since[button] = timestamp;
+                    presses[button]++;
+                    if(!oldest || timestamp < oldest) oldest = timestamp;
+                }
+            }
+            else if(counts[button] > 0){
+                counts[button]--;
             }
-
-            return true;
-        };
-        void render(SDL_Renderer* renderer,int cameraX,int cameraY){
-            if(texture){                
-                SDL_Rect Screen = dstRect;
-                Screen.x = dstRect.x - cameraX;
-                Screen.y = dstRect.y - cameraY;
-                SDL_RenderCopy(renderer,texture,NULL,&Screen);}
-        };
-    protected:
-        virtual void handle_vertical(const Stage* stage){
         }
-        virtual void handle_horizonal(const Stage* stage){
+        bool active(int button)const{
+            return held[button] > 0 || held_pad[button] > 0 || tapped[button];
+        }
+        bool take(int button){
+            if(presses[button] == 0) return false;
+            presses[button]--;
+            return true;
         }
+
+        std::array<Sint8,SDL_NUM_SCANCODES> key_map;
+        std::array<Sint8,SDL_CONTROLLER_BUTTON_MAX> pad_map;
+        std::array<int,BUTTON_COUNT> held{};      //押しているキーの数
+        std::array<int,BUTTON_COUNT> held_pad{};  //押しているゲームパッドのボタンの数
+        std::array<bool,BUTTON_COUNT> tapped{};   //前のtickから一度でも押された
+        std::array<int,BUTTON_COUNT> presses{};   //まだ渡していない押下の回数
+        std::array<Uint32,BUTTON_COUNT> pending_since{};
+        Uint32 oldest = 0;     //まだ渡していない押下のうち一番古い時刻（SDL_GetTicks）
+        Uint32 press_age = 0;
+        int stick = 0;
+        std::vector<SDL_GameController*> pads;
 };
 
-class Warp_Pipe : public Pipe{
+//フレームの間隔を1/FPS秒ちょうどに揃える（ミリ秒で丸めない）
+//OSのスリープは粗いので、締め切りの少し前まで眠って残りは回って待つ
+//入力を読んでから画面に出るまでの時間と、出した間隔のばらつきも測っておき、終了時に出す
+class FramePacer{
     public:
-        char pipe_anker;
-        bool can_in = true;
-        bool can_out = true;
-        Warp_Pipe* pair = nullptr;
-        void init(int bx,int by,int pipe_h,int pipe_w,bool ci,bool co,char pa){
-            Pipe::init(bx,by,pipe_h,pipe_w);
-            can_in = ci;
-            can_out = co;
-            pipe_anker = pa;
+        explicit FramePacer(int fps)
+            :freq(SDL_GetPerformanceFrequency()),period(freq / fps),spin(freq * SPIN_MS / 1000),next(SDL_GetPerformanceCounter()){}
+
+        //次のフレームの時刻まで待つ（1フレーム以上遅れていたら取り戻そうとせず、今から数え直す）
+        void wait(){
+            next += period;
+            Uint64 now = SDL_GetPerformanceCounter();
+            if(now > next + period){
+                next = now;
+                resets++;
+                return;
+            }
+            while(now + spin < next){
+                Uint32 ms = (Uint32)((next - now - spin) * 1000 / freq);
+                if(ms == 0) break;
+                SDL_Delay(ms);
+                now = SDL_GetPerformanceCounter();
+            }
+            while(now < next){
+                std::this_thread::yield();
+                now = SDL_GetPerformanceCounter();
+            }
+        }
+        //入力を読んだ（この入力のフレームは、パイプラインで1つ後のpresentedで画面に出る）
+        //press_age_msはそのフレームで渡した押下が、押されてから待った時間
+        void input_sampled(Uint32 press_age_ms = 0){
+            shown_sample = last_sample;
+            shown_press = last_press;
+            last_sample = SDL_GetPerformanceCounter();
+            last_press = press_age_ms ? last_sample - std::min<Uint64>(last_sample,(Uint64)press_age_ms * freq / 1000) : 0;
+        }
+        //SDL_RenderPresentが戻った
+        void presented(){
+            Uint64 now = SDL_GetPerformanceCounter();
+            if(last_present){
+                double ms = to_ms(now - last_present);
+                interval.add(ms);
+                if(ms > to_ms(period) * 1.5) missed++;
+            }
+            if(shown_sample) latency.add(to_ms(now - shown_sample));
+            if(shown_press) press_latency.add(to_ms(now - shown_press));
+            last_present = now;
+        }
+        void log()const{
+            SDL_Log("フレーム間隔: %lld 回, 平均 %.2fms, ばらつき(標準偏差) %.2fms, 最大 %.2fms, 落ちた %d 回, 数え直し %d 回",
+                interval.count,interval.mean(),interval.stddev(),interval.max,missed,resets);
+            SDL_Log("入力から表示まで: 平均 %.2fms, 最大 %.2fms",latency.mean(),latency.max);
+            if(press_latency.count){
+                SDL_Log("ボタンを押してから表示まで: %lld 回, 平均 %.2fms, 最大 %.2fms",press_latency.count,press_latency.mean(),press_latency.max);
+            }
         }
+    private:
+        static constexpr int SPIN_MS = 2;  //締め切りのこれだけ前からは眠らずに回る
+        struct Stat{
+            long long count = 0;
+            double sum = 0,sum2 = 0,max = 0;
+            void add(double v){
+                count++;
+                sum += v;
+                sum2 += v * v;
+                max = std::max(max,v);
+            }
+            double mean()const{ return count ? sum / count : 0; }
+            double stddev()const{ return count ? std::sqrt(std::max(0.0,sum2 / count - mean() * mean())) : 0; }
+        };
+        double to_ms(Uint64 t)const{ return t * 1000.0 / freq; }
+
+        Uint64 freq,period,spin;
+        Uint64 next;               //次のフレームの締め切り
+        Uint64 last_sample = 0;    //いま始めたフレームの入力を読んだ時刻
+        Uint64 shown_sample = 0;   //次に画面に出るフレームの入力を読んだ時刻
+        Uint64 last_press = 0;     //いま始めたフレームに渡した押下の時刻（なければ0）
+        Uint64 shown_press = 0;
+        Uint64 last_present = 0;
+        Stat interval,latency,press_latency;
+        int missed = 0;
+        int resets = 0;
 };
 
-Warp_Pipe* Mario::warp_point() {
-    int mario_center_x = dstRect.x + dstRect.w / 2;
-    int mario_foot_y   = dstRect.y + dstRect.h;
-
-    for (auto* wp : warp_pipes) {
-        int top   = wp->dstRect.y;
-        int left  = wp->dstRect.x;
-        int right = wp->dstRect.x + wp->dstRect.w;
-
-        bool x_inside   = (mario_center_x >= left && mario_center_x < right);
-        bool y_near_top = (abs(mario_foot_y - top) <= 2);
-
-        if (x_inside && y_near_top) {
-            return wp;
-        }
+int main(int argc,char* argv[]){
+    if(argc >= 2 && std::string(argv[1]) == "--gen"){
+        return run_stage_generator(argc,argv);
     }
-    return nullptr;
-}
-
-void Stage::hit_blocks(int px, int py, std::vector<item*>& items,SDL_Renderer* redenderer){
-    int col = px / TILE_SIZE;
-    int row = py / TILE_SIZE;
-
-    int worldX = col * TILE_SIZE;
-    int worldY = row * TILE_SIZE;
-
-    TileType t = tiles[row][col];
-    if(t == TILE_BLOCK){
-        tiles[row][col] = TILE_EMPTY;
+    if(argc >= 2 && std::string(argv[1]) == "--batch"){
+        return run_batch(argc,argv);
     }
-    else if(t == TILE_ITEMBOX){
-        ITEM_IN_BOX i = boxes[row][col];
-        if(i == BOX_COIN){
-            auto* c = new Coin();
-            c->init(worldX,worldY - TILE_SIZE);
-            c->load_texture(redenderer);
-            items.push_back(c);
+    if(argc >= 2 && std::string(argv[1]) == "--analyze"){
+        return run_analyzer(argc,argv);
+    }
+    if(argc >= 2 && std::string(argv[1]) == "--autoplay"){
+        return run_autoplay(argc,argv);
+    }
+    if(argc >= 2 && std::string(argv[1]) == "--fuzz"){
+        return run_fuzzer(argc,argv);
+    }
+    //./mario [--stream] [--watch] [--particles N] [--vsync] [--threads N] [--bind button=KEY,pad:BUTTON ...] [stage.map ...]
+    //ステージを複数並べると、ゴールに触れるたびに次のステージへ進む（最後の次は最初に戻る）
+    std::vector<std::string> stage_files;
+    bool use_stream = false;
+    bool use_watch = false;
+    int particle_stress = 0;
+    bool use_vsync = false;
+    int update_threads = 1;
+    std::vector<std::string> bindings;
+    for(int i = 1; i < argc; i++){
+        if(std::string(argv[i]) == "--stream"){
+            use_stream = true;
         }
-        else if(i == BOX_SUPERMASHROOM){
-            auto* c = new SuperMashroom();
-            c->init(worldX,worldY - TILE_SIZE);
-            c->load_texture(redenderer);
-            items.push_back(c);
+        else if(std::string(argv[i]) == "--watch"){
+            use_watch = true;
         }
-        else if(i == BOX_STAR){
-            auto* c = new Star();
-            c->init(worldX,worldY - TILE_SIZE);
-            c->load_texture(redenderer);
-            items.push_back(c);           
+        else if(std::string(argv[i]) == "--vsync"){
+            use_vsync = true;
         }
-        else if(i == BOX_FIREFLOWER){
-            auto* c = new FireFlower();
-            c->init(worldX,worldY - TILE_SIZE);
-            c->load_texture(redenderer);
-            items.push_back(c);           
+        else if(std::string(argv[i]) == "--bind" && i + 1 < argc){
+            bindings.push_back(argv[++i]);
+        }
+        else if(std::string(argv[i]) == "--particles" && i + 1 < argc){
+            particle_stress = atoi(argv[++i]);
+        }
+        else if(std::string(argv[i]) == "--threads" && i + 1 < argc){
+            update_threads = atoi(argv[++i]);
+        }
+        else{
+            stage_files.push_back(argv[i]);
         }
-        tiles[row][col] = TILE_BLOCK;
-    }
-}
-
-void Mario::try_warp(Stage* stage) {
-    float foot_y = dstRect.y + dstRect.h;
-    float left_x = dstRect.x;
-    float right_x = dstRect.x + dstRect.w;
-
-    bool foot_solidL = stage->is_solid_at_pixel(left_x,  foot_y + 1);
-    bool foot_solidR = stage->is_solid_at_pixel(right_x, foot_y + 1);
-    if (!(foot_solidL || foot_solidR)) {
-        return;
-    }
-
-    int pipeRow      = static_cast<int>(foot_y) / stage->TILE_SIZE;
-    int pipeColLeft  = static_cast<int>(left_x)  / stage->TILE_SIZE;
-    int pipeColRight = static_cast<int>(right_x) / stage->TILE_SIZE;
-
-    bool on_warp =
-        stage->get_pipetype(pipeRow, pipeColLeft)  == Stage::PIPE_WARP ||
-        stage->get_pipetype(pipeRow, pipeColRight) == Stage::PIPE_WARP;
-
-    if (!on_warp) {
-        return;
-    }
-
-    Warp_Pipe* wp = warp_point();
-    if (!wp) return;
-    if (!wp->can_in) return;
-
-    Warp_Pipe* next_wp = wp->pair;
-    if (!next_wp || !next_wp->can_out) return;
-
-    dstRect.x = next_wp->dstRect.x;
-    dstRect.y = next_wp->dstRect.y - dstRect.h;
-
-    stage->is_underground = !stage->is_underground;
-    if (stage->is_underground) {
-        cameraY = stage->start_underground_row * stage->TILE_SIZE;
-    } else {
-        cameraY = 0;
     }
-}
-
-void Mario::fire(SDL_Renderer* renderer){
-     if(state == Fire || (state == Star && prev_state == Fire)){
-        Fireball* f = new Fireball();
-        f->init(this);
-        f->load_texture(renderer);
-        fire_balls.push_back(f);  
-     }
-     else{
-        return;
-     }
-
-}
-
-void Bowser::fire(SDL_Renderer* renderer){
-    if(p_25){ 
-        Fire* f = new Fire();
-        f->init(this);
-        f->load_texture(renderer);
-        fires.push_back(f);  
-        p_25 = false;
+    if(stage_files.empty()){
+        stage_files.push_back("1-1.map");
     }
-}
-
-Mario mario;
-Goal goal;
-std::vector<item*> items;
-std::vector<Enemy*> enemies;
-std::vector<Pipe*> pipes;
-std::vector<Warp_Pipe*> warp_pipes;
-std::vector<Fireball*> fire_balls;
-std::vector<Fire*> fires;
-
-int main(){
     if (SDL_Init(SDL_INIT_VIDEO)  != 0){
         return 1;
     }
@@ -1927,7 +6586,8 @@ int main(){
         return 1;
     }
 
-    SDL_Renderer* renderer = SDL_CreateRenderer(window,-1,0);
+    //垂直同期するとSDL_RenderPresentが画面の切り替わりまで待つ（ティアリングなし。ゲームの速さはFramePacerが1/FPS秒に保つ）
+    SDL_Renderer* renderer = SDL_CreateRenderer(window,-1,use_vsync ? SDL_RENDERER_PRESENTVSYNC : 0);
     if (!renderer) {
         SDL_Log("SDL_CreateRenderer Error: %s", SDL_GetError());
         SDL_DestroyWindow(window);
@@ -1935,156 +6595,148 @@ int main(){
         return 1;
     }
 
-    Stage stage;
-    stage.initTileTable();
-    stage.load_stage("1-1.map");
-    //タイル情報から生成
-    for(int row = 0; row < stage.stageHeightInTiles(); row++){
-        for(int col = 0; col < stage.stageWidthInTiles(); col++){
-            if(stage.get_tiletype(row,col) == Stage::TILE_COIN){
-                int worldX = col * stage.TILE_SIZE;
-                int worldY = row * stage.TILE_SIZE;
+    IMG_Init(IMG_INIT_JPG | IMG_INIT_PNG);
+
+    size_t stage_index = 0;
+    std::string stage_file = stage_files[0];
+    auto game = std::make_unique<World>(renderer);
+    game->keep_baseline = true;
+    //敵・アイテムの移動を領域ごとに分けるスレッド（シミュレーションのスレッドも手伝う）
+    std::unique_ptr<ThreadPool> update_pool;
+    std::unique_ptr<WorkStealingScheduler> update_scheduler;
+    if(update_threads > 1){
+        update_pool = std::make_unique<ThreadPool>(update_threads);
+        update_scheduler = std::make_unique<WorkStealingScheduler>(*update_pool);
+        game->update_scheduler = update_scheduler.get();
+    }
+    {
+        //最初のステージだけはその場で読み込む
+        auto first = prepare_stage(stage_file,use_stream);
+        if(!first->ok){
+            SDL_DestroyRenderer(renderer);
+            SDL_DestroyWindow(window);
+            SDL_Quit();
+            return 1;
+        }
+        game->enter(*first);
+    }
+    //次のステージは遊んでいる間に裏で読み込んでおく
+    std::future<std::unique_ptr<PreparedStage>> next_stage =
+        std::async(std::launch::async,prepare_stage,stage_files[(stage_index + 1) % stage_files.size()],use_stream,true);
+
+    StageWatcher watcher;
+    if(use_watch){
+        if(use_stream){
+            SDL_Log("--watch は --stream と同時には使えません");
+            use_watch = false;
+        }
+        else{
+            use_watch = watcher.start(stage_file.c_str());
+        }
+    }
 
-                Coin* c = new Coin();
-                if(row <= stage.start_underground_row){
-                    c->is_underground = false;
-                }else{
-                    c->is_underground = true;
-                }
-                c->init(worldX,worldY);
-                c->load_texture(renderer);
-                items.push_back(c);      
-            }
-            else if(stage.get_tiletype(row,col) == Stage::TILE_ENEMY){
-                int worldX = col * stage.TILE_SIZE;
-                int worldY = row * stage.TILE_SIZE;
-                Enemy* e = nullptr;
-                auto kind = stage.get_enemytype(row,col);
-                if(kind == Stage::ENEMY_MASHROOM){
-                    e = new Mashroom();
-                    e->load_texture(renderer);
-                }
-                else if(kind == Stage::ENEMY_GREENTURTLE){
-                    e = new GreemTurtle();
-                    e->load_texture(renderer);          
-                }
-                else if(kind == Stage::ENEMY_FISH){
-                    e = new Fish();
-                    e->load_texture(renderer);          
-                }
-                else if(kind == Stage::ENEMY_BOWSER){
-                    e = new Bowser();
-                    e->load_texture(renderer);          
-                }
-                if(e){
-                    e->init(worldX,worldY);
-                    if(row <= stage.start_underground_row){
-                        e->is_underground = false;
-                    }else{
-                        e->is_underground = true;
-                    }
-                    enemies.push_back(e);   
-                } 
-                int ocean_count = 0;
-                int H = stage.stageHeightInTiles();
-                int W = stage.stageWidthInTiles();
-                
-                if (row > 0 && stage.get_tiletype(row-1, col) == Stage::TILE_OCEAN) ocean_count++;
-                if (row+1 < H && stage.get_tiletype(row+1, col) == Stage::TILE_OCEAN) ocean_count++;
-                if (col > 0 && stage.get_tiletype(row, col-1) == Stage::TILE_OCEAN) ocean_count++;
-                if (col+1 < W && stage.get_tiletype(row, col+1) == Stage::TILE_OCEAN) ocean_count++;
-                
-                if (ocean_count >= 2) {
-                    stage.change_tiles(row, col, Stage::TILE_OCEAN);
-                }
-            }
-            else if(stage.get_tiletype(row,col) == Stage::TILE_GOAL){
-                int worldX = col * stage.TILE_SIZE;
-                int worldY = row * stage.TILE_SIZE;
-                goal.init(worldX,worldY,&stage);
-                goal.load_texture(renderer);  
-            }
-            else if(stage.get_tiletype(row,col) == Stage::TILE_START){
-                int worldX = col * stage.TILE_SIZE;
-                int worldY = row * stage.TILE_SIZE;
-                mario.init(worldX,worldY);
-                mario.load_texture(renderer);  
-            }
-            else if(stage.get_tiletype(row,col) == Stage::TILE_PIPE){
-                //左か右がドカンならスキップ
-                bool left_is_pipe = (col > 0) &&
-                (stage.get_tiletype(row, col-1) == Stage::TILE_PIPE);
-                bool up_is_pipe = (row > 0) &&
-                    (stage.get_tiletype(row-1, col) == Stage::TILE_PIPE);
-            
-                if (left_is_pipe || up_is_pipe) continue;
-        
-                
-                int worldX = col * stage.TILE_SIZE;
-                int worldY = row * stage.TILE_SIZE;
-                //土管の大きさを取得
-                int pipe_h = 1;
-                while (row + pipe_h < stage.stageHeightInTiles() && stage.get_tiletype(row + pipe_h, col) == Stage::TILE_PIPE) {
-                    pipe_h++;
-                }
-                int pipe_w = 1;
-                while (col + pipe_w < stage.stageWidthInTiles() && stage.get_tiletype(row, col + pipe_w) == Stage::TILE_PIPE) {
-                    pipe_w++;
-                }
-                auto ptype = stage.get_pipetype(row,col);
-                if(ptype == Stage::PIPE_WARP){
-                    bool can_in = false;
-                    bool can_out = false;
-                    char anker;
-                    if(stage.raw_lines[row+1][col] == 'i'){
-                        can_in = true;
-                    }
-                    if(stage.raw_lines[row+1][col+1] == 'o'){
-                        can_out = true;
-                    }
-                    anker = stage.raw_lines[row][col+1];
-                    Warp_Pipe* pipe = new Warp_Pipe();
-                    pipe->init(worldX,worldY,pipe_h * stage.TILE_SIZE,pipe_w * stage.TILE_SIZE,can_in,can_out,anker);
-                    pipe->load_texture(renderer);
-                    pipes.push_back(pipe);
-                    warp_pipes.push_back(pipe);
+    //ゴールに触れたら裏で読み込んでおいた次のステージに入れ替える（シミュレーションのスレッドで呼ぶ）
+    std::atomic<bool> load_failed{false};
+    auto switch_stage = [&]{
+        //読み込みが終わっていなければここで待つ
+        std::unique_ptr<PreparedStage> next = next_stage.get();
+        if(!next->ok){
+            SDL_Log("次のステージを読み込めませんでした: %s", next->filename.c_str());
+            load_failed = true;
+            return;
+        }
+        stage_index = (stage_index + 1) % stage_files.size();
+        stage_file = next->filename;
+        game->enter(*next);
+        SDL_Log("ステージ %zu: %s", stage_index + 1, stage_file.c_str());
+        if(use_watch){
+            watcher.start(stage_file.c_str());
+        }
+        next_stage = std::async(std::launch::async,prepare_stage,stage_files[(stage_index + 1) % stage_files.size()],use_stream,true);
+    };
 
-                }
-                else{
-                    Pipe* pipe = new Pipe();
-                    pipe->init(worldX,worldY,pipe_h * stage.TILE_SIZE,pipe_w * stage.TILE_SIZE);
-                    pipe->load_texture(renderer);
-                    pipes.push_back(pipe);   
-                }
+    //今のステージを最初からやり直す（シミュレーションのスレッドで呼ぶ）
+    //ふつうは入った直後の写しに戻すだけ。写しがないときだけファイルを読み直す
+    auto restart_stage = [&]{
+        Uint64 begin = SDL_GetPerformanceCounter();
+        bool reloaded = false;
+        if(!game->restart()){
+            auto again = prepare_stage(stage_file,use_stream,false);
+            if(!again->ok){
+                SDL_Log("ステージを読み込み直せませんでした: %s", stage_file.c_str());
+                load_failed = true;
+                return;
             }
+            game->enter(*again);
+            reloaded = true;
         }
+        double ms = (SDL_GetPerformanceCounter() - begin) * 1000.0 / SDL_GetPerformanceFrequency();
+        SDL_Log("やり直し: %.2f ms%s", ms, reloaded ? "（読み込み直し）" : "");
+    };
+
+    //出来事の受け手（シミュレーションのスレッドで呼ばれる）
+    Hud hud;
+    EventStats stats;
+    EventProfiler profiler;
+    hud.subscribe(game->bus);
+    stats.subscribe(game->bus);
+    profiler.subscribe(game->bus);
+    ParticleSystem particles;
+    particles.stress = particle_stress;
+    particles.subscribe(game->bus);
+    //効果音（開けなければ音なし）
+    AudioEngine audio;
+    if(SDL_InitSubSystem(SDL_INIT_AUDIO) == 0 && audio.open()){
+        audio.subscribe(game->bus);
     }
 
-    std::unordered_map<char, Warp_Pipe*> anchor_map;
-    
-    for (auto* wp : warp_pipes) {
-        char a = wp->pipe_anker;
-        if (a == '\0') continue;
-        auto it = anchor_map.find(a);
-        if (it == anchor_map.end()) {
-            anchor_map[a] = wp;
-        } else {
-            Warp_Pipe* other = it->second;
-            wp->pair    = other;
-            other->pair = wp;
-            anchor_map.erase(it);
+    //シミュレーションを動かす前に、全部の画像をメインスレッドでテクスチャにしておく
+    texture_cache.upload_all(renderer);
+    //1フレーム分のシミュレーション。描画リストを積むところまで別のスレッドで行う
+    int lost_ticks = 0;  //やられてから経ったtick
+    auto pipeline = std::make_unique<FramePipeline>([&](const Action& action,DrawList& out){
+        if(load_failed) return;
+        if(use_watch && watcher.changed()){
+            game->hot_reload(stage_file.c_str());
         }
-    }
+        //やられたら少し見せてからやり直す
+        lost_ticks = game->is_lost() ? lost_ticks + 1 : 0;
+        if(action.restart || lost_ticks > RESTART_DELAY_TICKS){
+            restart_stage();
+            if(load_failed) return;
+            particles.clear();
+            lost_ticks = 0;
+        }
+        game->step(action);
+        if(game->goal.is_touch(game->mario.dstRect)){
+            switch_stage();
+            if(load_failed) return;
+        }
+        particles.update();
+        if(particles.stress > 0){
+            particles.fountain(game->mario.dstRect.x + game->mario.dstRect.w / 2.0f,game->mario.dstRect.y);
+        }
+        game->render(out);
+        particles.render(out,game->cameraX,game->cameraY);
+        hud.write(out.title);
+    });
 
     bool running = true;
     SDL_Event e;
+    std::string window_title;
+    FramePacer pacer(FPS);
+    //ゲームパッドは使えなければキーボードだけ（つながっているものも後から来るものもイベントで開く）
+    SDL_InitSubSystem(SDL_INIT_GAMECONTROLLER);
+    InputLayer input;
+    for(const std::string& spec : bindings){
+        input.rebind(spec);
+    }
+    input.sync_keyboard();
 
     while(running){
-        frameStart = SDL_GetTicks();
-        refresh_probabilities_each_second();
-        //キーの状態を取得
-        const Uint8* keys = SDL_GetKeyboardState(NULL);
-
+        //先に次のフレームの時刻まで待ち、入力はシミュレーションを始める直前に読む
+        pacer.wait();
+        //前のtickから溜まったイベントを反映して、このtickのActionを作る
         while(SDL_PollEvent(&e)){
             if(e.type == SDL_QUIT){
                 running = false;
@@ -2092,119 +6744,38 @@ int main(){
             if (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_ESCAPE) {
                 running = false;
             }
-            if(e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_SPACE){
-                mario.jump(&stage);
-                mario.wall_kick(&stage,keys);
-            }    
-            if(e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_m){
-                if (e.key.repeat == 0) {
-                    mario.try_warp(&stage);
-                }
-            }
-            if(e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_n){
-                if (e.key.repeat == 0) {
-                    mario.fire(renderer);
-                }
-            }
-        }
-
-
-        mario.update(&stage,renderer,items,keys);
-        for(auto* e : enemies){
-            e->update(&stage,renderer);
-            e->is_collision_mario(&mario,&stage);
-            for(auto* f : fire_balls){
-                e->is_collision_fireball(f);
-            }
-        }
-        for(auto* it : items){
-            it->update(&stage);
-            it->check_touch(&mario,&stage);
-        }
-        for (auto it = fire_balls.begin(); it != fire_balls.end(); ) {
-            Fireball* f = *it;
-            f->update(&stage);
-        
-            if (!f->is_alive) {
-                delete f;
-                it = fire_balls.erase(it);
-            } else {
-                ++it;
-            }
-        }
-        for (auto it = fires.begin(); it != fires.end();) {
-            Fire* f = *it;
-            f->update(&stage);
-            f->is_collision_mario(&mario,&stage);
-        
-            if (!f->is_alive) {
-                delete f;
-                it = fires.erase(it);
-            } else {
-                ++it;
-            }
-        }
-        // カメラをマリオに追従させる
-        cameraX = mario.dstRect.x + mario.dstRect.w/2 - SCREEN_WIDTH/2;
-
-        // ステージ範囲からはみ出ないようにクランプ
-        int stagePixelWidth = stage.stageWidthInTiles() * stage.TILE_SIZE;
-        if (cameraX < 0) cameraX = 0;
-        if (cameraX > stagePixelWidth - SCREEN_WIDTH)
-            cameraX = stagePixelWidth - SCREEN_WIDTH;
-        
-
-        SDL_SetRenderDrawColor(renderer,0,0,255,255);
-        SDL_RenderClear(renderer);
-        //レンダリング
-        stage.render(renderer,cameraX,cameraY);
-        goal.render(renderer,cameraX,cameraY);
-        mario.render(renderer,cameraX,cameraY);
-        for (auto* e : enemies){
-            e->render(renderer,cameraX,cameraY);
-        }
-        for (auto* it : items){
-            it->render(renderer,cameraX,cameraY);
+            input.handle(e);
         }
-        for (auto* p : pipes){
-            p->render(renderer,cameraX,cameraY);
+        const Action action = input.next_action();
+        pacer.input_sampled(input.last_press_age());
+
+        //このフレームのシミュレーションを始めさせ、その間に前のフレームを描く
+        const DrawList& frame = pipeline->exchange(action);
+        if(load_failed){
+            running = false;
+            break;
         }
-        for (auto* f : fire_balls){
-            f->render(renderer,cameraX,cameraY);
-        }
-        for (auto* f : fires){
-            f->render(renderer,cameraX,cameraY);
+        if(frame.title != window_title){
+            window_title = frame.title;
+            SDL_SetWindowTitle(window,window_title.c_str());
         }
+        frame.submit(renderer);
         SDL_RenderPresent(renderer);
-        //マリオを無敵状態から戻す
-        if(mario.state == Mario::Flash && SDL_GetTicks() >= mario.invincible){
-            mario.state = mario.prev_state;
-            mario.invincible = 0;
-        }
-        else if(mario.state == Mario::Star && SDL_GetTicks() >= mario.invincible){
-            mario.state = mario.prev_state;
-            mario.invincible = 0;         
-        }
-
-        frameTime = SDL_GetTicks() - frameStart;
-
-        if(frameDeray > frameTime){
-            SDL_Delay(frameDeray - frameTime);
-        }
+        pacer.presented();
     }
 
-    for (auto* it : items) {
-        delete it;
-    }
-    for (auto* e : enemies){
-        delete e;
-    }
-    for (auto* p : pipes){
-        delete p;
-    }
-    for (auto* f : fire_balls){
-        delete f;
-    }
+    //シミュレーションのスレッドを止めてから世界を片付ける
+    pipeline.reset();
+    SDL_Log("出来事:");
+    stats.log();
+    SDL_Log("配ったところ:");
+    profiler.log();
+    pacer.log();
+    if(update_scheduler) update_scheduler->log();
+    game.reset();
+    //SDLが持っているものはSDL_Quitの前に閉じる
+    input.close_pads();
+    audio.close();
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();